@@ -0,0 +1,200 @@
+#ifndef ANIM_H
+#define ANIM_H
+
+// Animation clips.
+//
+// Clips come from a small text file, one per line, and are loaded once and
+// shared read-only by every sprite that plays them:
+//
+//   # name      x   y    w   h   frames  s/frame...
+//   run_right   0   0    42  50  30      0.01
+//   blink       0   200  42  50  3       0.5 0.05 0.05
+//
+// The frames of a clip run left to right across the sheet from x,y. Give
+// one duration for all of them or one per frame, the last one repeating.
+//
+// A sprite only keeps an anim_state, which clip and how far into it. The
+// frame to draw is found from that time through each clip's running total
+// of durations, via a bucket table so it's a lookup however long the clip
+// is, and big steps land on the right frame instead of one further on.
+// Buckets are no longer than the clip's shortest frame, so a bucket
+// crosses at most one frame end and the lookup never walks further than
+// the next frame.
+
+#include <SDL/SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+struct sprite_frame {
+    SDL_Rect rect;
+    float duration; //s
+};
+
+// a clip with frames far shorter than it is long gets no more than this
+// and may walk a few frames
+const int ANIM_MAX_BUCKETS = 4096;
+
+struct anim_clip {
+    std::string name;
+    int first; // into the set's frames and ends
+    int count;
+    float length; // s, all frames
+    int first_bucket;
+    int num_buckets;
+    float bucket_rate; // buckets per s
+};
+
+struct anim_set {
+    std::vector<struct anim_clip> clips;
+    std::vector<struct sprite_frame> frames;
+    std::vector<float> ends; // time into its clip that each frame finishes
+    std::vector<Uint16> buckets; // first frame of its clip showing in each bucket
+};
+
+struct anim_state {
+    int clip;
+    float time; // s into the clip
+};
+
+inline void anim_add_clip( struct anim_set *set, const std::string &name, const std::vector<struct sprite_frame> &frames ) {
+    struct anim_clip clip;
+    clip.name = name;
+    clip.first = set->frames.size();
+    clip.count = frames.size();
+    float t = 0.0;
+    for( int i = 0; i < clip.count; i++ ) {
+        t += frames[ i ].duration;
+        set->frames.push_back( frames[ i ] );
+        set->ends.push_back( t );
+    }
+    clip.length = t;
+    clip.first_bucket = set->buckets.size();
+    float shortest = frames[ 0 ].duration;
+    for( int i = 1; i < clip.count; i++ ) {
+        shortest = std::min( shortest, frames[ i ].duration );
+    }
+    // one spare for rounding
+    clip.num_buckets = std::min( (int)ceilf( clip.length / shortest ) + 1, ANIM_MAX_BUCKETS );
+    clip.num_buckets = std::max( clip.num_buckets, clip.count );
+    clip.bucket_rate = clip.num_buckets / clip.length;
+    const float *ends = &set->ends[ clip.first ];
+    int f = 0;
+    for( int b = 0; b < clip.num_buckets; b++ ) {
+        float start = b / clip.bucket_rate;
+        while( f < clip.count - 1 && ends[ f ] <= start ) {
+            f++;
+        }
+        set->buckets.push_back( f );
+    }
+    set->clips.push_back( clip );
+}
+
+inline bool anim_load( struct anim_set *set, const char *filename ) {
+    FILE *f = fopen( filename, "r" );
+    if( f == NULL ) {
+        return false;
+    }
+    char line[ 512 ];
+    bool ok = true;
+    while( ok && fgets( line, sizeof( line ), f ) ) {
+        char *comment = strchr( line, '#' );
+        if( comment ) {
+            *comment = '\0';
+        }
+        char name[ 64 ];
+        int x, y, w, h, count, used = 0;
+        int n = sscanf( line, "%63s %i %i %i %i %i%n", name, &x, &y, &w, &h, &count, &used );
+        if( n <= 0 ) {
+            // blank
+            continue;
+        }
+        if( n != 6 || w <= 0 || h <= 0 || count <= 0 || count > 0xffff ) {
+            ok = false;
+            break;
+        }
+        std::vector<struct sprite_frame> frames;
+        const char *p = line + used;
+        float duration = 0.0;
+        for( int i = 0; i < count; i++ ) {
+            char *end;
+            float d = strtof( p, &end );
+            if( end != p ) {
+                duration = d;
+                p = end;
+            }
+            if( duration <= 0.0 ) {
+                ok = false;
+                break;
+            }
+            struct sprite_frame frame = { { (Sint16)( x + i * w ), (Sint16)y, (Uint16)w, (Uint16)h }, duration };
+            frames.push_back( frame );
+        }
+        if( ok ) {
+            anim_add_clip( set, name, frames );
+        }
+    }
+    fclose( f );
+    return ok && !set->clips.empty();
+}
+
+// loaded the first time it's asked for and kept for the life of the
+// program, NULL if it can't be read
+inline const struct anim_set *anim_get( const std::string &filename ) {
+    static std::map<std::string, struct anim_set> sets;
+    std::map<std::string, struct anim_set>::iterator it = sets.find( filename );
+    if( it != sets.end() ) {
+        return &it->second;
+    }
+    struct anim_set set;
+    if( !anim_load( &set, filename.c_str() ) ) {
+        return NULL;
+    }
+    return &( sets[ filename ] = set );
+}
+
+// clip id by name, -1 if there isn't one
+inline int anim_find( const struct anim_set *set, const char *name ) {
+    for( int i = 0; i < (int)set->clips.size(); i++ ) {
+        if( set->clips[ i ].name == name ) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// switch clips, starting from the top unless it's already playing
+inline void anim_play( struct anim_state *s, int clip ) {
+    if( s->clip != clip ) {
+        s->clip = clip;
+        s->time = 0.0;
+    }
+}
+
+// clips loop
+inline void anim_advance( const struct anim_set *set, struct anim_state *s, float dt ) {
+    float length = set->clips[ s->clip ].length;
+    s->time += dt;
+    if( s->time >= length ) {
+        s->time = fmodf( s->time, length );
+    }
+}
+
+inline const struct sprite_frame *anim_sample( const struct anim_set *set, const struct anim_state *s ) {
+    const struct anim_clip *clip = &set->clips[ s->clip ];
+    int b = std::min( (int)( s->time * clip->bucket_rate ), clip->num_buckets - 1 );
+    int f = set->buckets[ clip->first_bucket + b ];
+    // a bucket can start partway through a short frame
+    const float *ends = &set->ends[ clip->first ];
+    while( f < clip->count - 1 && s->time >= ends[ f ] ) {
+        f++;
+    }
+    return &set->frames[ clip->first + f ];
+}
+
+#endif
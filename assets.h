@@ -0,0 +1,93 @@
+#ifndef ASSETS_H
+#define ASSETS_H
+
+// Shared images.
+//
+// asset_acquire() decodes a file the first time it's asked for and hands
+// the same surface to everyone after that, counting users; asset_release()
+// frees it once the last one lets go. Files are keyed by their canonical
+// path (plus colour key) so "./player_2.png" and "player_2.png" share.
+//
+//   sprite_sheet = asset_acquire( "player_2.png" );
+//   ...
+//   asset_release( sprite_sheet );
+
+#include <SDL/SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string>
+#include <map>
+
+#include "image.h"
+#include "trace.h"
+
+struct asset {
+    SDL_Surface *surface;
+    int refs;
+    int bytes;
+    int path; // IMAGE_ import path it took
+};
+
+struct asset_cache {
+    std::map<std::string, struct asset> assets;
+    std::map<SDL_Surface *, std::string> keys; // back from a surface to its entry
+    int bytes; // held by all live assets
+};
+
+inline struct asset_cache *asset_get_cache() {
+    static struct asset_cache cache;
+    return &cache;
+}
+
+inline std::string asset_key( const std::string &filename, Uint32 colour_key ) {
+    char resolved[ PATH_MAX ];
+    std::string key = realpath( filename.c_str(), resolved ) ? resolved : filename;
+    if( colour_key != IMAGE_NO_KEY ) {
+        char suffix[ 16 ];
+        snprintf( suffix, sizeof( suffix ), "#%06x", colour_key );
+        key += suffix;
+    }
+    return key;
+}
+
+inline SDL_Surface *asset_acquire( const std::string &filename, Uint32 colour_key = IMAGE_NO_KEY ) {
+    struct asset_cache *cache = asset_get_cache();
+    std::string key = asset_key( filename, colour_key );
+    std::map<std::string, struct asset>::iterator it = cache->assets.find( key );
+    if( it != cache->assets.end() ) {
+        it->second.refs++;
+        return it->second.surface;
+    }
+    struct asset a;
+    a.surface = load_image( filename, colour_key, &a.path );
+    if( a.surface == NULL ) {
+        return NULL;
+    }
+    a.refs = 1;
+    a.bytes = a.surface->pitch * a.surface->h;
+    cache->assets[ key ] = a;
+    cache->keys[ a.surface ] = key;
+    cache->bytes += a.bytes;
+    TRACE( TRACE_INFO, TRACE_RENDER, "asset loaded, %i bytes, %i held", a.bytes, cache->bytes );
+    return a.surface;
+}
+
+inline void asset_release( SDL_Surface *surface ) {
+    struct asset_cache *cache = asset_get_cache();
+    std::map<SDL_Surface *, std::string>::iterator k = cache->keys.find( surface );
+    if( k == cache->keys.end() ) {
+        return;
+    }
+    std::map<std::string, struct asset>::iterator it = cache->assets.find( k->second );
+    if( --it->second.refs > 0 ) {
+        return;
+    }
+    cache->bytes -= it->second.bytes;
+    TRACE( TRACE_INFO, TRACE_RENDER, "asset freed, %i bytes, %i held", it->second.bytes, cache->bytes );
+    SDL_FreeSurface( surface );
+    cache->assets.erase( it );
+    cache->keys.erase( k );
+}
+
+#endif
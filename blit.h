@@ -0,0 +1,344 @@
+#ifndef BLIT_H
+#define BLIT_H
+
+// Our own blits, for the few cases we actually draw.
+//
+// Everything the games draw is a 32 bit surface going to a 32 bit surface
+// in the same channel order, as one of:
+//
+//   copy    opaque, straight copy
+//   key     colour keyed, pixels matching the key are skipped
+//   blend   per-pixel alpha in the top byte, blended over the destination
+//
+// For those blit_surface() runs its own row kernels, picked once at
+// startup for the best the CPU has (AVX2, SSE2, plain C), and leaves
+// anything else to SDL_BlitSurface. That saves SDL's per-call setup and
+// its generic colour key and alpha handling, which is most of the cost of
+// a 32x32 tile. blitbench compares the two.
+//
+// The kernels only read the source and only write the destination rect,
+// so several threads can blit from one surface at once as long as their
+// destination rects don't overlap, which SDL can't promise: it rewrites
+// per-source state whenever a surface is blitted to a new destination.
+// Surfaces need to be locked (if SDL_MUSTLOCK) around blit_rect(), which
+// also turns RLE surfaces back into plain pixels; blit_surface() falls
+// back to SDL rather than lock.
+
+#include <SDL/SDL.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <immintrin.h>
+#define BLIT_X86 1
+#endif
+
+enum { BLIT_SDL, BLIT_SCALAR, BLIT_SSE2, BLIT_AVX2, BLIT_NUM_LEVELS };
+const char *const BLIT_LEVEL_NAMES[ BLIT_NUM_LEVELS ] = { "sdl", "scalar", "sse2", "avx2" };
+
+enum { BLIT_NONE, BLIT_COPY, BLIT_KEY, BLIT_BLEND };
+
+const Uint32 BLIT_ALPHA_MASK = 0xff000000;
+
+struct blit_kernels {
+    void (*copy)( const Uint32 *s, Uint32 *d, int n );
+    void (*key)( const Uint32 *s, Uint32 *d, int n, Uint32 rgb, Uint32 key );
+    void (*blend)( const Uint32 *s, Uint32 *d, int n );
+};
+
+// ********** scalar **********
+
+inline void blit_copy_scalar( const Uint32 *s, Uint32 *d, int n ) {
+    memcpy( d, s, n * 4 );
+}
+
+inline void blit_key_scalar( const Uint32 *s, Uint32 *d, int n, Uint32 rgb, Uint32 key ) {
+    for( int x = 0; x < n; x++ ) {
+        if( ( s[ x ] & rgb ) != key ) {
+            d[ x ] = s[ x ];
+        }
+    }
+}
+
+// c = ( s * a + d * ( 255 - a ) ) / 255, rounded, per channel
+inline void blit_blend_scalar( const Uint32 *s, Uint32 *d, int n ) {
+    for( int x = 0; x < n; x++ ) {
+        Uint32 a = s[ x ] >> 24;
+        if( a == 0 ) {
+            continue;
+        }
+        if( a == 255 ) {
+            d[ x ] = s[ x ];
+            continue;
+        }
+        Uint32 out = 0;
+        for( int shift = 0; shift < 32; shift += 8 ) {
+            Uint32 c = ( ( s[ x ] >> shift ) & 0xff ) * a + ( ( d[ x ] >> shift ) & 0xff ) * ( 255 - a ) + 128;
+            out |= ( ( c + ( c >> 8 ) ) >> 8 ) << shift;
+        }
+        d[ x ] = out;
+    }
+}
+
+#ifdef BLIT_X86
+
+// ********** SSE2, 4 pixels at a time **********
+
+__attribute__(( target( "sse2" ) ))
+inline void blit_copy_sse2( const Uint32 *s, Uint32 *d, int n ) {
+    int x = 0;
+    for( ; x + 4 <= n; x += 4 ) {
+        _mm_storeu_si128( (__m128i *)( d + x ), _mm_loadu_si128( (const __m128i *)( s + x ) ) );
+    }
+    blit_copy_scalar( s + x, d + x, n - x );
+}
+
+__attribute__(( target( "sse2" ) ))
+inline void blit_key_sse2( const Uint32 *s, Uint32 *d, int n, Uint32 rgb, Uint32 key ) {
+    const __m128i vrgb = _mm_set1_epi32( rgb );
+    const __m128i vkey = _mm_set1_epi32( key );
+    int x = 0;
+    for( ; x + 4 <= n; x += 4 ) {
+        __m128i src = _mm_loadu_si128( (const __m128i *)( s + x ) );
+        __m128i dst = _mm_loadu_si128( (const __m128i *)( d + x ) );
+        __m128i keep = _mm_cmpeq_epi32( _mm_and_si128( src, vrgb ), vkey );
+        dst = _mm_or_si128( _mm_and_si128( keep, dst ), _mm_andnot_si128( keep, src ) );
+        _mm_storeu_si128( (__m128i *)( d + x ), dst );
+    }
+    blit_key_scalar( s + x, d + x, n - x, rgb, key );
+}
+
+// two pixels widened to 16 bits a channel, same sum as the scalar one
+__attribute__(( target( "sse2" ) ))
+inline __m128i blit_blend2_sse2( __m128i s, __m128i d, __m128i a ) {
+    const __m128i v255 = _mm_set1_epi16( 255 );
+    const __m128i v128 = _mm_set1_epi16( 128 );
+    __m128i c = _mm_add_epi16( _mm_mullo_epi16( s, a ), _mm_mullo_epi16( d, _mm_sub_epi16( v255, a ) ) );
+    c = _mm_add_epi16( c, v128 );
+    return _mm_srli_epi16( _mm_add_epi16( c, _mm_srli_epi16( c, 8 ) ), 8 );
+}
+
+__attribute__(( target( "sse2" ) ))
+inline void blit_blend_sse2( const Uint32 *s, Uint32 *d, int n ) {
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+    for( ; x + 4 <= n; x += 4 ) {
+        __m128i src = _mm_loadu_si128( (const __m128i *)( s + x ) );
+        __m128i dst = _mm_loadu_si128( (const __m128i *)( d + x ) );
+        // alpha of each pixel in all four of its 16 bit channels
+        __m128i a = _mm_srli_epi32( src, 24 );
+        a = _mm_or_si128( a, _mm_slli_epi32( a, 16 ) );
+        __m128i alo = _mm_unpacklo_epi32( a, a );
+        __m128i ahi = _mm_unpackhi_epi32( a, a );
+        __m128i lo = blit_blend2_sse2( _mm_unpacklo_epi8( src, zero ), _mm_unpacklo_epi8( dst, zero ), alo );
+        __m128i hi = blit_blend2_sse2( _mm_unpackhi_epi8( src, zero ), _mm_unpackhi_epi8( dst, zero ), ahi );
+        _mm_storeu_si128( (__m128i *)( d + x ), _mm_packus_epi16( lo, hi ) );
+    }
+    blit_blend_scalar( s + x, d + x, n - x );
+}
+
+// ********** AVX2, 8 pixels at a time **********
+//
+// the unpacks and packs work within each 128 bit half, so this is the
+// SSE2 code twice over
+
+__attribute__(( target( "avx2" ) ))
+inline void blit_copy_avx2( const Uint32 *s, Uint32 *d, int n ) {
+    int x = 0;
+    for( ; x + 8 <= n; x += 8 ) {
+        _mm256_storeu_si256( (__m256i *)( d + x ), _mm256_loadu_si256( (const __m256i *)( s + x ) ) );
+    }
+    blit_copy_sse2( s + x, d + x, n - x );
+}
+
+__attribute__(( target( "avx2" ) ))
+inline void blit_key_avx2( const Uint32 *s, Uint32 *d, int n, Uint32 rgb, Uint32 key ) {
+    const __m256i vrgb = _mm256_set1_epi32( rgb );
+    const __m256i vkey = _mm256_set1_epi32( key );
+    int x = 0;
+    for( ; x + 8 <= n; x += 8 ) {
+        __m256i src = _mm256_loadu_si256( (const __m256i *)( s + x ) );
+        __m256i dst = _mm256_loadu_si256( (const __m256i *)( d + x ) );
+        __m256i keep = _mm256_cmpeq_epi32( _mm256_and_si256( src, vrgb ), vkey );
+        _mm256_storeu_si256( (__m256i *)( d + x ), _mm256_blendv_epi8( src, dst, keep ) );
+    }
+    blit_key_sse2( s + x, d + x, n - x, rgb, key );
+}
+
+__attribute__(( target( "avx2" ) ))
+inline __m256i blit_blend2_avx2( __m256i s, __m256i d, __m256i a ) {
+    const __m256i v255 = _mm256_set1_epi16( 255 );
+    const __m256i v128 = _mm256_set1_epi16( 128 );
+    __m256i c = _mm256_add_epi16( _mm256_mullo_epi16( s, a ), _mm256_mullo_epi16( d, _mm256_sub_epi16( v255, a ) ) );
+    c = _mm256_add_epi16( c, v128 );
+    return _mm256_srli_epi16( _mm256_add_epi16( c, _mm256_srli_epi16( c, 8 ) ), 8 );
+}
+
+__attribute__(( target( "avx2" ) ))
+inline void blit_blend_avx2( const Uint32 *s, Uint32 *d, int n ) {
+    const __m256i zero = _mm256_setzero_si256();
+    int x = 0;
+    for( ; x + 8 <= n; x += 8 ) {
+        __m256i src = _mm256_loadu_si256( (const __m256i *)( s + x ) );
+        __m256i dst = _mm256_loadu_si256( (const __m256i *)( d + x ) );
+        __m256i a = _mm256_srli_epi32( src, 24 );
+        a = _mm256_or_si256( a, _mm256_slli_epi32( a, 16 ) );
+        __m256i alo = _mm256_unpacklo_epi32( a, a );
+        __m256i ahi = _mm256_unpackhi_epi32( a, a );
+        __m256i lo = blit_blend2_avx2( _mm256_unpacklo_epi8( src, zero ), _mm256_unpacklo_epi8( dst, zero ), alo );
+        __m256i hi = blit_blend2_avx2( _mm256_unpackhi_epi8( src, zero ), _mm256_unpackhi_epi8( dst, zero ), ahi );
+        _mm256_storeu_si256( (__m256i *)( d + x ), _mm256_packus_epi16( lo, hi ) );
+    }
+    blit_blend_sse2( s + x, d + x, n - x );
+}
+
+#endif
+
+// ********** dispatch **********
+
+inline const struct blit_kernels *blit_kernels_for( int level ) {
+    static const struct blit_kernels kernels[ BLIT_NUM_LEVELS ] = {
+        { blit_copy_scalar, blit_key_scalar, blit_blend_scalar }, // BLIT_SDL, for blit_rect
+        { blit_copy_scalar, blit_key_scalar, blit_blend_scalar },
+#ifdef BLIT_X86
+        { blit_copy_sse2, blit_key_sse2, blit_blend_sse2 },
+        { blit_copy_avx2, blit_key_avx2, blit_blend_avx2 },
+#else
+        { blit_copy_scalar, blit_key_scalar, blit_blend_scalar },
+        { blit_copy_scalar, blit_key_scalar, blit_blend_scalar },
+#endif
+    };
+    return &kernels[ level ];
+}
+
+inline int blit_best_level() {
+#ifdef BLIT_X86
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports( "avx2" ) ) {
+        return BLIT_AVX2;
+    }
+    if( __builtin_cpu_supports( "sse2" ) ) {
+        return BLIT_SSE2;
+    }
+#endif
+    // SDL's own RLE blits beat plain C ones
+    return BLIT_SDL;
+}
+
+// the level blit_surface() uses, the best there is unless set otherwise
+inline int *blit_level_setting() {
+    static int level = blit_best_level();
+    return &level;
+}
+
+inline int blit_level() {
+    return *blit_level_setting();
+}
+
+inline void blit_set_level( int level ) {
+    *blit_level_setting() = level;
+}
+
+// which kernel, if any, can take src to dst
+inline int blit_kind( const SDL_Surface *src, const SDL_Surface *dst ) {
+    const SDL_PixelFormat *s = src->format;
+    const SDL_PixelFormat *d = dst->format;
+    if(
+        s->BytesPerPixel != 4 || d->BytesPerPixel != 4 ||
+        s->Rmask != d->Rmask || s->Gmask != d->Gmask || s->Bmask != d->Bmask
+    ) {
+        return BLIT_NONE;
+    }
+    if( src->flags & SDL_SRCALPHA ) {
+        // per-pixel alpha only, not a surface-wide one
+        return s->Amask == BLIT_ALPHA_MASK && s->alpha == SDL_ALPHA_OPAQUE ? BLIT_BLEND : BLIT_NONE;
+    }
+    return src->flags & SDL_SRCCOLORKEY ? BLIT_KEY : BLIT_COPY;
+}
+
+// blit sr (NULL for all) of src to dx,dy in dst with the kernels for
+// level, clipped like SDL_BlitSurface. Returns false and draws nothing if
+// there's no kernel for the pair. Pixels must be accessible.
+inline bool blit_rect( SDL_Surface *src, const SDL_Rect *sr, SDL_Surface *dst, int dx, int dy, int level ) {
+    int kind = blit_kind( src, dst );
+    if( kind == BLIT_NONE ) {
+        return false;
+    }
+    int sx = 0;
+    int sy = 0;
+    int w = src->w;
+    int h = src->h;
+    if( sr ) {
+        sx = sr->x;
+        sy = sr->y;
+        w = sr->w;
+        h = sr->h;
+    }
+    // source rect to the source, then the destination to its clip rect
+    if( sx < 0 ) {
+        w += sx;
+        dx -= sx;
+        sx = 0;
+    }
+    if( sy < 0 ) {
+        h += sy;
+        dy -= sy;
+        sy = 0;
+    }
+    w = std::min( w, src->w - sx );
+    h = std::min( h, src->h - sy );
+    const SDL_Rect *clip = &dst->clip_rect;
+    if( dx < clip->x ) {
+        sx += clip->x - dx;
+        w -= clip->x - dx;
+        dx = clip->x;
+    }
+    if( dy < clip->y ) {
+        sy += clip->y - dy;
+        h -= clip->y - dy;
+        dy = clip->y;
+    }
+    w = std::min( w, clip->x + clip->w - dx );
+    h = std::min( h, clip->y + clip->h - dy );
+    if( w <= 0 || h <= 0 ) {
+        return true;
+    }
+
+    const struct blit_kernels *k = blit_kernels_for( level );
+    const SDL_PixelFormat *fmt = src->format;
+    Uint32 rgb = fmt->Rmask | fmt->Gmask | fmt->Bmask;
+    Uint32 key = fmt->colorkey & rgb;
+    for( int y = 0; y < h; y++ ) {
+        const Uint32 *s = (const Uint32 *)( (const Uint8 *)src->pixels + ( sy + y ) * src->pitch ) + sx;
+        Uint32 *d = (Uint32 *)( (Uint8 *)dst->pixels + ( dy + y ) * dst->pitch ) + dx;
+        if( kind == BLIT_COPY ) {
+            k->copy( s, d, w );
+        } else if( kind == BLIT_KEY ) {
+            k->key( s, d, w, rgb, key );
+        } else {
+            k->blend( s, d, w );
+        }
+    }
+    return true;
+}
+
+// what the apply_ helpers call: our kernels when they can do it without
+// locking anything, SDL otherwise
+inline void blit_surface( SDL_Surface *src, SDL_Rect *sr, SDL_Surface *dst, int dx, int dy ) {
+    int level = blit_level();
+    if( level != BLIT_SDL && !SDL_MUSTLOCK( src ) && !SDL_MUSTLOCK( dst ) && blit_rect( src, sr, dst, dx, dy, level ) ) {
+        return;
+    }
+    SDL_Rect offset;
+    offset.x = dx;
+    offset.y = dy;
+    SDL_BlitSurface( src, sr, dst, &offset );
+}
+
+// RLE speeds up SDL's blits but hides the pixels from ours
+inline Uint32 blit_rle_flag() {
+    return blit_level() == BLIT_SDL ? SDL_RLEACCEL : 0;
+}
+
+#endif
@@ -0,0 +1,133 @@
+// blitbench - time blit.h's kernels against SDL_BlitSurface
+//
+//   ./blitbench [blits per case]
+//
+// Draws 32x32 tiles (opaque and colour keyed) and a 42x50 alpha sprite
+// all over a 640x480 screen-sized surface, the way the games do, once per
+// kernel level the CPU has. The SDL runs use RLE like the games did before
+// blit.h. Each level's output is checked against the plain C kernels.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "blit.h"
+#include "profile.h"
+
+const int BENCH_W = 640;
+const int BENCH_H = 480;
+
+enum { CASE_TILE, CASE_KEYED_TILE, CASE_SPRITE, NUM_CASES };
+const char *const CASE_NAMES[ NUM_CASES ] = { "tile 32x32", "keyed tile 32x32", "alpha sprite 42x50" };
+const int CASE_W[ NUM_CASES ] = { 32, 32, 42 };
+const int CASE_H[ NUM_CASES ] = { 32, 32, 50 };
+
+// xorshift, so every run draws the same thing
+Uint32 bench_random( Uint32 *state ) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+SDL_Surface *make_source( int kind, bool rle ) {
+    bool alpha = kind == CASE_SPRITE;
+    SDL_Surface *s = SDL_CreateRGBSurface(
+        SDL_SWSURFACE, 256, 256, 32, 0x00ff0000, 0x0000ff00, 0x000000ff, alpha ? BLIT_ALPHA_MASK : 0
+    );
+    Uint32 seed = 12345;
+    for( int y = 0; y < s->h; y++ ) {
+        Uint32 *row = (Uint32 *)( (Uint8 *)s->pixels + y * s->pitch );
+        for( int x = 0; x < s->w; x++ ) {
+            Uint32 p = bench_random( &seed );
+            if( kind == CASE_KEYED_TILE && ( p & 3 ) == 0 ) {
+                p = 0xff00ff; // about a quarter see-through
+            } else if( kind == CASE_SPRITE ) {
+                // mostly fully in or out like a real sprite, some edges
+                Uint32 a = ( p >> 24 ) < 96 ? 0 : ( p >> 24 ) < 224 ? 255 : p >> 24;
+                p = ( p & 0xffffff ) | ( a << 24 );
+            } else {
+                p &= 0xffffff;
+            }
+            row[ x ] = p;
+        }
+    }
+    if( kind == CASE_KEYED_TILE ) {
+        SDL_SetColorKey( s, SDL_SRCCOLORKEY | ( rle ? SDL_RLEACCEL : 0 ), 0xff00ff );
+    } else if( alpha ) {
+        SDL_SetAlpha( s, SDL_SRCALPHA | ( rle ? SDL_RLEACCEL : 0 ), SDL_ALPHA_OPAQUE );
+    }
+    return s;
+}
+
+SDL_Surface *make_screen() {
+    SDL_Surface *d = SDL_CreateRGBSurface( SDL_SWSURFACE, BENCH_W, BENCH_H, 32, 0x00ff0000, 0x0000ff00, 0x000000ff, 0 );
+    SDL_FillRect( d, NULL, 0x336699 );
+    return d;
+}
+
+// n blits from random places in the source to random places on screen,
+// returns us taken
+Uint64 run_case( int kind, int level, int n, SDL_Surface *src, SDL_Surface *dst ) {
+    int w = CASE_W[ kind ];
+    int h = CASE_H[ kind ];
+    Uint32 seed = 99;
+    Uint64 start = clock_us();
+    for( int i = 0; i < n; i++ ) {
+        SDL_Rect sr = { (Sint16)( bench_random( &seed ) % ( src->w - w ) ), (Sint16)( bench_random( &seed ) % ( src->h - h ) ), (Uint16)w, (Uint16)h };
+        int dx = bench_random( &seed ) % ( BENCH_W - w );
+        int dy = bench_random( &seed ) % ( BENCH_H - h );
+        if( level == BLIT_SDL ) {
+            SDL_Rect offset = { (Sint16)dx, (Sint16)dy, 0, 0 };
+            SDL_BlitSurface( src, &sr, dst, &offset );
+        } else {
+            blit_rect( src, &sr, dst, dx, dy, level );
+        }
+    }
+    return clock_us() - start;
+}
+
+int main( int argc, char **argv ) {
+    int n = argc > 1 ? atoi( argv[ 1 ] ) : 200000;
+    if( SDL_Init( 0 ) == -1 ) {
+        return 1;
+    }
+    int best = blit_best_level();
+    int failures = 0;
+    printf( "best kernels here: %s\n", BLIT_LEVEL_NAMES[ best ] );
+    for( int kind = 0; kind < NUM_CASES; kind++ ) {
+        printf( "%s\n", CASE_NAMES[ kind ] );
+        // the plain C result is the reference
+        SDL_Surface *reference = make_screen();
+        SDL_Surface *plain = make_source( kind, false );
+        run_case( kind, BLIT_SCALAR, 1000, plain, reference );
+        for( int level = 0; level < BLIT_NUM_LEVELS; level++ ) {
+            if( level > BLIT_SCALAR && level > best ) {
+                continue;
+            }
+            SDL_Surface *src = level == BLIT_SDL ? make_source( kind, true ) : plain;
+            SDL_Surface *dst = make_screen();
+            if( level != BLIT_SDL ) {
+                run_case( kind, level, 1000, src, dst );
+                if( memcmp( dst->pixels, reference->pixels, dst->pitch * dst->h ) != 0 ) {
+                    printf( "  %-6s output differs from scalar\n", BLIT_LEVEL_NAMES[ level ] );
+                    failures++;
+                }
+            }
+            Uint64 us = std::max( run_case( kind, level, n, src, dst ), (Uint64)1 );
+            printf(
+                "  %-6s %8.1f ns/blit %8.1f Mpixel/s\n",
+                BLIT_LEVEL_NAMES[ level ], us * 1000.0 / n, (double)n * CASE_W[ kind ] * CASE_H[ kind ] / us
+            );
+            SDL_FreeSurface( dst );
+            if( src != plain ) {
+                SDL_FreeSurface( src );
+            }
+        }
+        SDL_FreeSurface( plain );
+        SDL_FreeSurface( reference );
+    }
+    SDL_Quit();
+    return failures ? 1 : 0;
+}
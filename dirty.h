@@ -0,0 +1,96 @@
+#ifndef DIRTY_H
+#define DIRTY_H
+
+// Damaged screen rectangles for the dirty-rect presentation path.
+//
+// Each frame collect the areas that changed, redraw with the clip rect set
+// to each one in turn and hand just those to SDL_UpdateRects. Overlapping
+// rects are merged as they're added; if there are too many the whole
+// screen is treated as damaged.
+
+#include <SDL/SDL.h>
+#include <algorithm>
+
+const int DIRTY_MAX_RECTS = 16;
+
+struct dirty_rects {
+    SDL_Rect rects[ DIRTY_MAX_RECTS ];
+    int count;
+    bool full; // whole screen is damaged
+    int w; // screen size to clip to
+    int h;
+};
+
+inline void dirty_reset( struct dirty_rects *d, int w, int h ) {
+    d->count = 0;
+    d->full = false;
+    d->w = w;
+    d->h = h;
+}
+
+inline void dirty_all( struct dirty_rects *d ) {
+    d->full = true;
+}
+
+inline void dirty_add( struct dirty_rects *d, int x, int y, int w, int h ) {
+    if( d->full ) {
+        return;
+    }
+    int x0 = std::max( x, 0 );
+    int y0 = std::max( y, 0 );
+    int x1 = std::min( x + w, d->w );
+    int y1 = std::min( y + h, d->h );
+    if( x0 >= x1 || y0 >= y1 ) {
+        return;
+    }
+    // grow into anything we touch, which may then touch something else
+    bool merged = true;
+    while( merged ) {
+        merged = false;
+        for( int i = 0; i < d->count; i++ ) {
+            SDL_Rect *r = &d->rects[ i ];
+            if( r->x <= x1 && x0 <= r->x + r->w && r->y <= y1 && y0 <= r->y + r->h ) {
+                x0 = std::min( x0, (int)r->x );
+                y0 = std::min( y0, (int)r->y );
+                x1 = std::max( x1, r->x + r->w );
+                y1 = std::max( y1, r->y + r->h );
+                d->rects[ i ] = d->rects[ --d->count ];
+                merged = true;
+                break;
+            }
+        }
+    }
+    if( d->count == DIRTY_MAX_RECTS ) {
+        d->full = true;
+        return;
+    }
+    SDL_Rect *r = &d->rects[ d->count++ ];
+    r->x = x0;
+    r->y = y0;
+    r->w = x1 - x0;
+    r->h = y1 - y0;
+}
+
+inline void dirty_add( struct dirty_rects *d, const SDL_Rect *r ) {
+    dirty_add( d, r->x, r->y, r->w, r->h );
+}
+
+// number of clipped redraw passes needed, 0 means nothing changed
+inline int dirty_passes( const struct dirty_rects *d ) {
+    return d->full ? 1 : d->count;
+}
+
+// clip rect for a redraw pass, NULL for the whole screen
+inline SDL_Rect *dirty_clip( struct dirty_rects *d, int pass ) {
+    return d->full ? NULL : &d->rects[ pass ];
+}
+
+inline void dirty_present( struct dirty_rects *d, SDL_Surface *screen ) {
+    if( d->full ) {
+        SDL_UpdateRect( screen, 0, 0, 0, 0 );
+    } else if( d->count > 0 ) {
+        SDL_UpdateRects( screen, d->count, d->rects );
+    }
+}
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef EDITS_H
+#define EDITS_H
+
+// Map edits on their way from the main thread to the simulation.
+//
+// set_tile changes the level and what's drawn on the main thread, which
+// owns them, but solidity (and in ninjabox the Box2D world) belongs to
+// whichever thread ticks. Each edited cell's new solidity goes through
+// here and the sim applies it before its next tick:
+//
+//   edits_push( &q, col, row, solid );  // main thread
+//   edits_take( &q, &taken );           // sim, between ticks
+//
+// An empty queue costs the sim one atomic load, the lock is only taken
+// when there's something in it.
+
+#include <SDL/SDL.h>
+#include <SDL/SDL_thread.h>
+#include <atomic>
+#include <vector>
+
+struct cell_edit {
+    int col;
+    int row;
+    bool solid;
+};
+
+struct edit_queue {
+    SDL_mutex *lock; // guards pending
+    std::vector<struct cell_edit> pending;
+    std::atomic<int> count; // pending's size, readable without the lock
+};
+
+inline void edits_init( struct edit_queue *q ) {
+    q->lock = SDL_CreateMutex();
+    q->pending.clear();
+    q->count.store( 0 );
+}
+
+inline void edits_free( struct edit_queue *q ) {
+    SDL_DestroyMutex( q->lock );
+    q->lock = NULL;
+}
+
+inline void edits_push( struct edit_queue *q, int col, int row, bool solid ) {
+    struct cell_edit e = { col, row, solid };
+    SDL_mutexP( q->lock );
+    q->pending.push_back( e );
+    q->count.store( q->pending.size() );
+    SDL_mutexV( q->lock );
+}
+
+// everything pushed so far, in order, returns whether there was any
+inline bool edits_take( struct edit_queue *q, std::vector<struct cell_edit> *out ) {
+    out->clear();
+    if( q->count.load() == 0 ) {
+        return false;
+    }
+    SDL_mutexP( q->lock );
+    out->swap( q->pending );
+    q->count.store( 0 );
+    SDL_mutexV( q->lock );
+    return true;
+}
+
+#endif
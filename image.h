@@ -0,0 +1,168 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+// Image import.
+//
+// Loaded images are converted to the screen's format once, here, so every
+// later blit is a straight copy instead of going through SDL's converting
+// blitter. Each image goes down one of these paths:
+//
+//   opaque    no transparency at all, plain display format
+//   colorkey  a TMX trans colour or the file's own key
+//   alpha     the file has pixels that really are partly transparent,
+//             display format with alpha
+//   raw       no video surface yet (headless), left as loaded
+//
+// Keyed and alpha images are RLE accelerated when SDL does the blitting
+// and left as plain pixels when blit.h's kernels do.
+//
+// Conversion needs SDL_SetVideoMode to have been called first.
+
+#include <SDL/SDL.h>
+#include <SDL/SDL_image.h>
+#include <string.h>
+#include <string>
+#include <algorithm>
+
+#include "trace.h"
+#include "blit.h"
+
+enum { IMAGE_RAW, IMAGE_OPAQUE, IMAGE_COLORKEY, IMAGE_ALPHA, IMAGE_NUM_PATHS };
+const char *const IMAGE_PATH_NAMES[ IMAGE_NUM_PATHS ] = { "raw", "opaque", "colorkey", "alpha" };
+
+const Uint32 IMAGE_NO_KEY = 0xffffffff;
+
+// images loaded down each path so far
+inline int *image_path_counts() {
+    static int counts[ IMAGE_NUM_PATHS ];
+    return counts;
+}
+
+// is any pixel less than fully opaque
+inline bool image_uses_alpha( SDL_Surface *surface ) {
+    SDL_PixelFormat *fmt = surface->format;
+    if( fmt->Amask == 0 ) {
+        return false;
+    }
+    bool found = false;
+    if( SDL_MUSTLOCK( surface ) ) {
+        SDL_LockSurface( surface );
+    }
+    for( int y = 0; y < surface->h && !found; y++ ) {
+        const Uint8 *row = (const Uint8 *)surface->pixels + y * surface->pitch;
+        for( int x = 0; x < surface->w; x++ ) {
+            Uint32 pixel = 0;
+            memcpy( &pixel, row + x * fmt->BytesPerPixel, fmt->BytesPerPixel );
+            if( ( pixel & fmt->Amask ) != fmt->Amask ) {
+                found = true;
+                break;
+            }
+        }
+    }
+    if( SDL_MUSTLOCK( surface ) ) {
+        SDL_UnlockSurface( surface );
+    }
+    return found;
+}
+
+// does every pixel of r cover what's under it, going by the surface's
+// colour key and alpha
+inline bool image_rect_is_opaque( SDL_Surface *surface, const SDL_Rect *r ) {
+    SDL_PixelFormat *fmt = surface->format;
+    bool keyed = ( surface->flags & SDL_SRCCOLORKEY ) != 0;
+    bool alpha = ( surface->flags & SDL_SRCALPHA ) != 0 && fmt->Amask != 0;
+    if( !keyed && !alpha ) {
+        return true;
+    }
+    bool opaque = true;
+    if( SDL_MUSTLOCK( surface ) ) {
+        SDL_LockSurface( surface );
+    }
+    int x0 = std::max( 0, (int)r->x );
+    int x1 = std::min( surface->w, r->x + r->w );
+    for( int y = std::max( 0, (int)r->y ); y < std::min( surface->h, r->y + r->h ) && opaque; y++ ) {
+        const Uint8 *row = (const Uint8 *)surface->pixels + y * surface->pitch;
+        for( int x = x0; x < x1; x++ ) {
+            Uint32 pixel = 0;
+            memcpy( &pixel, row + x * fmt->BytesPerPixel, fmt->BytesPerPixel );
+            if( ( keyed && ( pixel & ~fmt->Amask ) == fmt->colorkey ) || ( alpha && ( pixel & fmt->Amask ) != fmt->Amask ) ) {
+                opaque = false;
+                break;
+            }
+        }
+    }
+    if( SDL_MUSTLOCK( surface ) ) {
+        SDL_UnlockSurface( surface );
+    }
+    return opaque;
+}
+
+// colour_key is 0xRRGGBB or IMAGE_NO_KEY, path if given gets the IMAGE_
+// path taken
+inline SDL_Surface *load_image( std::string filename, Uint32 colour_key = IMAGE_NO_KEY, int *path = NULL ) {
+    SDL_Surface *loadedImage = IMG_Load( filename.c_str() );
+    if( loadedImage == NULL ) {
+        TRACE( TRACE_ERROR, TRACE_RENDER, "IMG_Load failed" );
+        return NULL;
+    }
+    SDL_Surface *optimisedImage = NULL;
+    int taken;
+    if( SDL_GetVideoSurface() == NULL ) {
+        optimisedImage = loadedImage;
+        loadedImage = NULL;
+        taken = IMAGE_RAW;
+    } else if( colour_key != IMAGE_NO_KEY ) {
+        // a key from the map wins over whatever the file has
+        SDL_SetAlpha( loadedImage, 0, SDL_ALPHA_OPAQUE );
+        optimisedImage = SDL_DisplayFormat( loadedImage );
+        if( optimisedImage ) {
+            SDL_SetColorKey(
+                optimisedImage, SDL_SRCCOLORKEY | blit_rle_flag(),
+                SDL_MapRGB( optimisedImage->format, colour_key >> 16, ( colour_key >> 8 ) & 0xff, colour_key & 0xff )
+            );
+        }
+        taken = IMAGE_COLORKEY;
+    } else if( image_uses_alpha( loadedImage ) ) {
+        optimisedImage = SDL_DisplayFormatAlpha( loadedImage );
+        if( optimisedImage ) {
+            SDL_SetAlpha( optimisedImage, SDL_SRCALPHA | blit_rle_flag(), SDL_ALPHA_OPAQUE );
+        }
+        taken = IMAGE_ALPHA;
+    } else if( loadedImage->flags & SDL_SRCCOLORKEY ) {
+        // paletted with a transparent index, the key survives conversion
+        optimisedImage = SDL_DisplayFormat( loadedImage );
+        if( optimisedImage ) {
+            SDL_SetColorKey( optimisedImage, SDL_SRCCOLORKEY | blit_rle_flag(), optimisedImage->format->colorkey );
+        }
+        taken = IMAGE_COLORKEY;
+    } else {
+        optimisedImage = SDL_DisplayFormat( loadedImage );
+        taken = IMAGE_OPAQUE;
+    }
+    if( loadedImage ) {
+        SDL_FreeSurface( loadedImage );
+    }
+    if( optimisedImage == NULL ) {
+        TRACE( TRACE_ERROR, TRACE_RENDER, "display format conversion failed" );
+        return NULL;
+    }
+    image_path_counts()[ taken ]++;
+    TRACE( TRACE_INFO, TRACE_RENDER, "image %ix%i took path %i", optimisedImage->w, optimisedImage->h, taken );
+    if( path ) {
+        *path = taken;
+    }
+    return optimisedImage;
+}
+
+// an empty surface in the screen's format, for things we draw into and
+// then blit to the screen
+inline SDL_Surface *create_display_surface( int w, int h ) {
+    SDL_Surface *screen = SDL_GetVideoSurface();
+    if( screen == NULL ) {
+        return SDL_CreateRGBSurface( SDL_SWSURFACE, w, h, 32, 0, 0, 0, 0 );
+    }
+    SDL_PixelFormat *fmt = screen->format;
+    return SDL_CreateRGBSurface( SDL_HWSURFACE, w, h, fmt->BitsPerPixel, fmt->Rmask, fmt->Gmask, fmt->Bmask, 0 );
+}
+
+#endif
@@ -0,0 +1,266 @@
+#ifndef LEVEL_H
+#define LEVEL_H
+
+// Compiled level format.
+//
+// levelc turns a TMX map into one of these offline and the games mmap it
+// and use it where it lies, no parsing at all. The mapping is copy on
+// write, so cells can be changed in play without touching the file. The
+// file is a level_header followed by flat arrays of the records below,
+// each at an 8 byte aligned offset given in the header. Strings are
+// offsets into a table of NUL terminated names. Everything is in host
+// byte order.
+//
+// Bump LEVEL_VERSION whenever a record changes; levels are rebuilt by make.
+
+#include <SDL/SDL.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+const char LEVEL_MAGIC[ 4 ] = { 'N', 'J', 'L', 'V' };
+const Uint32 LEVEL_VERSION = 3;
+
+// level_tile flags
+const Uint16 LEVEL_TILE_SOLID = 1;
+
+const Uint16 LEVEL_NO_TILESET = 0xffff;
+const Uint32 LEVEL_NO_TRANS = 0xffffffff;
+const Uint32 LEVEL_NO_IMAGE = 0xffffffff;
+
+// level_layer sides, which goes over the sprites
+enum { LEVEL_BEHIND, LEVEL_FRONT };
+
+struct level_header {
+    char magic[ 4 ];
+    Uint32 version;
+    Uint32 size; // of the whole file
+    Uint32 width; // tiles
+    Uint32 height;
+    Uint32 tile_width; // px
+    Uint32 tile_height;
+    Uint32 num_layers;
+    Uint32 num_tilesets;
+    Uint32 num_gids; // tile table entries, gid 0 is the empty cell
+    Uint32 num_polylines;
+    Uint32 num_points;
+    // file offsets of each array
+    Uint32 layers;
+    Uint32 cells; // num_layers grids of width * height Uint16 gids, row-major
+    Uint32 tilesets;
+    Uint32 tiles;
+    Uint32 polylines;
+    Uint32 points;
+    Uint32 strings;
+    Uint32 strings_size;
+};
+
+// layers with a scroll factor other than 1 are parallax layers, drawn
+// behind the map at their own rate and left out of collision. An image
+// layer has no cells of its own, its picture is drawn in their place.
+struct level_layer {
+    Uint32 name; // string
+    Uint32 visible;
+    Uint32 side; // LEVEL_BEHIND or LEVEL_FRONT
+    Uint32 image; // string, relative to the map's directory, or LEVEL_NO_IMAGE
+    float scroll_x; // how far it moves per pixel the camera does
+    float scroll_y;
+};
+
+struct level_tileset {
+    Uint32 image; // string, relative to the map's directory
+    Uint32 first_gid;
+    Uint32 count;
+    Uint32 trans; // 0xRRGGBB colour key, or LEVEL_NO_TRANS
+};
+
+// one per gid, where to find it in its tileset image and what it is
+struct level_tile {
+    Uint16 tileset; // or LEVEL_NO_TILESET
+    Uint16 flags;
+    Sint16 x;
+    Sint16 y;
+    Uint16 w;
+    Uint16 h;
+};
+
+struct level_polyline {
+    Uint32 type; // string, the TMX object type
+    Sint32 x; // object position, the points are relative to it
+    Sint32 y;
+    Uint32 first_point;
+    Uint32 num_points;
+};
+
+struct level_point {
+    Sint32 x;
+    Sint32 y;
+};
+
+// a mapped level, the arrays point straight into the file
+struct level {
+    void *data;
+    size_t size;
+    int width;
+    int height;
+    int tile_width;
+    int tile_height;
+    int num_layers;
+    int num_tilesets;
+    int num_gids;
+    int num_polylines;
+    const struct level_layer *layers;
+    Uint16 *cells;
+    const struct level_tileset *tilesets;
+    const struct level_tile *tiles;
+    const struct level_polyline *polylines;
+    const struct level_point *points;
+    const char *strings;
+};
+
+inline const char *level_string( const struct level *l, Uint32 offset ) {
+    return l->strings + offset;
+}
+
+inline Uint16 level_gid( const struct level *l, int layer, int col, int row ) {
+    return l->cells[ ( layer * l->height + row ) * l->width + col ];
+}
+
+inline bool level_layer_is_parallax( const struct level *l, int layer ) {
+    return l->layers[ layer ].scroll_x != 1.0f || l->layers[ layer ].scroll_y != 1.0f || l->layers[ layer ].image != LEVEL_NO_IMAGE;
+}
+
+inline void level_set_gid( struct level *l, int layer, int col, int row, Uint16 gid ) {
+    l->cells[ ( layer * l->height + row ) * l->width + col ] = gid;
+}
+
+// does count records of size bytes at offset fit in the file
+inline bool level_fits( const struct level_header *h, Uint32 offset, Uint64 count, Uint32 size ) {
+    return offset <= h->size && count * size <= h->size - offset;
+}
+
+// is offset the start of a NUL terminated string in the table
+inline bool level_string_ok( const struct level *l, const struct level_header *h, Uint32 offset ) {
+    return offset < h->strings_size && memchr( l->strings + offset, 0, h->strings_size - offset ) != NULL;
+}
+
+// everything the games use as an index or a divisor, checked once here so
+// they needn't check it again
+inline bool level_contents_ok( const struct level *l, const struct level_header *h ) {
+    if(
+        h->width == 0 || h->height == 0 || h->width > 0xffff || h->height > 0xffff ||
+        h->tile_width == 0 || h->tile_height == 0 || h->tile_width > 0x7fff || h->tile_height > 0x7fff
+    ) {
+        return false;
+    }
+    for( Uint32 i = 0; i < h->num_layers; i++ ) {
+        const struct level_layer *layer = &l->layers[ i ];
+        if(
+            !level_string_ok( l, h, layer->name ) || layer->side > LEVEL_FRONT ||
+            ( layer->image != LEVEL_NO_IMAGE && !level_string_ok( l, h, layer->image ) )
+        ) {
+            return false;
+        }
+    }
+    Uint64 cells = (Uint64)h->num_layers * h->width * h->height;
+    for( Uint64 i = 0; i < cells; i++ ) {
+        if( l->cells[ i ] >= h->num_gids ) {
+            return false;
+        }
+    }
+    for( Uint32 i = 0; i < h->num_tilesets; i++ ) {
+        if( !level_string_ok( l, h, l->tilesets[ i ].image ) ) {
+            return false;
+        }
+    }
+    for( Uint32 i = 0; i < h->num_gids; i++ ) {
+        if( l->tiles[ i ].tileset != LEVEL_NO_TILESET && l->tiles[ i ].tileset >= h->num_tilesets ) {
+            return false;
+        }
+    }
+    for( Uint32 i = 0; i < h->num_polylines; i++ ) {
+        const struct level_polyline *pl = &l->polylines[ i ];
+        if(
+            !level_string_ok( l, h, pl->type ) ||
+            pl->first_point > h->num_points || pl->num_points > h->num_points - pl->first_point
+        ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline bool level_open( struct level *l, const char *filename ) {
+    memset( l, 0, sizeof( *l ) );
+    int fd = open( filename, O_RDONLY );
+    if( fd < 0 ) {
+        return false;
+    }
+    struct stat st;
+    if( fstat( fd, &st ) != 0 || (size_t)st.st_size < sizeof( struct level_header ) ) {
+        close( fd );
+        return false;
+    }
+    void *data = mmap( NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if( data == MAP_FAILED ) {
+        return false;
+    }
+    l->data = data;
+    l->size = st.st_size;
+
+    // stale or truncated files are refused rather than read past the end,
+    // and so are ones with any index out of range, see level_contents_ok
+    const struct level_header *h = (const struct level_header *)data;
+    if(
+        memcmp( h->magic, LEVEL_MAGIC, sizeof( LEVEL_MAGIC ) ) != 0 ||
+        h->version != LEVEL_VERSION ||
+        h->size != l->size ||
+        !level_fits( h, h->layers, h->num_layers, sizeof( struct level_layer ) ) ||
+        !level_fits( h, h->cells, (Uint64)h->num_layers * h->width * h->height, sizeof( Uint16 ) ) ||
+        !level_fits( h, h->tilesets, h->num_tilesets, sizeof( struct level_tileset ) ) ||
+        !level_fits( h, h->tiles, h->num_gids, sizeof( struct level_tile ) ) ||
+        !level_fits( h, h->polylines, h->num_polylines, sizeof( struct level_polyline ) ) ||
+        !level_fits( h, h->points, h->num_points, sizeof( struct level_point ) ) ||
+        !level_fits( h, h->strings, h->strings_size, 1 ) ||
+        h->num_gids == 0
+    ) {
+        munmap( data, l->size );
+        l->data = NULL;
+        return false;
+    }
+
+    const char *base = (const char *)data;
+    l->width = h->width;
+    l->height = h->height;
+    l->tile_width = h->tile_width;
+    l->tile_height = h->tile_height;
+    l->num_layers = h->num_layers;
+    l->num_tilesets = h->num_tilesets;
+    l->num_gids = h->num_gids;
+    l->num_polylines = h->num_polylines;
+    l->layers = (const struct level_layer *)( base + h->layers );
+    l->cells = (Uint16 *)( base + h->cells );
+    l->tilesets = (const struct level_tileset *)( base + h->tilesets );
+    l->tiles = (const struct level_tile *)( base + h->tiles );
+    l->polylines = (const struct level_polyline *)( base + h->polylines );
+    l->points = (const struct level_point *)( base + h->points );
+    l->strings = base + h->strings;
+    if( !level_contents_ok( l, h ) ) {
+        munmap( data, l->size );
+        memset( l, 0, sizeof( *l ) );
+        return false;
+    }
+    return true;
+}
+
+inline void level_close( struct level *l ) {
+    if( l->data ) {
+        munmap( l->data, l->size );
+        l->data = NULL;
+    }
+}
+
+#endif
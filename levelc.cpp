@@ -0,0 +1,221 @@
+// levelc - compile a TMX map into the binary level format in level.h
+//
+//   ./levelc map/platformtest.tmx map/platformtest.lvl
+//
+// All the XML, CSV and property parsing happens here, once, so the games
+// only have to map the result.
+//
+// Layer properties:
+//   parallax     scroll factor, 0.5 moves at half the camera's speed
+//   parallax_y   vertical factor if it differs, defaults to parallax
+//   image        picture to draw for the layer instead of its tiles,
+//                relative to the map, it wraps horizontally
+//   front        true to draw it over the sprites
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#include <tmxparser/Tmx.h>
+
+#include "level.h"
+
+struct string_table {
+    std::string data;
+    std::map<std::string, Uint32> offsets;
+};
+
+Uint32 add_string( struct string_table *strings, const std::string &s ) {
+    std::map<std::string, Uint32>::iterator it = strings->offsets.find( s );
+    if( it != strings->offsets.end() ) {
+        return it->second;
+    }
+    Uint32 offset = strings->data.size();
+    strings->data += s;
+    strings->data += '\0';
+    strings->offsets[ s ] = offset;
+    return offset;
+}
+
+// "ff00ff" as written in a tileset image's trans attribute
+Uint32 parse_trans( const std::string &trans ) {
+    if( trans.empty() ) {
+        return LEVEL_NO_TRANS;
+    }
+    return strtoul( trans.c_str(), NULL, 16 ) & 0xffffff;
+}
+
+// append records to the file image at the next 8 byte boundary,
+// returning where they went
+Uint32 add_section( std::vector<char> *out, const void *records, size_t bytes ) {
+    out->resize( ( out->size() + 7 ) & ~(size_t)7 );
+    Uint32 offset = out->size();
+    out->insert( out->end(), (const char *)records, (const char *)records + bytes );
+    return offset;
+}
+
+template <typename T>
+Uint32 add_section( std::vector<char> *out, const std::vector<T> &records ) {
+    return add_section( out, records.empty() ? NULL : &records[ 0 ], records.size() * sizeof( T ) );
+}
+
+int main( int argc, char **argv ) {
+    if( argc < 3 ) {
+        fprintf( stderr, "usage: %s <map.tmx> <map.lvl>\n", argv[ 0 ] );
+        return 1;
+    }
+    Tmx::Map *map = new Tmx::Map();
+    map->ParseFile( argv[ 1 ] );
+    if( map->HasError() ) {
+        fprintf( stderr, "%s: %s\n", argv[ 1 ], map->GetErrorText().c_str() );
+        return 1;
+    }
+
+    struct string_table strings;
+    struct level_header header;
+    memset( &header, 0, sizeof( header ) );
+    memcpy( header.magic, LEVEL_MAGIC, sizeof( LEVEL_MAGIC ) );
+    header.version = LEVEL_VERSION;
+    header.width = map->GetWidth();
+    header.height = map->GetHeight();
+    header.tile_width = map->GetTileWidth();
+    header.tile_height = map->GetTileHeight();
+
+    // tilesets, and the source rect of every gid in them with margin and
+    // spacing already applied
+    std::vector<struct level_tileset> tilesets;
+    std::vector<struct level_tile> tiles( 1 );
+    memset( &tiles[ 0 ], 0, sizeof( tiles[ 0 ] ) );
+    tiles[ 0 ].tileset = LEVEL_NO_TILESET;
+    for( int i = 0; i < map->GetNumTilesets(); i++ ) {
+        const Tmx::Tileset *tileset = map->GetTileset( i );
+        const Tmx::Image *image = tileset->GetImage();
+        int tw = tileset->GetTileWidth();
+        int th = tileset->GetTileHeight();
+        int margin = tileset->GetMargin();
+        int spacing = tileset->GetSpacing();
+        int cols = ( image->GetWidth() - 2 * margin + spacing ) / ( tw + spacing );
+        int rows = ( image->GetHeight() - 2 * margin + spacing ) / ( th + spacing );
+
+        struct level_tileset ts;
+        ts.image = add_string( &strings, image->GetSource() );
+        ts.first_gid = tileset->GetFirstGid();
+        ts.count = cols * rows;
+        ts.trans = parse_trans( image->GetTransparentColor() );
+        tilesets.push_back( ts );
+
+        if( ts.first_gid + ts.count > 0xffff ) {
+            fprintf( stderr, "%s: too many tiles, gids have to fit in 16 bits\n", argv[ 1 ] );
+            return 1;
+        }
+        if( tiles.size() < ts.first_gid + ts.count ) {
+            struct level_tile none;
+            memset( &none, 0, sizeof( none ) );
+            none.tileset = LEVEL_NO_TILESET;
+            tiles.resize( ts.first_gid + ts.count, none );
+        }
+        for( int id = 0; id < cols * rows; id++ ) {
+            struct level_tile *tile = &tiles[ ts.first_gid + id ];
+            tile->tileset = i;
+            tile->flags = 0;
+            tile->x = margin + ( id % cols ) * ( tw + spacing );
+            tile->y = margin + ( id / cols ) * ( th + spacing );
+            tile->w = tw;
+            tile->h = th;
+            const Tmx::Tile *props = tileset->GetTile( id );
+            if( props && props->GetProperties().GetIntProperty( "solid" ) == 1 ) {
+                tile->flags |= LEVEL_TILE_SOLID;
+            }
+        }
+    }
+
+    // layers are clipped or padded to the map size so they can share an index
+    std::vector<struct level_layer> layers;
+    std::vector<Uint16> cells( map->GetNumLayers() * header.width * header.height, 0 );
+    for( int i = 0; i < map->GetNumLayers(); i++ ) {
+        const Tmx::Layer *layer = map->GetLayer( i );
+        struct level_layer l;
+        l.name = add_string( &strings, layer->GetName() );
+        l.visible = layer->IsVisible();
+        const Tmx::PropertySet &props = layer->GetProperties();
+        l.side = props.GetLiteralProperty( "front" ) == "true" ? LEVEL_FRONT : LEVEL_BEHIND;
+        l.image = props.HasProperty( "image" ) ? add_string( &strings, props.GetLiteralProperty( "image" ) ) : LEVEL_NO_IMAGE;
+        l.scroll_x = props.GetFloatProperty( "parallax", 1.0f );
+        l.scroll_y = props.GetFloatProperty( "parallax_y", l.scroll_x );
+        layers.push_back( l );
+        for( int row = 0; row < std::min( (int)header.height, layer->GetHeight() ); row++ ) {
+            for( int col = 0; col < std::min( (int)header.width, layer->GetWidth() ); col++ ) {
+                int ts = layer->GetTileTilesetIndex( col, row );
+                if( ts < 0 ) {
+                    continue;
+                }
+                unsigned int gid = map->GetTileset( ts )->GetFirstGid() + layer->GetTileId( col, row );
+                // the games index the tile table with this unchecked
+                if( gid >= tiles.size() || tiles[ gid ].tileset != ts ) {
+                    fprintf( stderr, "%s: layer %i, %i,%i is outside its tileset, dropped\n", argv[ 1 ], i, col, row );
+                    continue;
+                }
+                cells[ ( i * header.height + row ) * header.width + col ] = gid;
+            }
+        }
+    }
+
+    std::vector<struct level_polyline> polylines;
+    std::vector<struct level_point> points;
+    for( int i = 0; i < map->GetNumObjectGroups(); i++ ) {
+        const Tmx::ObjectGroup *group = map->GetObjectGroup( i );
+        for( int j = 0; j < group->GetNumObjects(); j++ ) {
+            const Tmx::Object *ob = group->GetObject( j );
+            const Tmx::Polyline *pl = ob->GetPolyline();
+            if( pl == NULL ) {
+                continue;
+            }
+            struct level_polyline line;
+            line.type = add_string( &strings, ob->GetType() );
+            line.x = ob->GetX();
+            line.y = ob->GetY();
+            line.first_point = points.size();
+            line.num_points = pl->GetNumPoints();
+            polylines.push_back( line );
+            for( int k = 0; k < pl->GetNumPoints(); k++ ) {
+                struct level_point p = { pl->GetPoint( k ).x, pl->GetPoint( k ).y };
+                points.push_back( p );
+            }
+        }
+    }
+
+    header.num_layers = layers.size();
+    header.num_tilesets = tilesets.size();
+    header.num_gids = tiles.size();
+    header.num_polylines = polylines.size();
+    header.num_points = points.size();
+
+    std::vector<char> out( sizeof( header ) );
+    header.layers = add_section( &out, layers );
+    header.cells = add_section( &out, cells );
+    header.tilesets = add_section( &out, tilesets );
+    header.tiles = add_section( &out, tiles );
+    header.polylines = add_section( &out, polylines );
+    header.points = add_section( &out, points );
+    header.strings = add_section( &out, strings.data.data(), strings.data.size() );
+    header.strings_size = strings.data.size();
+    header.size = out.size();
+    memcpy( &out[ 0 ], &header, sizeof( header ) );
+
+    FILE *f = fopen( argv[ 2 ], "wb" );
+    if( f == NULL || fwrite( &out[ 0 ], 1, out.size(), f ) != out.size() ) {
+        fprintf( stderr, "can't write %s\n", argv[ 2 ] );
+        return 1;
+    }
+    fclose( f );
+    printf(
+        "%s: %ix%i, %i layers, %i tiles, %i polylines, %u bytes\n",
+        argv[ 2 ], header.width, header.height, header.num_layers, header.num_gids - 1, header.num_polylines, header.size
+    );
+    delete map;
+    return 0;
+}
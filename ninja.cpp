@@ -7,20 +7,24 @@
 #include <sstream>
 #include <cmath>
 #include <vector>
+#include <map>
+#include <algorithm>
 #include <stdarg.h>
 
-#include "TmxParser/Tmx.h"
+#include "level.h"
+#include "image.h"
+#include "assets.h"
+#include "anim.h"
+#include "replay.h"
+#include "trace.h"
+#include "dirty.h"
+#include "profile.h"
+#include "snapshot.h"
+#include "blit.h"
+#include "workers.h"
+#include "spatial.h"
+#include "edits.h"
 
-#ifdef DEBUG
-inline void printf_debug( const char* f, ... ) {
-    va_list argp;
-    va_start( argp, f );
-    vfprintf( stderr, f, argp );
-}
-#else
-inline void printf_debug( const char* f, ... ) {
-}
-#endif
 
 const int SCREEN_WIDTH = 640;
 const int SCREEN_HEIGHT = 480;
@@ -30,27 +34,52 @@ const int TH = 32;
 const int SCREEN_FLAGS = SDL_HWSURFACE | SDL_DOUBLEBUF | SDL_ASYNCBLIT;// | SDL_FULLSCREEN;
 const int FPSFPS = 10; // rate at which FPS display is updated
 const float GRAVITY = 3000.0; //pixels per second per second
-const int FPS_CAP = 5; // if FLIP isn't vsynced, limit to this so we don't waste cycles
-const float SLOW_DOWN = 5.0;
-
-Tmx::Map *map;
-std::map<std::string, SDL_Surface*> tilesets;
-
-// ********** global funcs ************
-
-struct sprite_frame {
+const int FPS_CAP = 60; // if FLIP isn't vsynced, limit to this so we don't waste cycles
+const float SLOW_DOWN = 5.0; // game time runs this many times slower than real time
+const int SIM_RATE = 120; // physics ticks per second, independent of frame rate
+const float SIM_DT = 1.0 / SIM_RATE;
+const float MAX_FRAME_TIME = 0.25; // s, don't try to catch up on more than this
+
+struct level *map;
+std::vector<SDL_Surface*> tilesets; // image for each of the level's tilesets
+
+// what to blit for each gid, resolved once at load time so drawing a
+// tile is a single index
+struct tile_src {
+    SDL_Surface *surface;
     SDL_Rect rect;
-    float duration; //s
+    bool opaque; // hides whatever is under it
 };
-struct animation {
-    int index;
-    struct sprite_frame *frames;
-    int count;
+std::vector<struct tile_src> tile_srcs;
+void build_tile_srcs();
+
+// per cell, the drawing order of the topmost opaque tile there, or -1.
+// Nothing under it is ever baked
+std::vector<int> cell_cover;
+void build_cover();
+void load_tilesets();
+
+// one bit per map cell, row-major, packed into 64 bit words
+// so a cell test is a shift and a mask
+struct solid_grid {
+    int w;
+    int h;
+    int stride; // words per row
+    std::vector<Uint64> bits;
 };
+struct solid_grid solidity;
+void build_solidity();
+
+// ********** global funcs ************
+
+const int MAX_CONTACT_CELLS = 8;
 struct contact {
     float t2i; // time to impact
     float rx; //normal to surface
     float ry; //normal to surface
+    int cells; // solid cells met at t2i
+    short cell_col[ MAX_CONTACT_CELLS ];
+    short cell_row[ MAX_CONTACT_CELLS ];
 };
 
 template <typename T> int sgn(T val) {
@@ -92,41 +121,15 @@ SDL_Rect calculate_viewport( int x, int y, int w, int h ) {
     }
 }
 
-SDL_Surface *load_image( std::string filename ) {
-	SDL_Surface *loadedImage = NULL;
-	SDL_Surface *optimisedImage = NULL;
-	loadedImage = IMG_Load( filename.c_str() );
-	if( loadedImage != NULL ) {
-        return loadedImage;
-		optimisedImage = SDL_DisplayFormatAlpha( loadedImage );
-		SDL_FreeSurface( loadedImage );
-	}
-	return optimisedImage;
-}
 void apply_sprite( int x, int y, SDL_Surface *source, SDL_Rect *frame, SDL_Surface *destination ) {
-	SDL_Rect offset;
-	offset.x = x;
-	offset.y = y;
-	SDL_BlitSurface( source, frame, destination, &offset );
-}
-void apply_tile( int sx, int sy, SDL_Surface *source, int dx, int dy, SDL_Surface *destination ) {
-	SDL_Rect soffset;
-	SDL_Rect doffset;
-	soffset.x = sx;
-	soffset.y = sy;
-	soffset.w = TW;
-	soffset.h = TH;
-	doffset.x = dx;
-	doffset.y = dy;
-	doffset.w = TW;
-	doffset.h = TH;
-	SDL_BlitSurface( source, &soffset, destination, &doffset );
+	blit_surface( source, frame, destination, x, y );
+}
+void apply_tile( const struct tile_src *src, int dx, int dy, SDL_Surface *destination ) {
+	SDL_Rect soffset = src->rect;
+	blit_surface( src->surface, &soffset, destination, dx, dy );
 }
 void apply_surface( int x, int y, SDL_Surface *source, SDL_Surface *destination ) {
-	SDL_Rect offset;
-	offset.x = x;
-	offset.y = y;
-	SDL_BlitSurface( source, NULL, destination, &offset );
+	blit_surface( source, NULL, destination, x, y );
 }
 void clear_surface( SDL_Surface *surf, Uint32 col ) {
 	SDL_FillRect( surf, NULL, col );
@@ -141,255 +144,317 @@ void apply_tiling_surface( int x, int y, int width, int x_offset, SDL_Surface *s
 	srcoff.h = source->h;
 	if( x_offset + width > source->w ) {
 		srcoff.w = source->w - x_offset;
-		SDL_BlitSurface( source, &srcoff, destination, &offset );
+		blit_surface( source, &srcoff, destination, offset.x, offset.y );
 		offset.x += srcoff.w;
 		srcoff.x = 0;
 		srcoff.w = width - srcoff.w;
-		SDL_BlitSurface( source, &srcoff, destination, &offset );
+		blit_surface( source, &srcoff, destination, offset.x, offset.y );
 	} else {
 		srcoff.w = width;
-		SDL_BlitSurface( source, &srcoff, destination, &offset );
+		blit_surface( source, &srcoff, destination, offset.x, offset.y );
 	}
 }
 
+// the level is compiled from map/platformtest.tmx by levelc, see level.h
 void load_map() {
-    map = new Tmx::Map();
-	map->ParseFile("map/platformtest.tmx");
-
-	if (map->HasError()) {
-        //printf_debug("error code: %d\n", map->GetErrorCode());
-	    //printf_debug("error text: %s\n", map->GetErrorText().c_str());
-		system("PAUSE");
+    map = new struct level;
+	if( !level_open( map, "map/platformtest.lvl" ) ) {
+        fprintf( stderr, "can't load map/platformtest.lvl, make levels to rebuild it\n" );
         exit(1);
 	}
 
-	for (int i = 0; i < map->GetNumTilesets(); ++i) {
-		// Get a tileset.
-		const Tmx::Tileset *tileset = map->GetTileset(i);
-		tilesets[ tileset->GetImage()->GetSource() ] = load_image( ( "map/" + tileset->GetImage()->GetSource() ).c_str() );
+    build_solidity();
+}
+
+// tileset images, converted for the screen so needs the video mode set
+void load_tilesets() {
+	for (int i = 0; i < map->num_tilesets; ++i) {
+		const struct level_tileset *tileset = &map->tilesets[ i ];
+		const char *image = level_string( map, tileset->image );
+		tilesets.push_back( asset_acquire( std::string( "map/" ) + image, tileset->trans == LEVEL_NO_TRANS ? IMAGE_NO_KEY : tileset->trans ) );
 	}
 
+    build_tile_srcs();
+    build_cover();
+}
+
+void free_tilesets() {
+    for( unsigned int i = 0; i < tilesets.size(); i++ ) {
+        asset_release( tilesets[ i ] );
+    }
+    tilesets.clear();
+    tile_srcs.clear();
+    cell_cover.clear();
+}
+
+void build_tile_srcs() {
+    tile_srcs.resize( map->num_gids );
+    for( int gid = 0; gid < map->num_gids; gid++ ) {
+        const struct level_tile *tile = &map->tiles[ gid ];
+        struct tile_src *src = &tile_srcs[ gid ];
+        src->surface = tile->tileset == LEVEL_NO_TILESET ? NULL : tilesets[ tile->tileset ];
+        src->rect.x = tile->x;
+        src->rect.y = tile->y;
+        src->rect.w = tile->w;
+        src->rect.h = tile->h;
+        src->opaque =
+            src->surface && tile->w >= map->tile_width && tile->h >= map->tile_height &&
+            image_rect_is_opaque( src->surface, &src->rect );
+    }
+}
+
+// layers go behind the sprites then in front, each lot in map order
+inline int layer_order( int layer ) {
+    return map->layers[ layer ].side * map->num_layers + layer;
+}
+
+// is the layer baked into chunks at all
+inline bool layer_shown( int layer ) {
+    return !level_layer_is_parallax( map, layer ) && map->layers[ layer ].visible;
+}
+
+// does the layer bake into the side's chunks
+inline bool layer_drawn( int layer, int side ) {
+    return layer_shown( layer ) && (int)map->layers[ layer ].side == side;
 }
 
-int tile_is_solid( const Tmx::Tile *tile ) {
-    return ( tile->GetProperties().GetLiteralProperty( "solid" ) == "1" );
+int find_cover( int col, int row ) {
+    int cover = -1;
+    for (int i = 0; i < map->num_layers; i++) {
+        if( layer_shown( i ) && tile_srcs[ level_gid( map, i, col, row ) ].opaque ) {
+            cover = std::max( cover, layer_order( i ) );
+        }
+    }
+    return cover;
 }
 
-int level_is_solid_here( const Tmx::Layer *layer, int col, int row ) {
-    int tile_id = layer->GetTileId( col, row );
-    if( tile_id ) {
-        const Tmx::Tileset *tileset = map->FindTileset(tile_id);
-        const Tmx::Tile *tile = tileset->GetTile(tile_id);
-        if( tile ) {
-            // not sure why a tileid wouldn't resolve to a tile...
-            if( tile_is_solid( tile ) ) {
-                return 1;
+void build_cover() {
+    cell_cover.resize( map->width * map->height );
+    int hidden = 0;
+    for (int row = 0; row < map->height; row++) {
+        for (int col = 0; col < map->width; col++) {
+            int cover = cell_cover[ row * map->width + col ] = find_cover( col, row );
+            for (int i = 0; i < map->num_layers; i++) {
+                hidden += layer_shown( i ) && layer_order( i ) < cover && level_gid( map, i, col, row );
             }
         }
     }
-    return 0;
+    TRACE( TRACE_INFO, TRACE_MAP, "%i tiles hidden under opaque ones", hidden );
 }
 
-int map_is_solid_here( int col, int row ) {
-    for (int i = map->GetNumLayers() - 1; i >= 0; i--) {
-        const Tmx::Layer *layer = map->GetLayer(i);
-        if( level_is_solid_here( layer, col, row ) ) {
-            return 1;
+int level_is_solid_here( int layer, int col, int row ) {
+    return ( map->tiles[ level_gid( map, layer, col, row ) ].flags & LEVEL_TILE_SOLID ) != 0;
+}
+
+// flatten solidity of all layers into the packed grid, parallax layers
+// are only scenery
+// only done at load time, everything else queries the bits
+void build_solidity() {
+    solidity.w = map->width;
+    solidity.h = map->height;
+    solidity.stride = ( solidity.w + 63 ) / 64;
+    solidity.bits.assign( solidity.stride * solidity.h, 0 );
+    for (int i = 0; i < map->num_layers; i++) {
+        if( level_layer_is_parallax( map, i ) ) {
+            continue;
+        }
+        for (int row = 0; row < solidity.h; row++) {
+            for (int col = 0; col < solidity.w; col++) {
+                if( level_is_solid_here( i, col, row ) ) {
+                    solidity.bits[ row * solidity.stride + ( col >> 6 ) ] |= (Uint64)1 << ( col & 63 );
+                }
+            }
         }
     }
-    return 0;
 }
 
-//
-// return d_ti time to impact
-float intersect_with_vertical(
-    float x0, float y0, float dx, float dy, float dt,
-    float a0, float b0, float a1, float b1
-) {
-    if( a1 != a0 ) {
-        printf_debug( "woops line is not vertical\n");
-        exit(1);
+// from the level, for after one cell changed
+bool cell_is_solid( int col, int row ) {
+    bool solid = false;
+    for (int i = 0; i < map->num_layers; i++) {
+        solid = solid || ( !level_layer_is_parallax( map, i ) && level_is_solid_here( i, col, row ) );
     }
-    if( x0 <= a0 && a0 < x0 + dx*dt ) {
-        float j = y0 + ( dy / dx * (a0 - x0) );
-        if( b0 < j && j < b1 ) {
-            return (a0 - x0) / dx;
-        }
+    return solid;
+}
+
+void set_solidity( int col, int row, bool solid ) {
+    Uint64 bit = (Uint64)1 << ( col & 63 );
+    Uint64 *word = &solidity.bits[ row * solidity.stride + ( col >> 6 ) ];
+    *word = solid ? *word | bit : *word & ~bit;
+}
+
+// off-map cells are never solid
+inline int map_is_solid_here( int col, int row ) {
+    if( col < 0 || col >= solidity.w || row < 0 || row >= solidity.h ) {
+        return 0;
     }
-    // no intersection
-    return -1.0f;
+    return ( solidity.bits[ row * solidity.stride + ( col >> 6 ) ] >> ( col & 63 ) ) & 1;
 }
 
-float intersect_with_horizontal(
-    float x0, float y0, float dx, float dy, float dt,
-    float a0, float b0, float a1, float b1
-) {
-    if( b1 != b0 ) {
-        printf_debug( "woops line is not vertical\n");
-        exit(1);
+// is any cell in cols col0..col1 (inclusive) of this row solid?
+int map_span_is_solid( int row, int col0, int col1 ) {
+    if( row < 0 || row >= solidity.h ) {
+        return 0;
+    }
+    col0 = std::max( col0, 0 );
+    col1 = std::min( col1, solidity.w - 1 );
+    if( col0 > col1 ) {
+        return 0;
+    }
+    const Uint64 *line = &solidity.bits[ row * solidity.stride ];
+    int w0 = col0 >> 6;
+    int w1 = col1 >> 6;
+    Uint64 lo = ~(Uint64)0 << ( col0 & 63 );
+    Uint64 hi = ~(Uint64)0 >> ( 63 - ( col1 & 63 ) );
+    if( w0 == w1 ) {
+        return ( line[w0] & lo & hi ) != 0;
     }
-    if( y0 <= b0 && b0 < y0 + dy*dt ) {
-        float j = x0 + ( dx / dy * (b0 - y0) );
-        if( a0 < j && j < a1 ) {
-            return (b0 - y0) / dy;
+    if( line[w0] & lo ) {
+        return 1;
+    }
+    for( int w = w0 + 1; w < w1; w++ ) {
+        if( line[w] ) {
+            return 1;
         }
     }
-    // no intersection
-    return -1.0f;
+    return ( line[w1] & hi ) != 0;
 }
 
-// iterate blocks in quadrants
-// if dx and dy both > 0, analyse top right quadrant
-// use of sgn(0) == 0 means special case dx or dy == 0 results in horizontal line
-struct contact find_intersection_with_solid(
-    float x, float y,
-    float dx, float dy,
-    float dt
-) {
-    int col = x / map->GetTileWidth();
-    int row = y / map->GetTileWidth();
-    printf_debug( "corner col: %i, %i\n", col, row );
-    int colinc = std::copysign( 1, dx );
-    int rowinc = std::copysign( 1, dy );
-    for(
-        int blockdist = 1;
-        //blockdist <= std::max( 1, (int)(2 * dt * (abs(dx) + abs(dy)) / map->GetTileWidth()) );
-        blockdist <= 3;
-        blockdist++
-    ) {
-        //printf_debug( "blockdist: %i\n", blockdist );
-        int rc = row;
-        for(
-            int cc = col + (colinc * blockdist);
-            cc + colinc != col;
-            cc -= colinc
-        ) {
-            printf_debug( "  cc: %i\n", cc );
-            /*for(
-                int rc = row;
-                rc != row + (rowinc * blockdist);
-                rc += rowinc
-            )*/ {
-                printf_debug( "  rc: %i\n", rc );
-                float intersect = -1.0;
-                if( cc >= map->GetWidth() || cc < 0 || rc >= map->GetHeight() || rc < 0 ) {
-                    continue;
+inline void add_contact_cell( struct contact *impact, int col, int row ) {
+    if( impact->cells < MAX_CONTACT_CELLS ) {
+        impact->cell_col[ impact->cells ] = col;
+        impact->cell_row[ impact->cells ] = row;
+        impact->cells++;
+    }
+}
+
+// sweep the box x,y,w,h along dx,dy for up to dt and find the first solid
+// cell it runs into
+//
+// rather than testing a fixed block of cells, step through the grid lines
+// the leading edges cross in the order they cross them (like a DDA line
+// walk) and at each one test just the cells the box face is over at that
+// moment, so cost follows distance travelled and the first hit found is
+// the earliest. returns t2i -1.0 if nothing is hit before dt
+struct contact sweep_box( float x, float y, float w, float h, float dx, float dy, float dt ) {
+    struct contact impact = { -1.0, 0.0, 0.0, 0 };
+    const float never = dt + 1.0;
+    const int tw = map->tile_width;
+    const int th = map->tile_height;
+
+    // next vertical grid line the leading x face reaches, and when
+    int col = 0;
+    float next_tx = never;
+    float delta_tx = never;
+    if( dx > 0 ) {
+        col = (int)ceil( ( x + w ) / tw );
+        next_tx = ( col * tw - ( x + w ) ) / dx;
+        delta_tx = tw / dx;
+    } else if( dx < 0 ) {
+        col = (int)floor( x / tw );
+        next_tx = ( col * tw - x ) / dx;
+        delta_tx = -tw / dx;
+    }
+    // and the same for horizontal lines and the leading y face
+    int row = 0;
+    float next_ty = never;
+    float delta_ty = never;
+    if( dy > 0 ) {
+        row = (int)ceil( ( y + h ) / th );
+        next_ty = ( row * th - ( y + h ) ) / dy;
+        delta_ty = th / dy;
+    } else if( dy < 0 ) {
+        row = (int)floor( y / th );
+        next_ty = ( row * th - y ) / dy;
+        delta_ty = -th / dy;
+    }
+
+    while( true ) {
+        float t = std::max( 0.0f, std::min( next_tx, next_ty ) );
+        // resting against something at the very end isn't a hit this step
+        if( t >= dt ) {
+            break;
+        }
+        // both when a corner crosses a line in each direction at once
+        bool step_x = next_tx <= next_ty;
+        bool step_y = next_ty <= next_tx;
+        if( step_x ) {
+            // x face is on line col, test the column ahead over the rows it spans
+            int c = dx > 0 ? col : col - 1;
+            float top = y + dy * t;
+            for( int r = (int)floor( top / th ); r <= (int)ceil( ( top + h ) / th ) - 1; r++ ) {
+                if( map_is_solid_here( c, r ) ) {
+                    impact.rx = dx > 0 ? -1.0 : 1.0;
+                    add_contact_cell( &impact, c, r );
                 }
-                if( map_is_solid_here( cc, rc ) ) {
-                    if( dx > 0 ) {
-                        // left edge
-                        intersect = intersect_with_vertical(
-                            x, y, dx, dy, dt,
-                            cc * map->GetTileWidth(),
-                            rc * map->GetTileHeight(),
-                            cc * map->GetTileWidth(),
-                            (rc + 1) * map->GetTileHeight()
-                        );
-                        if( intersect >= 0.0 ) {
-                            return { intersect, -1.0, 0.0 };
-                        }
-                    }
-                    if( dx < 0 ) {
-                        // right edge
-                        intersect = intersect_with_vertical(
-                            x, y, dx, dy, dt,
-                            (cc + 1) * map->GetTileWidth(),
-                            rc * map->GetTileHeight(),
-                            (cc + 1) * map->GetTileWidth(),
-                            (rc + 1) * map->GetTileHeight()
-                        );
-                        if( intersect >= 0.0 ) {
-                            return { intersect, 1.0, 0.0 };
-                        }
-                    }
-                    if( dy > 0 ) {
-                        // top edge
-                        intersect = intersect_with_horizontal(
-                            x, y + 1, dx, dy, dt,
-                            cc * map->GetTileWidth(),
-                            rc * map->GetTileHeight(),
-                            (cc + 1) * map->GetTileWidth(),
-                            rc * map->GetTileHeight()
-                        );
-                        printf_debug( "%f, %f - %i, %i : %f\n", x/map->GetTileWidth(), y/map->GetTileWidth(), cc, rc, intersect );
-                        if( intersect >= 0.0 ) {
-                            printf_debug( "boom \n" );
-                            return { intersect, 0.0, -1.0 };
-                        }
-                    }
-                    if( dy < 0 ) {
-                        // bottom edge
-                        intersect = intersect_with_horizontal(
-                            x, y, dx, dy, dt,
-                            cc * map->GetTileWidth(),
-                            (rc + 1) * map->GetTileHeight(),
-                            (cc + 1) * map->GetTileWidth(),
-                            (rc + 1) * map->GetTileHeight()
-                        );
-                        if( intersect >= 0.0 ) {
-                            return { intersect, 0.0, 1.0 };
-                        }
+            }
+        }
+        if( step_y ) {
+            // y face is on line row, test the row ahead over the columns it spans
+            int r = dy > 0 ? row : row - 1;
+            float left = x + dx * t;
+            int c0 = (int)floor( left / tw );
+            int c1 = (int)ceil( ( left + w ) / tw ) - 1;
+            if( map_span_is_solid( r, c0, c1 ) ) {
+                impact.ry = dy > 0 ? -1.0 : 1.0;
+                for( int c = c0; c <= c1; c++ ) {
+                    if( map_is_solid_here( c, r ) ) {
+                        add_contact_cell( &impact, c, r );
                     }
                 }
             }
-            rc += rowinc;
+        }
+        if( impact.cells > 0 ) {
+            impact.t2i = t;
+            break;
+        }
+        // step past whichever line(s) we just tested
+        if( step_x ) {
+            next_tx += delta_tx;
+            col += dx > 0 ? 1 : -1;
+        }
+        if( step_y ) {
+            next_ty += delta_ty;
+            row += dy > 0 ? 1 : -1;
         }
     }
-    //return -1.0;
-    return { -1.0, 0.0, 0.0 };
+    return impact;
 }
 
 // returns the next solid block below
 int find_surface_down( int x, int y ) {
-    int col = x / map->GetTileWidth();
-    for( int level = y / map->GetTileHeight(); level < map->GetHeight(); level ++ ) {
-        for (int i = map->GetNumLayers() - 1; i >= 0; i--) {
-            const Tmx::Layer *layer = map->GetLayer(i);
-            if( col < 0 || col >= layer->GetWidth() || level < 0 || level > layer->GetHeight() ) {
-                continue;
-            }
-            if( level_is_solid_here( layer, col, level ) ) {
-                return level * map->GetTileHeight();
-            }
+    int col = x / map->tile_width;
+    for( int level = std::max( 0, y / map->tile_height ); level < map->height; level ++ ) {
+        if( map_is_solid_here( col, level ) ) {
+            return level * map->tile_height;
         }
     }
     // bottom of map
-    return map->GetHeight() * map->GetTileHeight();
+    return map->height * map->tile_height;
 }
 
 // returns the next solid block below
 int find_surface_up( int x, int y ) {
-    int col = x / map->GetTileWidth();
-    for( int level = y / map->GetTileHeight(); level >= 0; level -- ) {
-        for (int i = map->GetNumLayers() - 1; i >= 0; i--) {
-            const Tmx::Layer *layer = map->GetLayer(i);
-            if( col < 0 || col >= layer->GetWidth() || level < 0 || level > layer->GetHeight() ) {
-                continue;
-            }
-            if( level_is_solid_here( layer, col, level ) ) {
-                return level * map->GetTileHeight();
-            }
+    int col = x / map->tile_width;
+    for( int level = std::min( map->height - 1, y / map->tile_height ); level >= 0; level -- ) {
+        if( map_is_solid_here( col, level ) ) {
+            return level * map->tile_height;
         }
     }
     // bottom of map
-    return map->GetHeight() * map->GetTileHeight();
+    return map->height * map->tile_height;
 }
 
-const Tmx::Tile *get_tile_by_coords( int x, int y ) {
-    int col = x / map->GetTileWidth();
-    int row = y / map->GetTileHeight();
-    for (int i = map->GetNumLayers() - 1; i >= 0; i--) {
-        const Tmx::Layer *layer = map->GetLayer(i);
-        if( col < 0 || col >= layer->GetWidth() || row < 0 || row > layer->GetHeight() ) {
-            continue;
-        }
-        int tile_id = layer->GetTileId( col, row );
-        if( tile_id > 0 ) {
-            const Tmx::Tileset *tileset = map->FindTileset(tile_id);
-            const Tmx::Tile *tile = tileset->GetTile(tile_id);
-            if( tile ) {
-                return tile;
-            }
+const struct level_tile *get_tile_by_coords( int x, int y ) {
+    int col = x / map->tile_width;
+    int row = y / map->tile_height;
+    if( col < 0 || col >= map->width || row < 0 || row >= map->height ) {
+        return NULL;
+    }
+    for (int i = map->num_layers - 1; i >= 0; i--) {
+        int gid = level_layer_is_parallax( map, i ) ? 0 : level_gid( map, i, col, row );
+        if( gid ) {
+            return &map->tiles[ gid ];
         }
     }
     return NULL;
@@ -397,225 +462,724 @@ const Tmx::Tile *get_tile_by_coords( int x, int y ) {
 
 
 SDL_Surface *init_background() {
-    // create surface for background using default bit masks
-    return SDL_CreateRGBSurface( SDL_HWSURFACE, map->GetWidth() * TW, map->GetHeight() * TH, 32, 0, 0, 0, 0 );
+    // create surface for background in the screen format
+    return create_display_surface( map->width * TW, map->height * TH );
 }
 
-int render_map( int v_x, int v_y, SDL_Surface *destination ) {
-                //Tmx::Tile *tile = *(tileset->GetTiles().begin());
-                //tile_is_solid( tile )
-
-	// Iterate through the layers.
-    // test std::min( 0, 4 );
-
-    for (int y = 0; y < map->GetHeight(); ++y) {
-        for (int x = 0; x < map->GetWidth(); ++x) {
-            // iterate in reverse so we get top layer first
-            for (int i = map->GetNumLayers() - 1; i >= 0; i--) {
-                const Tmx::Layer *layer = map->GetLayer(i);
-                int tile_id = layer->GetTileId(x, y);
-                if( tile_id ) {
-                    const Tmx::Tileset *tileset = map->FindTileset(tile_id);
-                    const Tmx::Tile *tile = tileset->GetTile(tile_id);
-                    if( tile ) {
-                        // not sure why a tileid wouldn't resolve to a tile...
-                        if( tile_is_solid( tile ) ) {
-                            // TODO
-                        } else {
-                            // TODO
-                        }
-                    } else {
-                        // we have to construct a tile ourselves!
-                        // TODO
-                    }
-                    // This is all very shit - TODO modify TmxParser to calculate this crap for you
-                    // TODO margin and spacing compensation
-                    int tileset_cols = tileset->GetImage()->GetWidth() / tileset->GetTileWidth();
-                    int tileset_rows = tileset->GetImage()->GetHeight() / tileset->GetTileHeight();
-                    int tile_index = tile_id;
-                    int col = ( tile_index % tileset_cols );
-                    int row = ( tile_index / tileset_cols );
-                    apply_tile(
-                        col * ( tileset->GetSpacing() + tileset->GetTileWidth() ) + tileset->GetMargin(),
-                        row * ( tileset->GetSpacing() + tileset->GetTileHeight() ) + tileset->GetMargin(),
-                        tilesets[ tileset->GetImage()->GetSource() ], x * TW, y * TH, destination
-                    );
-                    //we only really care about the top tile for now
-                    break;
-                } else {
-                    //Nuffin 'ere at all
-                }
-            }
+// draw the side's layers in one cell at dx,dy in destination, from its
+// cover up so nothing is drawn only to be drawn over. Returns the number
+// of tiles, just counting them if destination is NULL
+int render_map_cell( int side, int col, int row, SDL_Surface *destination, int dx, int dy, bool direct = false ) {
+    int drawn = 0;
+    int cover = cell_cover[ row * map->width + col ];
+    for (int i = 0; i < map->num_layers; i++) {
+        int gid = layer_drawn( i, side ) && layer_order( i ) >= cover ? level_gid( map, i, col, row ) : 0;
+        if( !gid ) {
+            continue;
         }
-	}
+        drawn++;
+        if( destination == NULL ) {
+            continue;
+        }
+        // direct is safe off the main thread, see blit.h
+        if( direct ) {
+            blit_rect( tile_srcs[ gid ].surface, &tile_srcs[ gid ].rect, destination, dx, dy, std::max( blit_level(), (int)BLIT_SCALAR ) );
+        } else {
+            apply_tile( &tile_srcs[ gid ], dx, dy, destination );
+        }
+    }
+    return drawn;
+}
 
-    return 1;
+// bake the side's layers over a cols x rows block of the map starting at
+// col0,row0 into destination, with the block's top left corner at 0,0.
+// Returns the number of tiles, as render_map_cell
+int render_map_region( int side, int col0, int row0, int cols, int rows, SDL_Surface *destination, bool direct = false ) {
+    int drawn = 0;
+    for (int y = row0; y < std::min( row0 + rows, map->height ); ++y) {
+        for (int x = col0; x < std::min( col0 + cols, map->width ); ++x) {
+            drawn += render_map_cell( side, x, y, destination, ( x - col0 ) * TW, ( y - row0 ) * TH, direct );
+        }
+    }
+    return drawn;
 }
 
-// ************* Sprite classes ******************8
+int render_map( int v_x, int v_y, SDL_Surface *destination ) {
+    return render_map_region( LEVEL_BEHIND, 0, 0, map->width, map->height, destination );
+}
 
-class Sprite {
-    public:
-	    float x;
-	    float y;
-        Sprite();
-        virtual ~Sprite();
-        SDL_Surface *sprite_sheet;
-        //struct sprite_frame *frames;
-        int current_animation;
-        struct animation *animations;
+// ************* parallax layers ******************
+//
+// layers with a parallax or image property scroll at their own rate
+// behind the map. Each is baked once into a strip as wide as the map
+// holding just the rows it uses, then wrapped across the screen, so a
+// layer costs a blit or two a frame. Wherever the map's own tiles are all
+// opaque none of them are drawn at all.
+
+const Uint32 PARALLAX_KEY = 0xff00ff; // see-through, in strips and chunks
+
+struct parallax_layer {
+    SDL_Surface *strip;
+    bool shared; // an image asset, released rather than freed
+    bool opaque; // nothing behind shows through
+    float scroll_x;
+    float scroll_y;
+    int top; // px, where the strip sits with the camera at 0,0
+};
+struct parallax {
+    std::vector<struct parallax_layer> layers; // back to front
+    // 2D Fenwick tree of the cells the map leaves uncovered, so any
+    // rectangle of them can be counted, or one cell changed, in
+    // log width * log height steps
+    std::vector<int> holes; // ( width + 1 ) * ( height + 1 )
 };
-Sprite::Sprite() {
-    x = 0.0;
-    y = 0.0;
-}
-Sprite::~Sprite() {
-    //
-}
 
+// fill with the key colour and make that see-through, not RLE since
+// tiles are still to be drawn into it
+void key_surface( SDL_Surface *surface ) {
+    Uint32 key = SDL_MapRGB( surface->format, PARALLAX_KEY >> 16, ( PARALLAX_KEY >> 8 ) & 0xff, PARALLAX_KEY & 0xff );
+    SDL_FillRect( surface, NULL, key );
+    SDL_SetColorKey( surface, SDL_SRCCOLORKEY, key );
+}
 
-class NinjaPlayer: public Sprite {
-	public:
-        const static int RUN_LEFT = 0;
-        const static int RUN_RIGHT = 1;
-        const static int STAND_LEFT = 2;
-        const static int STAND_RIGHT = 3;
+void parallax_bake_tiles( struct parallax_layer *pl, int layer ) {
+    int top = map->height;
+    int bottom = 0;
+    for( int row = 0; row < map->height; row++ ) {
+        for( int col = 0; col < map->width; col++ ) {
+            if( level_gid( map, layer, col, row ) ) {
+                top = std::min( top, row );
+                bottom = row + 1;
+            }
+        }
+    }
+    pl->strip = NULL;
+    if( top >= bottom ) {
+        return;
+    }
+    pl->opaque = true;
+    for( int row = top; row < bottom; row++ ) {
+        for( int col = 0; col < map->width; col++ ) {
+            pl->opaque = pl->opaque && tile_srcs[ level_gid( map, layer, col, row ) ].opaque;
+        }
+    }
+    pl->strip = create_display_surface( map->width * TW, ( bottom - top ) * TH );
+    if( !pl->opaque ) {
+        key_surface( pl->strip );
+    }
+    for( int row = top; row < bottom; row++ ) {
+        for( int col = 0; col < map->width; col++ ) {
+            int gid = level_gid( map, layer, col, row );
+            if( gid ) {
+                apply_tile( &tile_srcs[ gid ], col * TW, ( row - top ) * TH, pl->strip );
+            }
+        }
+    }
+    pl->top = top * TH;
+}
 
-        int frame_count;
-        float last_frame_timer;
-        float frame_timer;
+void parallax_add_hole( struct parallax *p, int col, int row, int n ) {
+    int w = map->width + 1;
+    for( int r = row + 1; r <= map->height; r += r & -r ) {
+        for( int c = col + 1; c <= map->width; c += c & -c ) {
+            p->holes[ r * w + c ] += n;
+        }
+    }
+}
 
-        float dx;
-        float dy;
-        float jump_dy; // -900.0// initial jump velocity
-        float run_ddx; //3000.0; // p/s^2
+// uncovered cells in the cols and rows before col, row
+int parallax_holes_before( const struct parallax *p, int col, int row ) {
+    int w = map->width + 1;
+    int n = 0;
+    for( int r = row; r > 0; r -= r & -r ) {
+        for( int c = col; c > 0; c -= c & -c ) {
+            n += p->holes[ r * w + c ];
+        }
+    }
+    return n;
+}
 
-        float walkspeed; // p/s^2
-        float runspeed; // p/s^2
-        float top_speed;
+// strips for the visible parallax layers and the map's holes, needs the
+// tilesets loaded and the cover built
+void parallax_init( struct parallax *p ) {
+    for( int i = 0; i < map->num_layers; i++ ) {
+        const struct level_layer *layer = &map->layers[ i ];
+        if( !level_layer_is_parallax( map, i ) || !layer->visible ) {
+            continue;
+        }
+        struct parallax_layer pl;
+        pl.scroll_x = layer->scroll_x;
+        pl.scroll_y = layer->scroll_y;
+        pl.shared = layer->image != LEVEL_NO_IMAGE;
+        if( pl.shared ) {
+            pl.strip = asset_acquire( std::string( "map/" ) + level_string( map, layer->image ) );
+            pl.top = 0;
+            if( pl.strip ) {
+                SDL_Rect all = { 0, 0, (Uint16)pl.strip->w, (Uint16)pl.strip->h };
+                pl.opaque = image_rect_is_opaque( pl.strip, &all );
+            }
+        } else {
+            parallax_bake_tiles( &pl, i );
+        }
+        if( pl.strip ) {
+            p->layers.push_back( pl );
+        }
+    }
+    TRACE( TRACE_INFO, TRACE_RENDER, "%i parallax layers", (int)p->layers.size() );
+    if( p->layers.empty() ) {
+        return;
+    }
+    p->holes.assign( ( map->width + 1 ) * ( map->height + 1 ), 0 );
+    for( int row = 0; row < map->height; row++ ) {
+        for( int col = 0; col < map->width; col++ ) {
+            if( cell_cover[ row * map->width + col ] < 0 ) {
+                parallax_add_hole( p, col, row, 1 );
+            }
+        }
+    }
+}
 
-        bool jump_powering;
-        int jump_start;
-        int jump_power_time; // ms
+void parallax_free( struct parallax *p ) {
+    for( unsigned int i = 0; i < p->layers.size(); i++ ) {
+        if( p->layers[ i ].shared ) {
+            asset_release( p->layers[ i ].strip );
+        } else {
+            SDL_FreeSurface( p->layers[ i ].strip );
+        }
+    }
+    p->layers.clear();
+    p->holes.clear();
+}
 
-        NinjaPlayer();
-        virtual ~NinjaPlayer();
+// uncovered cells in cols c0..c1, rows r0..r1, ends exclusive
+int parallax_holes( const struct parallax *p, int c0, int r0, int c1, int r1 ) {
+    c0 = std::max( c0, 0 );
+    r0 = std::max( r0, 0 );
+    c1 = std::min( c1, map->width );
+    r1 = std::min( r1, map->height );
+    if( p->holes.empty() || c0 >= c1 || r0 >= r1 ) {
+        return 0;
+    }
+    return parallax_holes_before( p, c1, r1 ) - parallax_holes_before( p, c0, r1 ) -
+        parallax_holes_before( p, c1, r0 ) + parallax_holes_before( p, c0, r0 );
+}
 
-        void animate( float tdelta );
+// the layers showing through the map in viewport vp, back to front from
+// the nearest one that hides everything behind it
+void draw_parallax( const struct parallax *p, SDL_Rect vp, SDL_Surface *destination ) {
+    int holes = parallax_holes(
+        p, vp.x / TW, vp.y / TH, ( vp.x + vp.w + TW - 1 ) / TW, ( vp.y + vp.h + TH - 1 ) / TH
+    );
+    if( holes == 0 ) {
+        return;
+    }
+    int first = 0;
+    for( int i = (int)p->layers.size() - 1; i > 0; i-- ) {
+        const struct parallax_layer *pl = &p->layers[ i ];
+        int y = pl->top - (int)( vp.y * pl->scroll_y );
+        if( pl->opaque && y <= 0 && y + pl->strip->h >= destination->h ) {
+            first = i;
+            break;
+        }
+    }
+    for( int i = first; i < (int)p->layers.size(); i++ ) {
+        const struct parallax_layer *pl = &p->layers[ i ];
+        int y = pl->top - (int)( vp.y * pl->scroll_y );
+        if( y >= destination->h || y + pl->strip->h <= 0 ) {
+            continue;
+        }
+        int w = pl->strip->w;
+        int offset = (int)( vp.x * pl->scroll_x ) % w;
+        if( offset < 0 ) {
+            offset += w;
+        }
+        // one strip's width at a time, so narrow strips repeat
+        for( int x = 0; x < destination->w; x += w ) {
+            apply_tiling_surface( x, y, std::min( w, destination->w - x ), offset, pl->strip, destination );
+        }
+    }
+}
 
-        void walk();
-        void run();
-        void jump( int time, int floor_left, int floor_right );
-        void jump( int time, struct contact touching );
-        void left( float tdelta );
-        void right( float tdelta );
+// ************* background chunk cache ******************
+//
+// rather than baking the whole map into one surface, bake CHUNK_TILES
+// square blocks as the viewport approaches them and throw away the least
+// recently drawn ones once we're over budget, so memory follows the
+// screen size instead of the level size
 
-        void updateKinematics( float tdelta );
-        SDL_Rect getCurrentFrame();
-        // find if we're overlapping a tile while travelling
-        void collision();
+const int CHUNK_TILES = 8;
+const int CHUNK_BUDGET = 6 * 1024 * 1024; // bytes
 
-        int xleft() { return (int)x; }
-        int xright() { return (int)x+fr_w; }
-        int ytop() { return (int)y; }
-        int ybottom() { return (int)y+fr_h; }
-        int set_xleft( int nx ) { x = (float)nx; }
-        int set_xright( int nx ) { x = (float)(nx - fr_w); }
-        int set_ytop( int ny ) { y = (float)ny; }
-        int set_ybottom( int ny ) { y = (float)( ny - fr_h ); }
+struct bg_chunk {
+    SDL_Surface *surface; // NULL if there's nothing on this side here
+    Uint32 last_used; // frame it was last drawn or prefetched
+};
+struct chunk_cache {
+    std::map<int, struct bg_chunk> chunks; // keyed by chunk_key()
+    int across;
+    int down;
+    int bytes;
+    Uint32 frame;
+    struct worker_pool pool; // bakes missing chunks in parallel
+    struct parallax *behind; // chunks over its holes are see-through
+};
 
-        struct contact map_collisions( float dt );
+inline int chunk_key( const struct chunk_cache *cache, int side, int ccol, int crow ) {
+    return ( side * cache->down + crow ) * cache->across + ccol;
+}
 
-        short fr_w;
-        short fr_h;
+inline int chunk_bytes( SDL_Surface *surface ) {
+    return surface ? surface->pitch * surface->h : 0;
+}
 
-};
+void chunk_cache_init( struct chunk_cache *cache, struct parallax *behind ) {
+    cache->behind = behind;
+    cache->across = ( map->width + CHUNK_TILES - 1 ) / CHUNK_TILES;
+    cache->down = ( map->height + CHUNK_TILES - 1 ) / CHUNK_TILES;
+    cache->bytes = 0;
+    cache->frame = 0;
+    workers_start( &cache->pool );
+}
 
-void NinjaPlayer::collision() {
-    if( dx > 0 ) {
+void chunk_cache_free( struct chunk_cache *cache ) {
+    for( std::map<int, struct bg_chunk>::iterator it = cache->chunks.begin(); it != cache->chunks.end(); ++it ) {
+        SDL_FreeSurface( it->second.surface );
     }
+    cache->chunks.clear();
+    cache->bytes = 0;
+    workers_stop( &cache->pool );
 }
 
-NinjaPlayer::NinjaPlayer() {
-    frame_count = 0;
-    last_frame_timer = 0.0;
-    frame_timer = 0.0;
-
-    fr_w = 42;
-    fr_h = 50;
+// drop least recently used chunks, but never one wanted this frame
+void chunk_cache_evict( struct chunk_cache *cache ) {
+    while( cache->bytes > CHUNK_BUDGET ) {
+        std::map<int, struct bg_chunk>::iterator oldest = cache->chunks.end();
+        for( std::map<int, struct bg_chunk>::iterator it = cache->chunks.begin(); it != cache->chunks.end(); ++it ) {
+            if( oldest == cache->chunks.end() || it->second.last_used < oldest->second.last_used ) {
+                oldest = it;
+            }
+        }
+        if( oldest == cache->chunks.end() || oldest->second.last_used == cache->frame ) {
+            return;
+        }
+        cache->bytes -= chunk_bytes( oldest->second.surface );
+        SDL_FreeSurface( oldest->second.surface );
+        cache->chunks.erase( oldest );
+    }
+}
 
-    dx = 0.0;
-    dy = 0.0;
-    jump_dy = -500.0; // -900.0// initial jump velocity
-    run_ddx = 4000.0; //3000.0; // p/s^2
+// an empty chunk, or NULL if the side has no tiles there. Front chunks
+// and those over a parallax layer's holes are keyed so what's behind them
+// shows through
+SDL_Surface *chunk_cache_surface( struct chunk_cache *cache, int side, int ccol, int crow, int cols, int rows ) {
+    int c0 = ccol * CHUNK_TILES;
+    int r0 = crow * CHUNK_TILES;
+    if( render_map_region( side, c0, r0, cols, rows, NULL ) == 0 ) {
+        return NULL;
+    }
+    SDL_Surface *surface = create_display_surface( cols * TW, rows * TH );
+    if( side == LEVEL_FRONT || parallax_holes( cache->behind, c0, r0, c0 + cols, r0 + rows ) > 0 ) {
+        key_surface( surface );
+    }
+    return surface;
+}
 
-    walkspeed = 400.0; // p/s^2
-    runspeed = 600.0; // p/s^2
+// a batch of chunks being baked at once, one job each
+struct chunk_bake {
+    int across;
+    int down;
+    bool direct;
+    std::vector<int> keys;
+    std::vector<SDL_Surface *> surfaces;
+};
 
-    jump_powering = false;
-    jump_start = 0;
-    jump_power_time = 150; // ms
-	sprite_sheet = load_image( "player_2.png" );
-
-    animations = new animation[4];
-    short fr_w = 42;
-    short fr_h = 50;
-    const struct animation animation_template = {};
-    animations[RUN_RIGHT].frames = new struct sprite_frame[30];
-    animations[RUN_RIGHT].count = 30;
-    for( short f_c = 0; f_c < 30; f_c ++ ) {
-        animations[RUN_RIGHT].frames[ f_c ] = { { (short) (f_c * fr_w), 0, fr_w, fr_h }, 0.01 };
-    }
-    animations[RUN_LEFT].frames = new struct sprite_frame[30];
-    animations[RUN_LEFT].count = 30;
-    for( short f_c = 0; f_c < 30; f_c ++ ) {
-        animations[RUN_LEFT].frames[ f_c ] = { { (short) (f_c * fr_w), fr_h, fr_w, fr_h }, 0.01 };
-    }
-    animations[STAND_RIGHT].frames = new struct sprite_frame[30];
-    animations[STAND_RIGHT].count = 1;
-    for( short f_c = 0; f_c < 1; f_c ++ ) {
-        animations[STAND_RIGHT].frames[ f_c ] = { { (short) (f_c * fr_w), (short)(fr_h * 2), fr_w, fr_h }, 0.01 };
-    }
-    animations[STAND_LEFT].frames = new struct sprite_frame[30];
-    animations[STAND_LEFT].count = 1;
-    for( short f_c = 0; f_c < 1; f_c ++ ) {
-        animations[STAND_LEFT].frames[ f_c ] = { { (short) (f_c * fr_w), (short)(fr_h * 3), fr_w, fr_h }, 0.01 };
-    }
-    current_animation = RUN_LEFT;
-    top_speed = runspeed;
+void chunk_bake_job( void *data, int index ) {
+    struct chunk_bake *bake = (struct chunk_bake *)data;
+    int key = bake->keys[ index ];
+    int ccol = key % bake->across;
+    int crow = key / bake->across % bake->down;
+    int side = key / bake->across / bake->down;
+    render_map_region( side, ccol * CHUNK_TILES, crow * CHUNK_TILES, CHUNK_TILES, CHUNK_TILES, bake->surfaces[ index ], bake->direct );
 }
 
-NinjaPlayer::~NinjaPlayer() {
-    delete animations[RUN_LEFT].frames;
-    delete animations[RUN_RIGHT].frames;
-    delete animations;
-	SDL_FreeSurface( sprite_sheet );
+// can tiles go into surface with blit_rect, so off the main thread
+bool tiles_can_copy( SDL_Surface *surface ) {
+    for( unsigned int i = 0; i < tilesets.size(); i++ ) {
+        if( tilesets[ i ] == NULL || blit_kind( tilesets[ i ], surface ) == BLIT_NONE ) {
+            return false;
+        }
+    }
+    return true;
 }
-void NinjaPlayer::animate( float tdelta ) {
-    if( dx > 0.1 ) {
-        current_animation = RUN_RIGHT;
-    } else if( dx < -0.1 ) {
-        current_animation = RUN_LEFT;
-    } else {
-        if( current_animation == RUN_LEFT ) {
-            current_animation = STAND_LEFT;
-        } else if( current_animation == RUN_RIGHT ) {
-            current_animation = STAND_RIGHT;
+
+void lock_surfaces( const std::vector<SDL_Surface *> &surfaces ) {
+    for( unsigned int i = 0; i < surfaces.size(); i++ ) {
+        if( SDL_MUSTLOCK( surfaces[ i ] ) ) {
+            SDL_LockSurface( surfaces[ i ] );
         }
-        // else don't change it
     }
-    frame_timer += ( ( pow( abs(dx) / runspeed, 0.5 ) ) * tdelta );
-    if( frame_timer >= last_frame_timer + animations[ current_animation ].frames[ frame_count ].duration ) {
-        frame_timer = 0.0;
-        last_frame_timer = 0.0;
-        frame_count += 1;
-        if( frame_count > animations[ current_animation ].count - 1 ) {
-            frame_count = 0;
+}
+
+void unlock_surfaces( const std::vector<SDL_Surface *> &surfaces ) {
+    for( unsigned int i = 0; i < surfaces.size(); i++ ) {
+        if( SDL_MUSTLOCK( surfaces[ i ] ) ) {
+            SDL_UnlockSurface( surfaces[ i ] );
         }
     }
 }
-void NinjaPlayer::updateKinematics( float tdelta ) {
-    if( dx < -1.0 * top_speed ) {
+
+// bake every chunk of the side in c0,r0 - c1,r1 that isn't already, split
+// across the pool when the tiles allow it and one after another when they
+// don't. Those already baked count as used this frame
+void chunk_cache_bake( struct chunk_cache *cache, int side, int c0, int r0, int c1, int r1 ) {
+    struct chunk_bake bake;
+    bake.across = cache->across;
+    bake.down = cache->down;
+    for( int crow = r0; crow <= r1; crow++ ) {
+        for( int ccol = c0; ccol <= c1; ccol++ ) {
+            int key = chunk_key( cache, side, ccol, crow );
+            std::map<int, struct bg_chunk>::iterator it = cache->chunks.find( key );
+            if( it != cache->chunks.end() ) {
+                it->second.last_used = cache->frame;
+                continue;
+            }
+            // edge chunks are cut short by the map
+            int cols = std::min( CHUNK_TILES, map->width - ccol * CHUNK_TILES );
+            int rows = std::min( CHUNK_TILES, map->height - crow * CHUNK_TILES );
+            struct bg_chunk chunk;
+            chunk.surface = chunk_cache_surface( cache, side, ccol, crow, cols, rows );
+            chunk.last_used = cache->frame;
+            cache->chunks[ key ] = chunk;
+            cache->bytes += chunk_bytes( chunk.surface );
+            if( chunk.surface ) {
+                bake.keys.push_back( key );
+                bake.surfaces.push_back( chunk.surface );
+            }
+        }
+    }
+    if( bake.keys.empty() ) {
+        return;
+    }
+    bake.direct = tiles_can_copy( bake.surfaces[ 0 ] );
+    if( !bake.direct ) {
+        for( unsigned int i = 0; i < bake.keys.size(); i++ ) {
+            chunk_bake_job( &bake, i );
+        }
+        return;
+    }
+    // locked here, on this thread, so the workers only see plain pixels
+    lock_surfaces( tilesets );
+    lock_surfaces( bake.surfaces );
+    workers_run( &cache->pool, bake.keys.size(), chunk_bake_job, &bake );
+    unlock_surfaces( bake.surfaces );
+    unlock_surfaces( tilesets );
+    TRACE( TRACE_DEBUG, TRACE_RENDER, "baked %i chunks on %i threads", (int)bake.keys.size(), cache->pool.num_threads + 1 );
+}
+
+SDL_Surface *chunk_cache_get( struct chunk_cache *cache, int side, int ccol, int crow ) {
+    int key = chunk_key( cache, side, ccol, crow );
+    std::map<int, struct bg_chunk>::iterator it = cache->chunks.find( key );
+    if( it != cache->chunks.end() ) {
+        it->second.last_used = cache->frame;
+        return it->second.surface;
+    }
+    // edge chunks are cut short by the map
+    int cols = std::min( CHUNK_TILES, map->width - ccol * CHUNK_TILES );
+    int rows = std::min( CHUNK_TILES, map->height - crow * CHUNK_TILES );
+    struct bg_chunk chunk;
+    chunk.surface = chunk_cache_surface( cache, side, ccol, crow, cols, rows );
+    chunk.last_used = cache->frame;
+    if( chunk.surface ) {
+        render_map_region( side, ccol * CHUNK_TILES, crow * CHUNK_TILES, cols, rows, chunk.surface );
+    }
+    cache->chunks[ key ] = chunk;
+    cache->bytes += chunk_bytes( chunk.surface );
+    return chunk.surface;
+}
+
+// redraw one edited cell in the chunks holding it, or drop a chunk to be
+// baked afresh when it's empty or should now be keyed differently
+void chunk_cache_patch( struct chunk_cache *cache, int col, int row ) {
+    int ccol = col / CHUNK_TILES;
+    int crow = row / CHUNK_TILES;
+    int c0 = ccol * CHUNK_TILES;
+    int r0 = crow * CHUNK_TILES;
+    for( int side = LEVEL_BEHIND; side <= LEVEL_FRONT; side++ ) {
+        std::map<int, struct bg_chunk>::iterator it = cache->chunks.find( chunk_key( cache, side, ccol, crow ) );
+        if( it == cache->chunks.end() ) {
+            continue;
+        }
+        SDL_Surface *surface = it->second.surface;
+        bool keyed = surface && ( surface->flags & SDL_SRCCOLORKEY );
+        bool see_through = side == LEVEL_FRONT || parallax_holes( cache->behind, c0, r0, c0 + CHUNK_TILES, r0 + CHUNK_TILES ) > 0;
+        if( surface == NULL || keyed != see_through ) {
+            cache->bytes -= chunk_bytes( surface );
+            SDL_FreeSurface( surface );
+            cache->chunks.erase( it );
+            continue;
+        }
+        SDL_Rect cell = { (Sint16)( ( col - c0 ) * TW ), (Sint16)( ( row - r0 ) * TH ), (Uint16)TW, (Uint16)TH };
+        SDL_FillRect( surface, &cell, keyed ? surface->format->colorkey : 0 );
+        render_map_cell( side, col, row, surface, cell.x, cell.y );
+    }
+}
+
+// once a frame, before any drawing: bake both sides' chunks under
+// viewport vp that are missing and any within half a chunk of the edge,
+// then drop what's over budget
+void prepare_background( struct chunk_cache *cache, SDL_Rect vp ) {
+    const int cw = CHUNK_TILES * TW;
+    const int ch = CHUNK_TILES * TH;
+    cache->frame++;
+    int c0 = std::max( 0, (int)vp.x - cw / 2 ) / cw;
+    int r0 = std::max( 0, (int)vp.y - ch / 2 ) / ch;
+    int c1 = std::min( cache->across - 1, ( vp.x + vp.w + cw / 2 - 1 ) / cw );
+    int r1 = std::min( cache->down - 1, ( vp.y + vp.h + ch / 2 - 1 ) / ch );
+    for( int side = LEVEL_BEHIND; side <= LEVEL_FRONT; side++ ) {
+        chunk_cache_bake( cache, side, c0, r0, c1, r1 );
+    }
+    chunk_cache_evict( cache );
+}
+
+// blit the side's chunks under viewport vp that overlap destination's
+// clip rect, which prepare_background has baked already
+void draw_background( struct chunk_cache *cache, int side, SDL_Rect vp, SDL_Surface *destination ) {
+    const int cw = CHUNK_TILES * TW;
+    const int ch = CHUNK_TILES * TH;
+    const SDL_Rect &clip = destination->clip_rect;
+    int c0 = std::max( 0, vp.x + clip.x ) / cw;
+    int r0 = std::max( 0, vp.y + clip.y ) / ch;
+    int c1 = std::min( cache->across - 1, ( vp.x + clip.x + clip.w - 1 ) / cw );
+    int r1 = std::min( cache->down - 1, ( vp.y + clip.y + clip.h - 1 ) / ch );
+    for( int crow = r0; crow <= r1; crow++ ) {
+        for( int ccol = c0; ccol <= c1; ccol++ ) {
+            SDL_Surface *chunk = chunk_cache_get( cache, side, ccol, crow );
+            if( chunk ) {
+                apply_surface( ccol * cw - vp.x, crow * ch - vp.y, chunk, destination );
+            }
+        }
+    }
+}
+
+// ************* map edits ******************
+//
+// for breakable walls, doors and the like
+
+// the main thread owns the level and everything drawn from it, the sim
+// owns solidity, set_tile queues edits from one to the other
+struct edit_queue tile_edits;
+// row * width + col, set since the last frame was drawn
+std::vector<int> edited_cells;
+
+// change one cell of a map layer and patch everything drawn from it, the
+// cover, the parallax holes and the baked chunk holding it, then queue the
+// cell's solidity for the sim. Main thread only, cache may be NULL
+// headless. Parallax layers, cells off the map and unknown gids are
+// refused
+bool set_tile( int layer, int col, int row, int gid, struct chunk_cache *cache = NULL ) {
+    if(
+        layer < 0 || layer >= map->num_layers || level_layer_is_parallax( map, layer ) ||
+        col < 0 || col >= map->width || row < 0 || row >= map->height ||
+        gid < 0 || gid >= map->num_gids
+    ) {
+        return false;
+    }
+    level_set_gid( map, layer, col, row, gid );
+    edits_push( &tile_edits, col, row, cell_is_solid( col, row ) );
+    if( !cell_cover.empty() ) {
+        int *cover = &cell_cover[ row * map->width + col ];
+        bool was_covered = *cover >= 0;
+        *cover = find_cover( col, row );
+        if( cache && !cache->behind->holes.empty() && was_covered != ( *cover >= 0 ) ) {
+            parallax_add_hole( cache->behind, col, row, was_covered ? 1 : -1 );
+        }
+    }
+    if( cache ) {
+        chunk_cache_patch( cache, col, row );
+    }
+    edited_cells.push_back( row * map->width + col );
+    TRACE( TRACE_DEBUG, TRACE_MAP, "layer %i cell %i,%i set to %i", layer, col, row, gid );
+    return true;
+}
+
+// the sim's half, before a tick
+void apply_tile_edits( struct edit_queue *q ) {
+    std::vector<struct cell_edit> taken;
+    if( !edits_take( q, &taken ) ) {
+        return;
+    }
+    for( unsigned int i = 0; i < taken.size(); i++ ) {
+        set_solidity( taken[ i ].col, taken[ i ].row, taken[ i ].solid );
+    }
+}
+
+#ifdef DEBUG
+// clicking takes out the topmost tile under the pointer, to try set_tile
+// with
+void debug_knock_out( int x, int y, struct chunk_cache *cache ) {
+    int col = x / map->tile_width;
+    int row = y / map->tile_height;
+    if( x < 0 || y < 0 || col >= map->width || row >= map->height ) {
+        return;
+    }
+    for( int i = map->num_layers - 1; i >= 0; i-- ) {
+        if( !level_layer_is_parallax( map, i ) && level_gid( map, i, col, row ) ) {
+            set_tile( i, col, row, 0, cache );
+            return;
+        }
+    }
+}
+#endif
+
+// ************* Sprite classes ******************8
+
+// the player's clips, shared by everything drawn with its sheet, ids
+// indexed by NinjaPlayer::RUN_LEFT etc.
+const char *const PLAYER_ANIMS = "player_2.anim";
+const char *const PLAYER_CLIP_NAMES[ 4 ] = { "run_left", "run_right", "stand_left", "stand_right" };
+const struct anim_set *player_clips = NULL;
+int player_clip_ids[ 4 ];
+
+bool load_player_clips() {
+    player_clips = anim_get( PLAYER_ANIMS );
+    if( player_clips == NULL ) {
+        return false;
+    }
+    for( int i = 0; i < 4; i++ ) {
+        player_clip_ids[ i ] = anim_find( player_clips, PLAYER_CLIP_NAMES[ i ] );
+        if( player_clip_ids[ i ] < 0 ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+class Sprite {
+    public:
+	    float x;
+	    float y;
+        Sprite();
+        virtual ~Sprite();
+        SDL_Surface *sprite_sheet;
+        // clips are shared, this is just where we are in one
+        const struct anim_set *clips;
+        struct anim_state anim;
+};
+Sprite::Sprite() {
+    x = 0.0;
+    y = 0.0;
+    clips = NULL;
+    anim.clip = 0;
+    anim.time = 0.0;
+}
+Sprite::~Sprite() {
+    //
+}
+
+
+class NinjaPlayer: public Sprite {
+	public:
+        const static int RUN_LEFT = 0;
+        const static int RUN_RIGHT = 1;
+        const static int STAND_LEFT = 2;
+        const static int STAND_RIGHT = 3;
+
+        float dx;
+        float dy;
+        float jump_dy; // -900.0// initial jump velocity
+        float run_ddx; //3000.0; // p/s^2
+
+        float walkspeed; // p/s^2
+        float runspeed; // p/s^2
+        float top_speed;
+
+        bool jump_powering;
+        int jump_start;
+        int jump_power_time; // ms
+
+        NinjaPlayer();
+        virtual ~NinjaPlayer();
+
+        void animate( float tdelta );
+
+        void walk();
+        void run();
+        void jump( int time, int floor_left, int floor_right );
+        void jump( int time, struct contact touching );
+        void left( float tdelta );
+        void right( float tdelta );
+
+        void updateKinematics( float tdelta );
+        SDL_Rect getCurrentFrame();
+        // find if we're overlapping a tile while travelling
+        void collision();
+
+        int xleft() { return (int)x; }
+        int xright() { return (int)x+fr_w; }
+        int ytop() { return (int)y; }
+        int ybottom() { return (int)y+fr_h; }
+        int set_xleft( int nx ) { x = (float)nx; }
+        int set_xright( int nx ) { x = (float)(nx - fr_w); }
+        int set_ytop( int ny ) { y = (float)ny; }
+        int set_ybottom( int ny ) { y = (float)( ny - fr_h ); }
+
+        struct contact map_collisions( float dt );
+
+        short fr_w;
+        short fr_h;
+
+};
+
+void NinjaPlayer::collision() {
+    if( dx > 0 ) {
+    }
+}
+
+// which of RUN_LEFT etc. to show moving at dx, having been showing clip
+int player_next_clip( int clip, float dx ) {
+    if( dx > 0.1 ) {
+        return NinjaPlayer::RUN_RIGHT;
+    } else if( dx < -0.1 ) {
+        return NinjaPlayer::RUN_LEFT;
+    } else if( clip == player_clip_ids[ NinjaPlayer::RUN_LEFT ] || clip == player_clip_ids[ NinjaPlayer::STAND_LEFT ] ) {
+        return NinjaPlayer::STAND_LEFT;
+    }
+    return NinjaPlayer::STAND_RIGHT;
+}
+
+NinjaPlayer::NinjaPlayer() {
+    fr_w = 42;
+    fr_h = 50;
+
+    dx = 0.0;
+    dy = 0.0;
+    jump_dy = -500.0; // -900.0// initial jump velocity
+    run_ddx = 4000.0; //3000.0; // p/s^2
+
+    walkspeed = 400.0; // p/s^2
+    runspeed = 600.0; // p/s^2
+
+    jump_powering = false;
+    jump_start = 0;
+    jump_power_time = 150; // ms
+	sprite_sheet = asset_acquire( "player_2.png" );
+
+    clips = player_clips;
+    anim.clip = player_clip_ids[ RUN_LEFT ];
+    anim.time = 0.0;
+    top_speed = runspeed;
+}
+
+NinjaPlayer::~NinjaPlayer() {
+	asset_release( sprite_sheet );
+}
+void NinjaPlayer::animate( float tdelta ) {
+    anim_play( &anim, player_clip_ids[ player_next_clip( anim.clip, dx ) ] );
+    // legs speed up with the square root of how fast we're going
+    anim_advance( clips, &anim, sqrtf( fabsf( dx ) / runspeed ) * tdelta );
+}
+void NinjaPlayer::updateKinematics( float tdelta ) {
+    if( dx < -1.0 * top_speed ) {
         dx = -1.0 * top_speed;
     }
     if( dx > top_speed ) {
@@ -631,7 +1195,7 @@ void NinjaPlayer::walk() {
     top_speed = walkspeed;
 }
 SDL_Rect NinjaPlayer::getCurrentFrame() {
-    return animations[ current_animation ].frames[ frame_count ].rect;    
+    return anim_sample( clips, &anim )->rect;
 }
 // floor = last place you were standing
 //void NinjaPlayer::jump( int time, int floor_left, int floor_right ) {
@@ -646,7 +1210,7 @@ void NinjaPlayer::jump( int time, struct contact touching ) {
         }
     //} else if( ybottom() == floor_left || ybottom() == floor_right ) {
     } else if( touching.t2i < 0.1 && touching.t2i > -0.1 && touching.ry == -1.0 ) {
-        printf_debug( "jump\n" );
+        TRACE( TRACE_INFO, TRACE_INPUT, "jump at %i", time );
         // start jump power phase
         dy = jump_dy;
         jump_powering = true;
@@ -660,307 +1224,968 @@ void NinjaPlayer::right( float tdelta ) {
     dx += tdelta * run_ddx;
 }
 
-// return 1 if this sprite impacts a solid map block
-// on current trajectory and updates internal dx,dy to truncate
-// trajectory so it rests against block next frame
-struct contact NinjaPlayer::map_collisions( float dt ) {
-    // time to impact
+// returns the first solid map block this box impacts on its current
+// trajectory and truncates *dx,*dy so it rests against it next frame
+struct contact collide_box( float x, float y, float w, float h, float *dx, float *dy, float dt ) {
     // -1.0 special no-impact value
-    float t2i = -1.0;
-    struct contact impact = { -1.0, 0.0, 0.0 };
-    float rx = 0.0;
-    float ry = 0.0;
-
-    printf_debug( "--\n\n" );
-
-    // top left corner
-    if( dy < 0 || dx < 0 ) {
-        printf_debug( "top left\n" );
-        struct contact new_impact = find_intersection_with_solid(
-            xleft(), ytop(), dx, dy, dt
+    struct contact impact = { -1.0, 0.0, 0.0, 0 };
+
+    // once one axis is stopped, sweep again with what's left so sliding
+    // along a floor still finds walls
+    for( int pass = 0; pass < 2; pass++ ) {
+        struct contact hit = sweep_box( x, y, w, h, *dx, *dy, dt );
+        if( hit.t2i < 0.0 ) {
+            break;
+        }
+        TRACE( TRACE_DEBUG, TRACE_COLLIDE, "bang t2i %f normal %f %f cells %i", hit.t2i, hit.rx, hit.ry, hit.cells );
+        if( impact.t2i < 0.0 ) {
+            impact.t2i = hit.t2i;
+        }
+        for( int i = 0; i < hit.cells; i++ ) {
+            add_contact_cell( &impact, hit.cell_col[ i ], hit.cell_row[ i ] );
+        }
+        // is the resistance from surface opposing our current velocity?
+        // scale our velocity so we finish frame at surface, rounding
+        // towards zero so we never end up inside it
+        if( hit.rx != 0.0 && std::copysign( 1, hit.rx ) != std::copysign( 1, *dx ) ) {
+            impact.rx = hit.rx;
+            *dx = (int)( *dx * hit.t2i / dt );
+        }
+        if( hit.ry != 0.0 && std::copysign( 1, hit.ry ) != std::copysign( 1, *dy ) ) {
+            impact.ry = hit.ry;
+            *dy = (int)( *dy * hit.t2i / dt );
+        }
+    }
+    return impact;
+}
+
+struct contact NinjaPlayer::map_collisions( float dt ) {
+    return collide_box( x, y, fr_w, fr_h, &dx, &dy, dt );
+}
+
+// ************* entity store ******************
+//
+// crowds of simple walkers. rather than an object per sprite each field
+// is its own array, so the batch passes below only stream through the
+// fields they use and there's no virtual dispatch per entity
+
+const float ENTITY_WALK_SPEED = 150.0; // p/s
+
+struct entity_store {
+    int count;
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> prev_x; // last tick, for drawing in between
+    std::vector<float> prev_y;
+    std::vector<float> dx;
+    std::vector<float> dy;
+    std::vector<short> w; // collider extents
+    std::vector<short> h;
+    std::vector<struct anim_state> anim;
+};
+
+int entity_spawn( struct entity_store *es, float x, float y, short w, short h, float dx ) {
+    es->x.push_back( x );
+    es->y.push_back( y );
+    es->prev_x.push_back( x );
+    es->prev_y.push_back( y );
+    es->dx.push_back( dx );
+    es->dy.push_back( 0.0 );
+    es->w.push_back( w );
+    es->h.push_back( h );
+    struct anim_state anim = { player_clip_ids[ dx < 0 ? NinjaPlayer::RUN_LEFT : NinjaPlayer::RUN_RIGHT ], 0.0 };
+    es->anim.push_back( anim );
+    return es->count++;
+}
+
+// scatter n walkers over empty parts of the map, always the same places
+void entities_spawn_walkers( struct entity_store *es, int n, short w, short h ) {
+    es->count = 0;
+    Uint32 seed = 1;
+    int cols = ( w + TW - 1 ) / TW;
+    int rows = ( h + TH - 1 ) / TH;
+    for( int tries = 0; es->count < n && tries < n * 100; tries++ ) {
+        seed = seed * 1664525u + 1013904223u;
+        int col = ( seed >> 8 ) % map->width;
+        seed = seed * 1664525u + 1013904223u;
+        int row = ( seed >> 8 ) % map->height;
+        bool clear = true;
+        for( int r = row; r < row + rows && clear; r++ ) {
+            clear = r < map->height && !map_span_is_solid( r, col, col + cols - 1 ) && col + cols <= map->width;
+        }
+        if( clear ) {
+            entity_spawn( es, col * TW, row * TH, w, h, ( seed & 0x100 ) ? ENTITY_WALK_SPEED : -ENTITY_WALK_SPEED );
+        }
+    }
+}
+
+void entities_begin_tick( struct entity_store *es ) {
+    es->prev_x = es->x;
+    es->prev_y = es->y;
+}
+
+// same swept collision the player gets, walkers turn round at walls
+void entities_collide( struct entity_store *es, float dt ) {
+    for( int i = 0; i < es->count; i++ ) {
+        struct contact hit = collide_box( es->x[ i ], es->y[ i ], es->w[ i ], es->h[ i ], &es->dx[ i ], &es->dy[ i ], dt );
+        if( hit.rx != 0.0 ) {
+            es->dx[ i ] = hit.rx * ENTITY_WALK_SPEED;
+        }
+    }
+}
+
+// the sides of the map are walls to walkers, off it nothing is solid
+void entities_update_kinematics( struct entity_store *es, float dt ) {
+    if( es->count == 0 ) {
+        return;
+    }
+    const float right = map->width * TW;
+    float *x = &es->x[ 0 ];
+    float *y = &es->y[ 0 ];
+    float *dx = &es->dx[ 0 ];
+    float *dy = &es->dy[ 0 ];
+    const short *w = &es->w[ 0 ];
+    for( int i = 0; i < es->count; i++ ) {
+        x[ i ] += dt * dx[ i ];
+        y[ i ] += dt * dy[ i ];
+        dy[ i ] += dt * GRAVITY;
+        if( x[ i ] < 0.0 ) {
+            x[ i ] = 0.0;
+            dx[ i ] = ENTITY_WALK_SPEED;
+        } else if( x[ i ] + w[ i ] > right ) {
+            x[ i ] = right - w[ i ];
+            dx[ i ] = -ENTITY_WALK_SPEED;
+        }
+    }
+}
+
+// walkers that have dropped out of the bottom of the map would fall for
+// ever, so they leave the store. The last one takes each one's place
+void entities_retire_fallen( struct entity_store *es ) {
+    const float bottom = map->height * TH;
+    int retired = 0;
+    for( int i = es->count - 1; i >= 0; i-- ) {
+        if( es->y[ i ] < bottom ) {
+            continue;
+        }
+        int last = --es->count;
+        es->x[ i ] = es->x[ last ];
+        es->y[ i ] = es->y[ last ];
+        es->prev_x[ i ] = es->prev_x[ last ];
+        es->prev_y[ i ] = es->prev_y[ last ];
+        es->dx[ i ] = es->dx[ last ];
+        es->dy[ i ] = es->dy[ last ];
+        es->w[ i ] = es->w[ last ];
+        es->h[ i ] = es->h[ last ];
+        es->anim[ i ] = es->anim[ last ];
+        es->x.pop_back();
+        es->y.pop_back();
+        es->prev_x.pop_back();
+        es->prev_y.pop_back();
+        es->dx.pop_back();
+        es->dy.pop_back();
+        es->w.pop_back();
+        es->h.pop_back();
+        es->anim.pop_back();
+        retired++;
+    }
+    if( retired > 0 ) {
+        TRACE( TRACE_DEBUG, TRACE_COLLIDE, "%i walkers fell off the map, %i left", retired, es->count );
+    }
+}
+
+// two moving boxes over dt, t2i is when a first touches b or -1.0 if it
+// doesn't, rx,ry the normal pushing a away. Boxes already overlapping
+// touch at 0.0 on the axis they overlap least
+struct contact sweep_boxes(
+    float ax, float ay, float aw, float ah, float adx, float ady,
+    float bx, float by, float bw, float bh, float bdx, float bdy, float dt
+) {
+    struct contact impact = { -1.0, 0.0, 0.0, 0 };
+    // a's path relative to b, against b grown by a's size
+    float mx = ( adx - bdx ) * dt;
+    float my = ( ady - bdy ) * dt;
+    float x0 = bx - aw;
+    float x1 = bx + bw;
+    float y0 = by - ah;
+    float y1 = by + bh;
+    if( ax > x0 && ax < x1 && ay > y0 && ay < y1 ) {
+        float px = std::min( ax - x0, x1 - ax );
+        float py = std::min( ay - y0, y1 - ay );
+        impact.t2i = 0.0;
+        if( px < py ) {
+            impact.rx = ax - x0 < x1 - ax ? -1.0 : 1.0;
+        } else {
+            impact.ry = ay - y0 < y1 - ay ? -1.0 : 1.0;
+        }
+        return impact;
+    }
+    // slabs, when the path is inside each pair of faces
+    float enter = 0.0;
+    float leave = 1.0;
+    float nx = 0.0;
+    float ny = 0.0;
+    if( mx == 0.0 ) {
+        if( ax <= x0 || ax >= x1 ) {
+            return impact;
+        }
+    } else {
+        float t0 = ( ( mx > 0 ? x0 : x1 ) - ax ) / mx;
+        float t1 = ( ( mx > 0 ? x1 : x0 ) - ax ) / mx;
+        if( t0 > enter ) {
+            enter = t0;
+            nx = mx > 0 ? -1.0 : 1.0;
+        }
+        leave = std::min( leave, t1 );
+    }
+    if( my == 0.0 ) {
+        if( ay <= y0 || ay >= y1 ) {
+            return impact;
+        }
+    } else {
+        float t0 = ( ( my > 0 ? y0 : y1 ) - ay ) / my;
+        float t1 = ( ( my > 0 ? y1 : y0 ) - ay ) / my;
+        if( t0 > enter ) {
+            enter = t0;
+            nx = 0.0;
+            ny = my > 0 ? -1.0 : 1.0;
+        }
+        leave = std::min( leave, t1 );
+    }
+    if( enter >= leave || ( nx == 0.0 && ny == 0.0 ) ) {
+        return impact;
+    }
+    impact.t2i = enter * dt;
+    impact.rx = nx;
+    impact.ry = ny;
+    return impact;
+}
+
+// scratch for entity collisions, kept between ticks so its vectors hold
+// on to their capacity
+struct entity_contacts {
+    struct spatial_hash grid; // tile sized cells
+    std::vector<std::pair<int, int> > pairs;
+    std::vector<int> found;
+    int hits; // last tick
+};
+
+void entity_contacts_init( struct entity_contacts *ec ) {
+    spatial_init( &ec->grid, TW, TH );
+    ec->hits = 0;
+}
+
+// is a heading into b along the contact normal, rather than away
+inline bool closing( const struct contact *hit, float adx, float ady, float bdx, float bdy ) {
+    return ( adx - bdx ) * hit->rx + ( ady - bdy ) * hit->ry < 0.0;
+}
+
+// walkers that would walk into each other this tick turn round as if
+// they'd met a wall, and so do any the player runs into. Each walker's
+// path for the tick goes in the grid, so only the pairs it turns up get
+// swept against each other
+void entities_bump( struct entity_store *es, struct entity_contacts *ec, const NinjaPlayer *player, float dt ) {
+    ec->hits = 0;
+    if( es->count == 0 ) {
+        return;
+    }
+    spatial_clear( &ec->grid );
+    for( int i = 0; i < es->count; i++ ) {
+        float x1 = es->x[ i ] + es->dx[ i ] * dt;
+        float y1 = es->y[ i ] + es->dy[ i ] * dt;
+        spatial_insert(
+            &ec->grid, i,
+            std::min( es->x[ i ], x1 ), std::min( es->y[ i ], y1 ),
+            std::max( es->x[ i ], x1 ) + es->w[ i ], std::max( es->y[ i ], y1 ) + es->h[ i ]
         );
-        // will we impact something sooner on this corner?
-        //if( new_t2i >= 0.0 && new_t2i < t2i ) {
-            // optimised ;-)
-            impact = new_impact;
-        //}
-    }
-    // top right corner
-    if( dy < 0 || dx > 0 ) {
-        printf_debug( "top right\n" );
-        struct contact new_impact = find_intersection_with_solid(
-            xright(), ytop(), dx, dy, dt
+    }
+    spatial_build( &ec->grid );
+    spatial_pairs( &ec->grid, &ec->pairs );
+    for( unsigned int p = 0; p < ec->pairs.size(); p++ ) {
+        int a = ec->pairs[ p ].first;
+        int b = ec->pairs[ p ].second;
+        struct contact hit = sweep_boxes(
+            es->x[ a ], es->y[ a ], es->w[ a ], es->h[ a ], es->dx[ a ], es->dy[ a ],
+            es->x[ b ], es->y[ b ], es->w[ b ], es->h[ b ], es->dx[ b ], es->dy[ b ], dt
         );
-        // will we impact something sooner on this corner?
-        if( new_impact.t2i >= 0.0 && ( new_impact.t2i < impact.t2i || impact.t2i < 0.0 ) ) {
-            impact = new_impact;
+        if( hit.t2i >= 0.0 && hit.rx != 0.0 && closing( &hit, es->dx[ a ], es->dy[ a ], es->dx[ b ], es->dy[ b ] ) ) {
+            es->dx[ a ] = hit.rx * ENTITY_WALK_SPEED;
+            es->dx[ b ] = -hit.rx * ENTITY_WALK_SPEED;
+            ec->hits++;
         }
     }
-    // bottom right corner
-    if( dy > 0 || dx > 0 ) {
-        printf_debug( "bottom right\n" );
-        struct contact new_impact = find_intersection_with_solid(
-            xright(), ybottom(), dx, dy, dt
+
+    float px1 = player->x + player->dx * dt;
+    float py1 = player->y + player->dy * dt;
+    spatial_query(
+        &ec->grid,
+        std::min( player->x, px1 ), std::min( player->y, py1 ),
+        std::max( player->x, px1 ) + player->fr_w, std::max( player->y, py1 ) + player->fr_h,
+        &ec->found
+    );
+    for( unsigned int f = 0; f < ec->found.size(); f++ ) {
+        int i = ec->found[ f ];
+        struct contact hit = sweep_boxes(
+            player->x, player->y, player->fr_w, player->fr_h, player->dx, player->dy,
+            es->x[ i ], es->y[ i ], es->w[ i ], es->h[ i ], es->dx[ i ], es->dy[ i ], dt
         );
-        // will we impact something sooner on this corner?
-        if( new_impact.t2i >= 0.0 && ( new_impact.t2i < impact.t2i || impact.t2i < 0.0 ) ) {
-            printf_debug( "br x\n" );
-            impact = new_impact;
+        if( hit.t2i >= 0.0 && hit.rx != 0.0 && closing( &hit, player->dx, player->dy, es->dx[ i ], es->dy[ i ] ) ) {
+            es->dx[ i ] = -hit.rx * ENTITY_WALK_SPEED;
+            ec->hits++;
         }
     }
-    // bottom left corner
-    if( dy > 0.0 || dx < 0.0 ) {
-        printf_debug( "bottom left\n" );
-        struct contact new_impact = find_intersection_with_solid(
-            xleft(), ybottom(), dx, dy, dt
-        );
-        // will we impact something sooner on this corner?
-        if( new_impact.t2i >= 0.0 && ( new_impact.t2i < impact.t2i || impact.t2i < 0.0 ) ) {
-            printf_debug( "bl x\n" );
-            impact = new_impact;
+    TRACE( TRACE_DEBUG, TRACE_COLLIDE, "%i candidate pairs, %i bumps", (int)ec->pairs.size(), ec->hits );
+}
+
+// walkers play the player's clips
+void entities_animate( struct entity_store *es, float dt ) {
+    for( int i = 0; i < es->count; i++ ) {
+        struct anim_state *anim = &es->anim[ i ];
+        anim_play( anim, player_clip_ids[ player_next_clip( anim->clip, es->dx[ i ] ) ] );
+        anim_advance( player_clips, anim, sqrtf( fabsf( es->dx[ i ] ) / ENTITY_WALK_SPEED ) * dt );
+    }
+}
+
+// ************* simulation ******************
+//
+// a tick only touches what's in here, so it can run on a thread of its own
+
+struct sim_state {
+    NinjaPlayer *player;
+    struct entity_store *enemies;
+    struct entity_contacts *contacts;
+    int lc; // ticks so far
+    float prev_x; // player, last tick
+    float prev_y;
+    struct profiler *prof; // tick phases are timed into this
+    struct replay *recording; // keys are saved here if set
+    struct edit_queue *edits; // map edits from the main thread
+};
+
+// everything drawing needs from one tick, copied out so the sim can get on
+// with the next
+struct sim_snapshot {
+    Uint64 time; // clock_us() when taken
+    float prev_x; // player
+    float prev_y;
+    float x;
+    float y;
+    SDL_Rect frame;
+    std::vector<float> prev_ex; // enemies
+    std::vector<float> prev_ey;
+    std::vector<float> ex;
+    std::vector<float> ey;
+    std::vector<SDL_Rect> eframes;
+};
+
+void sim_tick( struct sim_state *sim, Uint8 *keystates ) {
+	float dynamic_friction = 12.00; // 1/s
+	float static_friction = 12.0; // p/s^2
+    NinjaPlayer &player = *sim->player;
+
+    apply_tile_edits( sim->edits );
+    sim->prev_x = player.x;
+    sim->prev_y = player.y;
+    entities_begin_tick( sim->enemies );
+    // distances are pixels
+    float tdelta = SIM_DT / SLOW_DOWN;
+    // jump timing is in ms of sim time
+    int sim_time = (int)( (Uint64)sim->lc * 1000 / SIM_RATE );
+
+    {
+        struct prof_timer t( sim->prof, PROF_INPUT );
+        if( sim->recording ) {
+            replay_record( sim->recording, keystates );
+        }
+        if( keystates[ SDLK_LCTRL ] ) {
+            player.run();
+        } else {
+            player.walk();
         }
     }
-    // if there's an impact, truncate our trajectory
-    if( impact.t2i >= 0.0 ) {
-        // TODO support diagonals
-        
-        // is the resistance from surface opposing our current velocity?
-        if( impact.rx != 0.0 && std::copysign( 1, impact.rx ) != std::copysign( 1, dx ) ) {
-            printf_debug( "slow x\n" );
-            // scale our velocity so we finish frame at surface
-            dx = floor( dx * impact.t2i / dt );
-        } else if( impact.ry != 0.0 && std::copysign( 1, impact.ry ) != std::copysign( 1, dy ) ) {
-            printf_debug( "slow y\n" );
-            dy = floor( dy * impact.t2i / dt );
+
+    //int floor = find_surface_down( (int)player.x, (int)player.y );
+
+    // calculate the floor(s) beneath me
+    int floorl = find_surface_down( player.xleft(), player.ybottom() );
+    int floorr = find_surface_down( player.xright(), player.ybottom() );
+
+    // calculate blocks I will collide with on current path
+
+    // calculate is any of 4 lines from tl -> br will intersect a box
+    //
+    // for each corner
+    //   line is x0,y0 -> x+dx.t,y+dy.t = x1,x1
+    //
+    //   for each block
+    //     for each side t,r,b,l
+    //       if x0 >= x1 and x0 < x+dx.t
+    //         and by
+    //float ttt = 0.0;
+    //ttt = intersect_with_vertical( 1.0, 1.0, 0.3, 0.3, 10, 2.0, 1.0, 2.0, 4.0 );
+    //ttt = intersect_with_horizontal( 1.0, 1.0, 0.3, 0.3, 10, 1.0, 2.0, 5.0, 2.0 );
+    //
+    //
+
+    struct contact touching;
+    {
+        struct prof_timer t( sim->prof, PROF_PHYSICS );
+        touching = player.map_collisions( tdelta );
+        player.updateKinematics( tdelta );
+        entities_collide( sim->enemies, tdelta );
+        entities_bump( sim->enemies, sim->contacts, &player, tdelta );
+        entities_update_kinematics( sim->enemies, tdelta );
+        entities_retire_fallen( sim->enemies );
+    }
+
+    //if( keystates[ SDLK_DOWN ] && player.dy == 0.0 ) {
+    //	player.y += 1.0;
+    //}
+
+    /*if( keystates[ SDLK_UP ] ) {
+        //y -= 1;
+    }
+    */
+
+    //const struct level_tile *tilel = get_tile_by_coords( player.xleft(), player.ybottom() );
+    //const struct level_tile *tiler = get_tile_by_coords( player.xright(), player.ybottom() );
+
+    // correct for collisions
+
+    /*if( tilel && player.dy > 0 ) {
+        if( tile_is_solid( tilel ) ) {
+            // move to top of tile
+            player.y = ( player.y / map->tile_height ) * map->tile_height;
+            //player.y = floorl;
+            player.dy = 0;
+        }
+    } else if( tiler && player.dy > 0 ) {
+        if( tile_is_solid( tiler ) ) {
+            // move to top of tile
+            player.y = ( player.y / map->tile_height ) * map->tile_height;
+            //player.y = floorr;
+            player.dy = 0;
+        }
+    } else {
+        if( player.ybottom() <= floorl && player.ybottom() <= floorr ) {
+            TRACE( TRACE_DEBUG, TRACE_COLLIDE, "creep" );
+        }
+    }*/
+
+    {
+        struct prof_timer t( sim->prof, PROF_INPUT );
+        if( keystates[ SDLK_UP ] ) {
+            player.jump( sim_time, touching );
+        }
+
+        //printf_debug( "Player: %i, Floorl: %i, Floorr: %i\n", (int)player.ybottom(), floorl, floorr );
+        // have I fallen through the surface of a solid tile?
+
+        /*if( player.ybottom() >= floorl && player.dy > 0.0 ) {
+            player.set_ybottom( floorl );
+            player.dy = 0;
+        } else if ( player.ybottom() >= floorr && player.dy > 0.0 ) {
+            player.set_ybottom( floorr );
+            player.dy = 0;
+        } else {
+            player.dy += tdelta * GRAVITY;
+        }*/
+
+        player.dy += tdelta * GRAVITY;
+
+        if( keystates[ SDLK_LEFT ] ) {
+            player.left( tdelta );
+        } else if( keystates[ SDLK_RIGHT ] ) {
+            player.right( tdelta );
+        } else {
+            // friction
+            if( player.dx < 0.0 || player.dx > 0.0 ) {
+                float friction_dir = ( player.dx > 0.0 ? -1.0 : 1.0 );
+                int newdx = player.dx + friction_dir * tdelta * ( static_friction + abs(player.dx) * dynamic_friction );
+                if( newdx * player.dx < 0.0 ) {
+                    // sign change - we've gone through 0
+                    newdx = 0.0;
+                }
+                player.dx = newdx;
+            }
         }
-        // collision flag
-        printf_debug( "bang\n" );
     }
-    return impact;
+
+    {
+        struct prof_timer t( sim->prof, PROF_ANIMATE );
+        player.animate( tdelta );
+        entities_animate( sim->enemies, tdelta );
+    }
+    sim->lc++;
 }
 
+// vectors keep their capacity between ticks, so this settles into copies
+void sim_snapshot_take( const struct sim_state *sim, struct sim_snapshot *snap ) {
+    const struct entity_store *es = sim->enemies;
+    snap->time = clock_us();
+    snap->prev_x = sim->prev_x;
+    snap->prev_y = sim->prev_y;
+    snap->x = sim->player->x;
+    snap->y = sim->player->y;
+    snap->frame = sim->player->getCurrentFrame();
+    snap->prev_ex = es->prev_x;
+    snap->prev_ey = es->prev_y;
+    snap->ex = es->x;
+    snap->ey = es->y;
+    snap->eframes.resize( es->count );
+    for( int i = 0; i < es->count; i++ ) {
+        snap->eframes[ i ] = anim_sample( player_clips, &es->anim[ i ] )->rect;
+    }
+}
+
+struct sim_thread {
+    struct sim_state *sim;
+    struct profiler *report; // the main thread's
+    struct triple_buffer<struct sim_snapshot> out;
+    std::atomic<Uint8> keys; // replay_key_mask() of what's held
+    std::atomic<bool> running;
+    SDL_Thread *thread;
+};
 
+// ticks in real time, publishing a snapshot after each one
+int sim_thread_main( void *data ) {
+    struct sim_thread *st = (struct sim_thread *)data;
+    const Uint64 step = 1000000 / SIM_RATE;
+    Uint8 keystates[ SDLK_LAST ];
+    Uint64 next = clock_us();
+    while( st->running.load() ) {
+        Uint64 now = clock_us();
+        if( now < next ) {
+            SDL_Delay( 1 );
+            continue;
+        }
+        if( now - next > (Uint64)( MAX_FRAME_TIME * 1000000 ) ) {
+            // too far behind to catch up, drop it
+            next = now;
+        }
+        replay_unmask( st->keys.load(), keystates );
+        sim_tick( st->sim, keystates );
+        sim_snapshot_take( st->sim, triple_back( &st->out ) );
+        triple_publish( &st->out );
+        profile_send( st->report, st->sim->prof );
+        profile_end_frame( st->sim->prof );
+        next += step;
+    }
+    return 0;
+}
 
+// report gets the tick phases, for the HUD and CSV
+bool sim_thread_start( struct sim_thread *st, struct sim_state *sim, struct profiler *report ) {
+    st->sim = sim;
+    st->report = report;
+    triple_init( &st->out );
+    // whichever slot gets read first is already a whole frame
+    for( int i = 0; i < 3; i++ ) {
+        sim_snapshot_take( sim, &st->out.slots[ i ] );
+    }
+    st->keys.store( 0 );
+    st->running.store( true );
+    st->thread = SDL_CreateThread( sim_thread_main, st );
+    return st->thread != NULL;
+}
+
+void sim_thread_stop( struct sim_thread *st ) {
+    st->running.store( false );
+    SDL_WaitThread( st->thread, NULL );
+}
+
+// ************* drawing ******************
+
+// the enemies inside the viewport, alpha of the way from last tick
+void entities_draw( const struct sim_snapshot *snap, SDL_Surface *sheet, float alpha, SDL_Rect vp, SDL_Surface *destination ) {
+    for( int i = 0; i < (int)snap->ex.size(); i++ ) {
+        SDL_Rect frame = snap->eframes[ i ];
+        int x = (int)( snap->prev_ex[ i ] + ( snap->ex[ i ] - snap->prev_ex[ i ] ) * alpha ) - vp.x;
+        int y = (int)( snap->prev_ey[ i ] + ( snap->ey[ i ] - snap->prev_ey[ i ] ) * alpha ) - vp.y;
+        if( x >= destination->w || y >= destination->h || x + frame.w <= 0 || y + frame.h <= 0 ) {
+            continue;
+        }
+        apply_sprite( x, y, sheet, &frame, destination );
+    }
+}
 
 // ***************** entry point *******************
 
+// the one way out once the trace has started, so it's flushed with
+// whatever went wrong in it
+int start_failed( int code ) {
+    trace_stop();
+    SDL_Quit();
+    return code;
+}
+
 int main( int argc, char **argv ) {
 
+    // --headless <file> runs the simulation only, fed by a recording
+    // --record <file> plays as normal and saves the keys held each tick
+    // --dirty only redraws and presents the parts of the screen that changed
+    // --trace <file> writes the binary trace log there, see tracedump
+    // --profile <file> writes per-frame phase timings there as CSV
+    // --enemies <n> adds a crowd of n walkers
+    // --threads runs the simulation on a thread of its own
+    bool headless = false;
+    bool threaded = false;
+    bool recording = false;
+    bool dirty_mode = false;
+    const char *replay_file = NULL;
+    const char *profile_file = NULL;
+    int enemy_count = 0;
+#ifdef DEBUG
+    const char *trace_file = "ninja.trace";
+#else
+    const char *trace_file = NULL;
+#endif
+    for( int a = 1; a < argc; a++ ) {
+        if( strcmp( argv[ a ], "--headless" ) == 0 && a + 1 < argc ) {
+            headless = true;
+            replay_file = argv[ ++a ];
+        } else if( strcmp( argv[ a ], "--record" ) == 0 && a + 1 < argc ) {
+            recording = true;
+            replay_file = argv[ ++a ];
+        } else if( strcmp( argv[ a ], "--dirty" ) == 0 ) {
+            dirty_mode = true;
+        } else if( strcmp( argv[ a ], "--trace" ) == 0 && a + 1 < argc ) {
+            trace_file = argv[ ++a ];
+        } else if( strcmp( argv[ a ], "--profile" ) == 0 && a + 1 < argc ) {
+            profile_file = argv[ ++a ];
+        } else if( strcmp( argv[ a ], "--threads" ) == 0 ) {
+            threaded = true;
+        } else if( strcmp( argv[ a ], "--enemies" ) == 0 && a + 1 < argc ) {
+            enemy_count = atoi( argv[ ++a ] );
+        }
+    }
+    struct replay input;
+    if( headless && !replay_load( &input, replay_file ) ) {
+        fprintf( stderr, "can't read replay %s\n", replay_file );
+        return 4;
+    }
+
+    // headless runs report these per tick, F3 shows them on screen
+    struct profiler prof;
+    if( !profile_init( &prof, profile_file ) ) {
+        fprintf( stderr, "can't write profile %s\n", profile_file );
+        return 4;
+    }
+    struct prof_hud hud;
+    bool show_hud = false;
+
 	SDL_Surface *screen = NULL;
 	//The layers
 	SDL_Surface *message = NULL;
-	SDL_Surface *background = NULL;
+    struct chunk_cache bg_cache;
+    struct parallax backdrop;
 
-	SDL_Surface *msg = NULL;
 	SDL_Event event;
 
 	bool quit = false;
 	int last_time;
 	int time = 0;
-	std::ostringstream formatter;
 
     load_map();
 
-	// for FPS
-	formatter.precision( 4 );
-
 	TTF_Font *font = NULL;
 	SDL_Color textColor = { 255, 255, 255 };
 
 	//Start SDL
-	if( SDL_Init( SDL_INIT_EVERYTHING ) == -1 ) {
+	if( SDL_Init( headless ? SDL_INIT_TIMER : SDL_INIT_EVERYTHING ) == -1 ) {
 		return 1;
 	}
-	if( TTF_Init() == -1 ) {
-		return 3;
-	}
-	screen = SDL_SetVideoMode( SCREEN_WIDTH, SCREEN_HEIGHT, SCREEN_BPP, SCREEN_FLAGS );
-	if( screen == NULL ) {
-		return 2;
-	}
-	SDL_WM_SetCaption( "Hello World", NULL );
-
-	font = TTF_OpenFont( "/usr/share/fonts/truetype/ttf-dejavu/DejaVuSans-Bold.ttf", 16 );
-
+    if( trace_file && !trace_start( trace_file ) ) {
+        fprintf( stderr, "can't write trace %s\n", trace_file );
+    }
+    if( !headless ) {
+        if( TTF_Init() == -1 ) {
+            TRACE( TRACE_ERROR, TRACE_GENERAL, "TTF_Init failed" );
+            return start_failed( 3 );
+        }
+        // update rects need a single buffered software screen
+        screen = SDL_SetVideoMode( SCREEN_WIDTH, SCREEN_HEIGHT, SCREEN_BPP, dirty_mode ? SDL_SWSURFACE : SCREEN_FLAGS );
+        if( screen == NULL ) {
+            TRACE( TRACE_ERROR, TRACE_RENDER, "SDL_SetVideoMode failed" );
+            return start_failed( 2 );
+        }
+        SDL_WM_SetCaption( "Hello World", NULL );
 
-    background = init_background();
-    render_map( 0, 0, background );
+        font = TTF_OpenFont( "/usr/share/fonts/truetype/ttf-dejavu/DejaVuSans-Bold.ttf", 16 );
 
-	float dynamic_friction = 12.00; // 1/s
-	float static_friction = 12.0; // p/s^2
+        load_tilesets();
+        parallax_init( &backdrop );
+        chunk_cache_init( &bg_cache, &backdrop );
+        profile_hud_init( &hud, 10, 10 );
+    }
 
-	// distances are pixels
-	int lc = 0;
-	float tdelta = 0;
+	int frames = 0;
 
+    if( !load_player_clips() ) {
+        fprintf( stderr, "can't read animations %s\n", PLAYER_ANIMS );
+        TRACE( TRACE_ERROR, TRACE_GENERAL, "can't read animations" );
+        return start_failed( 4 );
+    }
     NinjaPlayer player = NinjaPlayer();
     player.x = 300.0;
     player.y = 200.0;
 
-    // init last_time or it goes mental
-    last_time = SDL_GetTicks();
+    // they share the player's sheet and clips
+    struct entity_store enemies;
+    entities_spawn_walkers( &enemies, enemy_count, player.fr_w, player.fr_h );
+    SDL_Surface *enemy_sheet = headless ? NULL : asset_acquire( "player_2.png" );
 
-	while( !quit ) {
+    edits_init( &tile_edits );
 
-		time = SDL_GetTicks();
-		tdelta = (float)((time - last_time)/1000.0) / SLOW_DOWN;
-		last_time = time;
-		
-		if( SDL_PollEvent( &event ) ) {
-			if( event.type == SDL_KEYDOWN ) {
-				switch( event.key.keysym.sym ) {
-					case SDLK_ESCAPE:
-						quit = true;
-						break;
-				}
-			}
-			
-			if( event.type == SDL_QUIT ) {
-				quit = true;
-			}
-		}
-		Uint8 *keystates = SDL_GetKeyState( NULL );
-		if( keystates[ SDLK_LCTRL ] ) {
-			player.run();
-		} else {
-			player.walk();
-		}
-
-        //int floor = find_surface_down( (int)player.x, (int)player.y );
-
-        // calculate the floor(s) beneath me
-        int floorl = find_surface_down( player.xleft(), player.ybottom() );
-        int floorr = find_surface_down( player.xright(), player.ybottom() );
-
-        // calculate blocks I will collide with on current path
-
-        // calculate is any of 4 lines from tl -> br will intersect a box
-        //
-        // for each corner
-        //   line is x0,y0 -> x+dx.t,y+dy.t = x1,x1
-        //
-        //   for each block
-        //     for each side t,r,b,l
-        //       if x0 >= x1 and x0 < x+dx.t
-        //         and by
-        //float ttt = 0.0;
-        //ttt = intersect_with_vertical( 1.0, 1.0, 0.3, 0.3, 10, 2.0, 1.0, 2.0, 4.0 );
-        //ttt = intersect_with_horizontal( 1.0, 1.0, 0.3, 0.3, 10, 1.0, 2.0, 5.0, 2.0 );
-        //
-        //
-
-        struct contact touching = player.map_collisions( tdelta );
-        player.updateKinematics( tdelta );
-
-        //if( keystates[ SDLK_DOWN ] && player.dy == 0.0 ) {
-		//	player.y += 1.0;
-		//}
-
-		/*if( keystates[ SDLK_UP ] ) {
-			//y -= 1;
-		}
-		*/
+    // init last_time or it goes mental
+    last_time = headless ? 0 : SDL_GetTicks();
+    Uint64 run_start = clock_us();
+
+    // fixed step physics, frames consume whole ticks from the accumulator
+    // and draw the remainder by interpolating between the last two ticks
+    float accumulator = 0.0;
+    float frame_time = SIM_DT;
+    struct entity_contacts contacts;
+    entity_contacts_init( &contacts );
+    struct sim_state sim = { &player, &enemies, &contacts, 0, player.x, player.y, &prof, recording ? &input : NULL, &tile_edits };
+    struct sim_snapshot snap;
+
+    // --threads ticks on its own thread at its own pace, with its own
+    // profiler since they aren't shared, which sends its phases to prof
+    struct profiler sim_prof;
+    struct sim_thread worker;
+    if( threaded && !headless ) {
+        profile_init( &sim_prof, NULL );
+        sim.prof = &sim_prof;
+        threaded = sim_thread_start( &worker, &sim, &prof );
+    } else {
+        threaded = false;
+    }
 
-        //const Tmx::Tile *tilel = get_tile_by_coords( player.xleft(), player.ybottom() );
-        //const Tmx::Tile *tiler = get_tile_by_coords( player.xright(), player.ybottom() );
+    // what's on screen now, so we can tell what changed
+    struct dirty_rects damage;
+    bool redraw_all = true;
+    SDL_Rect last_vp = { 0, 0, 0, 0 };
+    SDL_Rect last_sprite = { 0, 0, 0, 0 };
+    SDL_Rect last_frame = { 0, 0, 0, 0 };
 
-        // correct for collisions
+	while( !quit ) {
 
-        /*if( tilel && player.dy > 0 ) {
-            if( tile_is_solid( tilel ) ) {
-                // move to top of tile
-                player.y = ( player.y / map->GetTileHeight() ) * map->GetTileHeight();
-                //player.y = floorl;
-                player.dy = 0;
-            }
-        } else if( tiler && player.dy > 0 ) {
-            if( tile_is_solid( tiler ) ) {
-                // move to top of tile
-                player.y = ( player.y / map->GetTileHeight() ) * map->GetTileHeight();
-                //player.y = floorr;
-                player.dy = 0;
-            }
+        // headless runs exactly one tick per pass so every run is identical
+        if( headless ) {
+            accumulator += SIM_DT;
         } else {
-            if( player.ybottom() <= floorl && player.ybottom() <= floorr ) {
-                printf_debug( "creep\n" );
+            time = SDL_GetTicks();
+            frame_time = (float)((time - last_time)/1000.0);
+            last_time = time;
+            if( !threaded ) {
+                accumulator += std::min( frame_time, MAX_FRAME_TIME );
             }
-        }*/
+        }
 
-		if( keystates[ SDLK_UP ] ) {
-			player.jump( time, touching );
-		}
+		if( !headless ) {
+            struct prof_timer t( &prof, PROF_EVENTS );
+            if( SDL_PollEvent( &event ) ) {
+                if( event.type == SDL_KEYDOWN ) {
+                    switch( event.key.keysym.sym ) {
+                        case SDLK_ESCAPE:
+                            quit = true;
+                            break;
+                        case SDLK_F3:
+                            show_hud = !show_hud;
+                            redraw_all = true;
+                            break;
+                    }
+                }
 
-        //printf_debug( "Player: %i, Floorl: %i, Floorr: %i\n", (int)player.ybottom(), floorl, floorr );
-        // have I fallen through the surface of a solid tile?
+                if( event.type == SDL_QUIT ) {
+                    quit = true;
+                }
+                if( event.type == SDL_VIDEOEXPOSE ) {
+                    redraw_all = true;
+                }
+#ifdef DEBUG
+                if( event.type == SDL_MOUSEBUTTONDOWN ) {
+                    debug_knock_out( last_vp.x + event.button.x, last_vp.y + event.button.y, &bg_cache );
+                }
+#endif
+            }
+		}
 
-        /*if( player.ybottom() >= floorl && player.dy > 0.0 ) {
-            player.set_ybottom( floorl );
-            player.dy = 0;
-        } else if ( player.ybottom() >= floorr && player.dy > 0.0 ) {
-            player.set_ybottom( floorr );
-            player.dy = 0;
+        const struct sim_snapshot *shown = &snap;
+        float alpha;
+        if( threaded ) {
+            // hand the keys over and draw the newest tick it's finished
+            worker.keys.store( replay_key_mask( SDL_GetKeyState( NULL ) ) );
+            triple_update( &worker.out );
+            shown = triple_front( &worker.out );
+            alpha = std::min( 1.0f, ( clock_us() - shown->time ) / 1000000.0f / SIM_DT );
         } else {
-            player.dy += tdelta * GRAVITY;
-        }*/
-        
-        player.dy += tdelta * GRAVITY;
+            while( accumulator >= SIM_DT && !quit ) {
+                accumulator -= SIM_DT;
+                Uint8 *keystates;
+                {
+                    struct prof_timer t( &prof, PROF_INPUT );
+                    keystates = headless ? replay_next( &input ) : SDL_GetKeyState( NULL );
+                }
+                if( keystates == NULL ) {
+                    // out of recorded input
+                    quit = true;
+                    break;
+                }
+                sim_tick( &sim, keystates );
+            }
 
-		if( keystates[ SDLK_LEFT ] ) {
-            player.left( tdelta );
-		} else if( keystates[ SDLK_RIGHT ] ) {
-            player.right( tdelta );
-		} else {
-			// friction
-			if( player.dx < 0.0 || player.dx > 0.0 ) {
-				float friction_dir = ( player.dx > 0.0 ? -1.0 : 1.0 );
-				int newdx = player.dx + friction_dir * tdelta * ( static_friction + abs(player.dx) * dynamic_friction );
-				if( newdx * player.dx < 0.0 ) {
-					// sign change - we've gone through 0
-					newdx = 0.0;
-				}
-				player.dx = newdx;
-			}
-		}
+            if( headless ) {
+                profile_end_frame( &prof );
+                continue;
+            }
+            sim_snapshot_take( &sim, &snap );
+            alpha = accumulator / SIM_DT;
+        }
 
-        player.animate( tdelta );
+        // where to draw, between the previous and current tick
+        float draw_x = shown->prev_x + ( shown->x - shown->prev_x ) * alpha;
+        float draw_y = shown->prev_y + ( shown->y - shown->prev_y ) * alpha;
 
-        SDL_Rect vp = calculate_viewport( (int)player.x, (int)player.y, map->GetWidth() * map->GetTileWidth(), map->GetHeight() * map->GetTileHeight() );
-        //printf_debug( "%i, %i, %i, %i\n", vp.x, vp.y, map->GetWidth(), map->GetHeight() );
+        SDL_Rect vp = calculate_viewport( (int)draw_x, (int)draw_y, map->width * map->tile_width, map->height * map->tile_height );
+        //printf_debug( "%i, %i, %i, %i\n", vp.x, vp.y, map->width, map->height );
 
-		//int bg_offset = (int)player.x % background->w;
-		clear_surface( screen, 0xffffffff );
-		//apply_tiling_surface( 0, (int)floor, screen->w, 0/*bg_offset*/, background, screen );
-		apply_surface( 0-vp.x, 0-vp.y, background, screen );
+        SDL_Rect player_rect = shown->frame;
+        SDL_Rect sprite_rect = { (Sint16)( (int)draw_x - vp.x ), (Sint16)( (int)draw_y - vp.y ), player_rect.w, player_rect.h };
 
-        //SDL_Rect player_rect = player.frames[ player.current_animation[ player.frame_count ] ].rect;
-        SDL_Rect player_rect = player.getCurrentFrame();;
+        // work out what needs drawing, scrolling moves every pixel and so
+        // does a crowd
+        dirty_reset( &damage, screen->w, screen->h );
+        if( !dirty_mode || redraw_all || vp.x != last_vp.x || vp.y != last_vp.y || !shown->ex.empty() ) {
+            dirty_all( &damage );
+        } else if(
+            sprite_rect.x != last_sprite.x || sprite_rect.y != last_sprite.y ||
+            player_rect.x != last_frame.x || player_rect.y != last_frame.y
+        ) {
+            dirty_add( &damage, &last_sprite );
+            dirty_add( &damage, &sprite_rect );
+        }
+        if( show_hud && frames % FPSFPS == 0 ) {
+            struct prof_timer t( &prof, PROF_TEXT );
+            dirty_add( &damage, &hud.rect );
+            profile_hud_update( &hud, &prof, 1.0 / frame_time, font, textColor );
+            dirty_add( &damage, &hud.rect );
+        }
+        // cells set_tile changed, wherever they are on screen now
+        for( unsigned int i = 0; i < edited_cells.size(); i++ ) {
+            int col = edited_cells[ i ] % map->width;
+            int row = edited_cells[ i ] / map->width;
+            dirty_add( &damage, col * map->tile_width - vp.x, row * map->tile_height - vp.y, map->tile_width, map->tile_height );
+        }
+        edited_cells.clear();
+        redraw_all = false;
+        last_vp = vp;
+        last_sprite = sprite_rect;
+        last_frame = player_rect;
+
+        {
+            struct prof_timer t( &prof, PROF_BACKGROUND );
+            prepare_background( &bg_cache, vp );
+        }
+        // one pass per damaged rect, clipped to it
+        for( int pass = 0; pass < dirty_passes( &damage ); pass++ ) {
+            SDL_SetClipRect( screen, dirty_clip( &damage, pass ) );
+            {
+                struct prof_timer t( &prof, PROF_BACKGROUND );
+                //int bg_offset = (int)player.x % background->w;
+                clear_surface( screen, 0xffffffff );
+                //apply_tiling_surface( 0, (int)floor, screen->w, 0/*bg_offset*/, background, screen );
+                draw_parallax( &backdrop, vp, screen );
+                draw_background( &bg_cache, LEVEL_BEHIND, vp, screen );
+            }
 
-		apply_sprite(
-            (int)player.x - vp.x,
-            (int)player.y - vp.y,
-            player.sprite_sheet,
-            &player_rect,
-            screen
-        );
+            {
+                struct prof_timer t( &prof, PROF_SPRITE );
+                entities_draw( shown, enemy_sheet, alpha, vp, screen );
+                apply_sprite(
+                    sprite_rect.x,
+                    sprite_rect.y,
+                    player.sprite_sheet,
+                    &player_rect,
+                    screen
+                );
+            }
+            {
+                struct prof_timer t( &prof, PROF_BACKGROUND );
+                draw_background( &bg_cache, LEVEL_FRONT, vp, screen );
+            }
+            if( show_hud ) {
+                struct prof_timer t( &prof, PROF_TEXT );
+                profile_hud_draw( &hud, screen );
+            }
+        }
+        SDL_SetClipRect( screen, NULL );
 
         // use up remaining ticks before frame is done
-        //if( tdelta < (1.0/(float)FPS_CAP) ) {
-		//    SDL_Delay( (int)( ( 1/(float)FPS_CAP - tdelta ) * 1000 ) );
-        //}
-        SDL_Delay( (int) ( 3 * pow( SLOW_DOWN, 2 ) ) ); // recommend to smooth things out
-		//msg = TTF_RenderText_Blended( font, formatter.str().c_str(), textColor );
-		//apply_surface( 400, 400, msg, screen );
-
-		SDL_Flip( screen );
-		if( lc++ % FPSFPS == 0 ) {
-			formatter.str( "FPS: " );
-			float fps = 1.0 / tdelta;
-			//printf_debug( "FPS: %.4f\n", fps );
-			formatter << fps;
-		}
+        {
+            struct prof_timer t( &prof, PROF_DELAY );
+            // one read of the clock, or it can pass the deadline between
+            // the test and the delay and wrap
+            int remaining = 1000 / FPS_CAP - (int)( SDL_GetTicks() - time );
+            if( remaining > 0 ) {
+                SDL_Delay( remaining );
+            }
+        }
+
+        {
+            struct prof_timer t( &prof, PROF_FLIP );
+            if( dirty_mode ) {
+                dirty_present( &damage, screen );
+            } else {
+                SDL_Flip( screen );
+            }
+        }
+        profile_end_frame( &prof );
+        frames++;
 	}
 	//SDL_Delay( 500 );
+    if( threaded ) {
+        sim_thread_stop( &worker );
+        profile_close( &sim_prof );
+    }
+    if( !headless ) {
+        chunk_cache_free( &bg_cache );
+        parallax_free( &backdrop );
+        free_tilesets();
+        asset_release( enemy_sheet );
+        profile_hud_free( &hud );
+    }
+    edits_free( &tile_edits );
+    profile_close( &prof );
+    if( recording ) {
+        replay_save( &input, replay_file );
+    }
+    if( headless ) {
+        Uint64 run_us = clock_us() - run_start;
+        Uint32 hash = STATE_HASH_INIT;
+        hash = state_hash( hash, &player.x, sizeof( player.x ) );
+        hash = state_hash( hash, &player.y, sizeof( player.y ) );
+        hash = state_hash( hash, &player.dx, sizeof( player.dx ) );
+        hash = state_hash( hash, &player.dy, sizeof( player.dy ) );
+        hash = state_hash( hash, &player.anim, sizeof( player.anim ) );
+        if( enemies.count > 0 ) {
+            hash = state_hash( hash, &enemies.x[ 0 ], enemies.count * sizeof( float ) );
+            hash = state_hash( hash, &enemies.y[ 0 ], enemies.count * sizeof( float ) );
+            hash = state_hash( hash, &enemies.dx[ 0 ], enemies.count * sizeof( float ) );
+            hash = state_hash( hash, &enemies.dy[ 0 ], enemies.count * sizeof( float ) );
+        }
+        printf( "entities: %i\n", enemies.count );
+        printf( "ticks: %i\n", sim.lc );
+        printf( "ticks/s: %.1f\n", sim.lc * 1000000.0 / std::max( run_us, (Uint64)1 ) );
+        for( int p = PROF_INPUT; p <= PROF_ANIMATE; p++ ) {
+            printf( "%s: %.3f us/tick\n", PROF_PHASE_NAMES[ p ], (float)prof.total[ p ] / std::max( sim.lc, 1 ) );
+        }
+        printf( "state: %08x\n", hash );
+    }
+    trace_stop();
 	SDL_Quit();
+	level_close( map );
 	delete map;
 	return 0;
 }
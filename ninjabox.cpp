@@ -3,26 +3,31 @@
 #include <SDL/SDL_ttf.h>
 #include <string>
 #include <stdio.h>
+#include <stdlib.h>
 #include <iostream>
 #include <sstream>
 #include <cmath>
 #include <vector>
+#include <map>
+#include <algorithm>
 #include <stdarg.h>
 
 #include <Box2D/Box2D.h>
 
-#include <tmxparser/Tmx.h>
+#include "level.h"
+#include "image.h"
+#include "assets.h"
+#include "anim.h"
+#include "replay.h"
+#include "trace.h"
+#include "dirty.h"
+#include "profile.h"
+#include "snapshot.h"
+#include "blit.h"
+#include "workers.h"
+#include "physstats.h"
+#include "edits.h"
 
-#ifdef DEBUG
-inline void printf_debug( const char* f, ... ) {
-    va_list argp;
-    va_start( argp, f );
-    vfprintf( stderr, f, argp );
-}
-#else
-inline void printf_debug( const char* f, ... ) {
-}
-#endif
 
 
 const int SCREEN_WIDTH = 640;
@@ -32,12 +37,42 @@ const int SCREEN_FLAGS = SDL_HWSURFACE | SDL_DOUBLEBUF | SDL_ASYNCBLIT;// | SDL_
 const int FPSFPS = 10; // rate at which FPS display is updated
 const float GRAVITY = 9.81f; // metres per second per second
 const int FPS_CAP = 60; // if FLIP isn't vsynced, limit to this so we don't waste cycles
-const float SLOW_DOWN = 1.0;
+const float SLOW_DOWN = 1.0; // game time runs this many times slower than real time
+const int SIM_RATE = 60; // physics ticks per second, Box2D wants a constant dt
+const float SIM_DT = 1.0f / SIM_RATE;
+const float MAX_FRAME_TIME = 0.25f; // s, don't try to catch up on more than this
 // pixels per metre
 const float SCALE = 40; // pixels per metre
 
-Tmx::Map *map;
-std::map<std::string, SDL_Surface*> tilesets;
+struct level *map;
+std::vector<SDL_Surface*> tilesets; // image for each of the level's tilesets
+
+// what to blit for each gid, resolved once at load time so drawing a
+// tile is a single index
+struct tile_src {
+    SDL_Surface *surface;
+    SDL_Rect rect;
+    bool opaque; // hides whatever is under it
+};
+std::vector<struct tile_src> tile_srcs;
+void build_tile_srcs();
+
+// per cell, the drawing order of the topmost opaque tile there, or -1.
+// Nothing under it is ever baked
+std::vector<int> cell_cover;
+void build_cover();
+void load_tilesets();
+
+// one bit per map cell, row-major, packed into 64 bit words
+// so a cell test is a shift and a mask
+struct solid_grid {
+    int w;
+    int h;
+    int stride; // words per row
+    std::vector<Uint64> bits;
+};
+struct solid_grid solidity;
+void build_solidity();
 
 // SDL Stuff
 
@@ -55,18 +90,8 @@ b2World* world;
 
 // ********** global funcs ************
 
-struct sprite_frame {
-    SDL_Rect rect;
-    float duration; //s
-};
-struct animation {
-    int index;
-    struct sprite_frame *frames;
-    int count;
-};
-
 SDL_Rect calculate_viewport( int x, int y, int w, int h ) {
-    SDL_Rect r;
+    SDL_Rect r = { 0, 0, 0, 0 };
     if( w < SCREEN_WIDTH || h < SCREEN_HEIGHT ) {
         // centre it
         if( w < SCREEN_WIDTH ) {
@@ -99,41 +124,15 @@ SDL_Rect calculate_viewport( int x, int y, int w, int h ) {
     }
 }
 
-SDL_Surface *load_image( std::string filename ) {
-    SDL_Surface *loadedImage = NULL;
-    SDL_Surface *optimisedImage = NULL;
-    loadedImage = IMG_Load( filename.c_str() );
-    if( loadedImage != NULL ) {
-        return loadedImage;
-        optimisedImage = SDL_DisplayFormatAlpha( loadedImage );
-        SDL_FreeSurface( loadedImage );
-    }
-    return optimisedImage;
-}
 void apply_sprite( int x, int y, SDL_Surface *source, SDL_Rect *frame, SDL_Surface *destination ) {
-    SDL_Rect offset;
-    offset.x = x;
-    offset.y = y;
-    SDL_BlitSurface( source, frame, destination, &offset );
-}
-void apply_tile( int tw, int th, int sx, int sy, SDL_Surface *source, int dx, int dy, SDL_Surface *destination ) {
-    SDL_Rect soffset;
-    SDL_Rect doffset;
-    soffset.x = sx;
-    soffset.y = sy;
-    soffset.w = tw;
-    soffset.h = th;
-    doffset.x = dx;
-    doffset.y = dy;
-    doffset.w = tw;
-    doffset.h = th;
-    SDL_BlitSurface( source, &soffset, destination, &doffset );
+    blit_surface( source, frame, destination, x, y );
+}
+void apply_tile( const struct tile_src *src, int dx, int dy, SDL_Surface *destination ) {
+    SDL_Rect soffset = src->rect;
+    blit_surface( src->surface, &soffset, destination, dx, dy );
 }
 void apply_surface( int x, int y, SDL_Surface *source, SDL_Surface *destination ) {
-    SDL_Rect offset;
-    offset.x = x;
-    offset.y = y;
-    SDL_BlitSurface( source, NULL, destination, &offset );
+    blit_surface( source, NULL, destination, x, y );
 }
 void clear_surface( SDL_Surface *surf, Uint32 col ) {
     SDL_FillRect( surf, NULL, col );
@@ -148,250 +147,1213 @@ void apply_tiling_surface( int x, int y, int width, int x_offset, SDL_Surface *s
     srcoff.h = source->h;
     if( x_offset + width > source->w ) {
         srcoff.w = source->w - x_offset;
-        SDL_BlitSurface( source, &srcoff, destination, &offset );
+        blit_surface( source, &srcoff, destination, offset.x, offset.y );
         offset.x += srcoff.w;
         srcoff.x = 0;
         srcoff.w = width - srcoff.w;
-        SDL_BlitSurface( source, &srcoff, destination, &offset );
+        blit_surface( source, &srcoff, destination, offset.x, offset.y );
     } else {
         srcoff.w = width;
-        SDL_BlitSurface( source, &srcoff, destination, &offset );
+        blit_surface( source, &srcoff, destination, offset.x, offset.y );
     }
 }
 
+// the level is compiled from map/platformtest.tmx by levelc, see level.h
 void load_map() {
-    map = new Tmx::Map();
-    map->ParseFile("map/platformtest.tmx");
-
-    if (map->HasError()) {
-        //printf_debug("error code: %d\n", map->GetErrorCode());
-        //printf_debug("error text: %s\n", map->GetErrorText().c_str());
-        system("PAUSE");
+    map = new struct level;
+    if( !level_open( map, "map/platformtest.lvl" ) ) {
+        fprintf( stderr, "can't load map/platformtest.lvl, make levels to rebuild it\n" );
         exit(1);
     }
 
-    for (int i = 0; i < map->GetNumTilesets(); ++i) {
-        // Get a tileset.
-        const Tmx::Tileset *tileset = map->GetTileset(i);
-        tilesets[ tileset->GetImage()->GetSource() ] = load_image( ( "map/" + tileset->GetImage()->GetSource() ).c_str() );
+    build_solidity();
+}
+
+// tileset images, converted for the screen so needs the video mode set
+void load_tilesets() {
+    for (int i = 0; i < map->num_tilesets; ++i) {
+        const struct level_tileset *tileset = &map->tilesets[ i ];
+        const char *image = level_string( map, tileset->image );
+        tilesets.push_back( asset_acquire( std::string( "map/" ) + image, tileset->trans == LEVEL_NO_TRANS ? IMAGE_NO_KEY : tileset->trans ) );
     }
 
+    build_tile_srcs();
+    build_cover();
 }
 
+void free_tilesets() {
+    for( unsigned int i = 0; i < tilesets.size(); i++ ) {
+        asset_release( tilesets[ i ] );
+    }
+    tilesets.clear();
+    tile_srcs.clear();
+    cell_cover.clear();
+}
 
-int tile_is_solid( const Tmx::Tile *tile ) {
-    return ( tile->GetProperties().GetIntProperty( "solid" ) == 1 );
+void build_tile_srcs() {
+    tile_srcs.resize( map->num_gids );
+    for( int gid = 0; gid < map->num_gids; gid++ ) {
+        const struct level_tile *tile = &map->tiles[ gid ];
+        struct tile_src *src = &tile_srcs[ gid ];
+        src->surface = tile->tileset == LEVEL_NO_TILESET ? NULL : tilesets[ tile->tileset ];
+        src->rect.x = tile->x;
+        src->rect.y = tile->y;
+        src->rect.w = tile->w;
+        src->rect.h = tile->h;
+        src->opaque =
+            src->surface && tile->w >= map->tile_width && tile->h >= map->tile_height &&
+            image_rect_is_opaque( src->surface, &src->rect );
+    }
 }
 
-int level_is_solid_here( const Tmx::Layer *layer, int col, int row ) {
-    int tile_id = layer->GetTileId( col, row );
-    if( tile_id ) {
-        const Tmx::Tileset *tileset = map->FindTileset(tile_id);
-        const Tmx::Tile *tile = tileset->GetTile(tile_id);
-        if( tile ) {
-            // not sure why a tileid wouldn't resolve to a tile...
-            if( tile_is_solid( tile ) ) {
-                return 1;
-            }
+
+// layers go behind the sprites then in front, each lot in map order
+inline int layer_order( int layer ) {
+    return map->layers[ layer ].side * map->num_layers + layer;
+}
+
+// is the layer baked into chunks at all
+inline bool layer_shown( int layer ) {
+    return !level_layer_is_parallax( map, layer ) && map->layers[ layer ].visible;
+}
+
+// does the layer bake into the side's chunks
+inline bool layer_drawn( int layer, int side ) {
+    return layer_shown( layer ) && (int)map->layers[ layer ].side == side;
+}
+
+int find_cover( int col, int row ) {
+    int cover = -1;
+    for (int i = 0; i < map->num_layers; i++) {
+        if( layer_shown( i ) && tile_srcs[ level_gid( map, i, col, row ) ].opaque ) {
+            cover = std::max( cover, layer_order( i ) );
         }
     }
-    return 0;
+    return cover;
 }
 
-int map_is_solid_here( int col, int row ) {
-    for (int i = map->GetNumLayers() - 1; i >= 0; i--) {
-        const Tmx::Layer *layer = map->GetLayer(i);
-        if( level_is_solid_here( layer, col, row ) ) {
-            return 1;
+void build_cover() {
+    cell_cover.resize( map->width * map->height );
+    int hidden = 0;
+    for (int row = 0; row < map->height; row++) {
+        for (int col = 0; col < map->width; col++) {
+            int cover = cell_cover[ row * map->width + col ] = find_cover( col, row );
+            for (int i = 0; i < map->num_layers; i++) {
+                hidden += layer_shown( i ) && layer_order( i ) < cover && level_gid( map, i, col, row );
+            }
         }
     }
-    return 0;
+    TRACE( TRACE_INFO, TRACE_MAP, "%i tiles hidden under opaque ones", hidden );
 }
 
-const Tmx::Tile *get_tile_by_coords( int x, int y ) {
-    int col = x / map->GetTileWidth();
-    int row = y / map->GetTileHeight();
-    for (int i = map->GetNumLayers() - 1; i >= 0; i--) {
-        const Tmx::Layer *layer = map->GetLayer(i);
-        if( col < 0 || col >= layer->GetWidth() || row < 0 || row > layer->GetHeight() ) {
+int level_is_solid_here( int layer, int col, int row ) {
+    return ( map->tiles[ level_gid( map, layer, col, row ) ].flags & LEVEL_TILE_SOLID ) != 0;
+}
+
+// flatten solidity of all layers into the packed grid, parallax layers
+// are only scenery
+// only done at load time, everything else queries the bits
+void build_solidity() {
+    solidity.w = map->width;
+    solidity.h = map->height;
+    solidity.stride = ( solidity.w + 63 ) / 64;
+    solidity.bits.assign( solidity.stride * solidity.h, 0 );
+    for (int i = 0; i < map->num_layers; i++) {
+        if( level_layer_is_parallax( map, i ) ) {
             continue;
         }
-        int tile_id = layer->GetTileId( col, row );
-        if( tile_id > 0 ) {
-            const Tmx::Tileset *tileset = map->FindTileset(tile_id);
-            const Tmx::Tile *tile = tileset->GetTile(tile_id);
-            if( tile ) {
-                return tile;
+        for (int row = 0; row < solidity.h; row++) {
+            for (int col = 0; col < solidity.w; col++) {
+                if( level_is_solid_here( i, col, row ) ) {
+                    solidity.bits[ row * solidity.stride + ( col >> 6 ) ] |= (Uint64)1 << ( col & 63 );
+                }
             }
         }
     }
+}
+
+// from the level, for after one cell changed
+bool cell_is_solid( int col, int row ) {
+    bool solid = false;
+    for (int i = 0; i < map->num_layers; i++) {
+        solid = solid || ( !level_layer_is_parallax( map, i ) && level_is_solid_here( i, col, row ) );
+    }
+    return solid;
+}
+
+void set_solidity( int col, int row, bool solid ) {
+    Uint64 bit = (Uint64)1 << ( col & 63 );
+    Uint64 *word = &solidity.bits[ row * solidity.stride + ( col >> 6 ) ];
+    *word = solid ? *word | bit : *word & ~bit;
+}
+
+// off-map cells are never solid
+inline int map_is_solid_here( int col, int row ) {
+    if( col < 0 || col >= solidity.w || row < 0 || row >= solidity.h ) {
+        return 0;
+    }
+    return ( solidity.bits[ row * solidity.stride + ( col >> 6 ) ] >> ( col & 63 ) ) & 1;
+}
+
+const struct level_tile *get_tile_by_coords( int x, int y ) {
+    int col = x / map->tile_width;
+    int row = y / map->tile_height;
+    if( col < 0 || col >= map->width || row < 0 || row >= map->height ) {
+        return NULL;
+    }
+    for (int i = map->num_layers - 1; i >= 0; i--) {
+        int gid = level_layer_is_parallax( map, i ) ? 0 : level_gid( map, i, col, row );
+        if( gid ) {
+            return &map->tiles[ gid ];
+        }
+    }
     return NULL;
 }
 
 
-SDL_Surface *init_background( Tmx::Map *map ) {
-    // create surface for background using default bit masks
-    return SDL_CreateRGBSurface( SDL_HWSURFACE, map->GetWidth() * map->GetTileWidth(), map->GetHeight() * map->GetTileHeight(), 32, 0, 0, 0, 0 );
+SDL_Surface *init_background( struct level *map ) {
+    // create surface for background in the screen format
+    return create_display_surface( map->width * map->tile_width, map->height * map->tile_height );
 }
 
 int debug_render_map( int v_x, int v_y, SDL_Surface *destination ) {
-    for (int i = 0; i < map->GetNumObjectGroups(); i ++) {
-        const Tmx::ObjectGroup *group = map->GetObjectGroup(i);
-        for (int j = 0; j < group->GetNumObjects(); j ++) {
-            const Tmx::Object *ob = group->GetObject(j);
-            if( ob->GetType().compare("polyline") == 0 ) {
-                const Tmx::Polyline *pl = ob->GetPolyline();
-                int x = ob->GetX();
-                int y = ob->GetY();
-                b2Vec2 * vertices;
-                //printf_debug( "polyline %i\n", ob->GetPolyline()->GetNumPoints() );
-                for( int k = 0; k < ob->GetPolyline()->GetNumPoints(); k ++ ) {
-                    Tmx::Point p = ob->GetPolyline()->GetPoint( k );
-                    //vertices[ k ].Set( (float)(p.x)/SCALE, (float)(p.y)/SCALE );
-                    //printf_debug( "node %f %f\b", (float)(p.x), (float)(p.y) );
-                }
+    for (int i = 0; i < map->num_polylines; i ++) {
+        const struct level_polyline *pl = &map->polylines[ i ];
+        if( strcmp( level_string( map, pl->type ), "polyline" ) == 0 ) {
+            int x = pl->x;
+            int y = pl->y;
+            b2Vec2 * vertices;
+            //printf_debug( "polyline %i\n", pl->num_points );
+            for( int k = 0; k < (int)pl->num_points; k ++ ) {
+                struct level_point p = map->points[ pl->first_point + k ];
+                //vertices[ k ].Set( (float)(p.x)/SCALE, (float)(p.y)/SCALE );
+                //printf_debug( "node %f %f\b", (float)(p.x), (float)(p.y) );
             }
-
         }
-
     }
     return 1;
 }
+// draw the side's layers in one cell at dx,dy in destination, from its
+// cover up so nothing is drawn only to be drawn over. Returns the number
+// of tiles, just counting them if destination is NULL
+int render_map_cell( int side, int col, int row, SDL_Surface *destination, int dx, int dy, bool direct = false ) {
+    int drawn = 0;
+    int cover = cell_cover[ row * map->width + col ];
+    for (int i = 0; i < map->num_layers; i++) {
+        int gid = layer_drawn( i, side ) && layer_order( i ) >= cover ? level_gid( map, i, col, row ) : 0;
+        if( !gid ) {
+            continue;
+        }
+        drawn++;
+        if( destination == NULL ) {
+            continue;
+        }
+        // direct is safe off the main thread, see blit.h
+        if( direct ) {
+            blit_rect( tile_srcs[ gid ].surface, &tile_srcs[ gid ].rect, destination, dx, dy, std::max( blit_level(), (int)BLIT_SCALAR ) );
+        } else {
+            apply_tile( &tile_srcs[ gid ], dx, dy, destination );
+        }
+    }
+    return drawn;
+}
+
+// bake the side's layers over a cols x rows block of the map starting at
+// col0,row0 into destination, with the block's top left corner at 0,0.
+// Returns the number of tiles, as render_map_cell
+int render_map_region( int side, int col0, int row0, int cols, int rows, SDL_Surface *destination, bool direct = false ) {
+    int drawn = 0;
+    for (int y = row0; y < std::min( row0 + rows, map->height ); ++y) {
+        for (int x = col0; x < std::min( col0 + cols, map->width ); ++x) {
+            drawn += render_map_cell( side, x, y, destination, ( x - col0 ) * map->tile_width, ( y - row0 ) * map->tile_height, direct );
+        }
+    }
+    return drawn;
+}
+
 int render_map( int v_x, int v_y, SDL_Surface *destination ) {
-                //Tmx::Tile *tile = *(tileset->GetTiles().begin());
-                //tile_is_solid( tile )
-
-    // Iterate through the layers.
-    // test std::min( 0, 4 );
-
-    for (int y = 0; y < map->GetHeight(); ++y) {
-        for (int x = 0; x < map->GetWidth(); ++x) {
-            // iterate in reverse so we get top layer first
-            for (int i = map->GetNumLayers() - 1; i >= 0; i--) {
-                const Tmx::Layer *layer = map->GetLayer(i);
-                int tile_id = layer->GetTileId(x, y);
-                if( tile_id ) {
-                    const Tmx::Tileset *tileset = map->FindTileset(tile_id);
-                    const Tmx::Tile *tile = tileset->GetTile(tile_id);
-                    if( tile ) {
-                        // not sure why a tileid wouldn't resolve to a tile...
-                        if( tile_is_solid( tile ) ) {
-                            // TODO
-                        } else {
-                            // TODO
-                        }
-                    } else {
-                        // we have to construct a tile ourselves!
-                        // TODO
-                    }
-                    // This is all very shit - TODO modify TmxParser to calculate this crap for you
-                    // TODO margin and spacing compensation
-                    int tileset_cols = tileset->GetImage()->GetWidth() / tileset->GetTileWidth();
-                    int tileset_rows = tileset->GetImage()->GetHeight() / tileset->GetTileHeight();
-                    int tile_index = tile_id;
-                    int col = ( tile_index % tileset_cols );
-                    int row = ( tile_index / tileset_cols );
-                    apply_tile(
-                        tileset->GetTileWidth(),
-                        tileset->GetTileHeight(),
-                        col * ( tileset->GetSpacing() + tileset->GetTileWidth() ) + tileset->GetMargin(),
-                        row * ( tileset->GetSpacing() + tileset->GetTileHeight() ) + tileset->GetMargin(),
-                        tilesets[ tileset->GetImage()->GetSource() ], x * tileset->GetTileWidth(), y * tileset->GetTileHeight(), destination
-                    );
-                    //we only really care about the top tile for now
+    return render_map_region( LEVEL_BEHIND, 0, 0, map->width, map->height, destination );
+}
+
+// ************* parallax layers ******************
+//
+// layers with a parallax or image property scroll at their own rate
+// behind the map. Each is baked once into a strip as wide as the map
+// holding just the rows it uses, then wrapped across the screen, so a
+// layer costs a blit or two a frame. Wherever the map's own tiles are all
+// opaque none of them are drawn at all.
+
+const Uint32 PARALLAX_KEY = 0xff00ff; // see-through, in strips and chunks
+
+struct parallax_layer {
+    SDL_Surface *strip;
+    bool shared; // an image asset, released rather than freed
+    bool opaque; // nothing behind shows through
+    float scroll_x;
+    float scroll_y;
+    int top; // px, where the strip sits with the camera at 0,0
+};
+struct parallax {
+    std::vector<struct parallax_layer> layers; // back to front
+    // 2D Fenwick tree of the cells the map leaves uncovered, so any
+    // rectangle of them can be counted, or one cell changed, in
+    // log width * log height steps
+    std::vector<int> holes; // ( width + 1 ) * ( height + 1 )
+};
+
+// fill with the key colour and make that see-through, not RLE since
+// tiles are still to be drawn into it
+void key_surface( SDL_Surface *surface ) {
+    Uint32 key = SDL_MapRGB( surface->format, PARALLAX_KEY >> 16, ( PARALLAX_KEY >> 8 ) & 0xff, PARALLAX_KEY & 0xff );
+    SDL_FillRect( surface, NULL, key );
+    SDL_SetColorKey( surface, SDL_SRCCOLORKEY, key );
+}
+
+void parallax_bake_tiles( struct parallax_layer *pl, int layer ) {
+    int top = map->height;
+    int bottom = 0;
+    for( int row = 0; row < map->height; row++ ) {
+        for( int col = 0; col < map->width; col++ ) {
+            if( level_gid( map, layer, col, row ) ) {
+                top = std::min( top, row );
+                bottom = row + 1;
+            }
+        }
+    }
+    pl->strip = NULL;
+    if( top >= bottom ) {
+        return;
+    }
+    pl->opaque = true;
+    for( int row = top; row < bottom; row++ ) {
+        for( int col = 0; col < map->width; col++ ) {
+            pl->opaque = pl->opaque && tile_srcs[ level_gid( map, layer, col, row ) ].opaque;
+        }
+    }
+    pl->strip = create_display_surface( map->width * map->tile_width, ( bottom - top ) * map->tile_height );
+    if( !pl->opaque ) {
+        key_surface( pl->strip );
+    }
+    for( int row = top; row < bottom; row++ ) {
+        for( int col = 0; col < map->width; col++ ) {
+            int gid = level_gid( map, layer, col, row );
+            if( gid ) {
+                apply_tile( &tile_srcs[ gid ], col * map->tile_width, ( row - top ) * map->tile_height, pl->strip );
+            }
+        }
+    }
+    pl->top = top * map->tile_height;
+}
+
+void parallax_add_hole( struct parallax *p, int col, int row, int n ) {
+    int w = map->width + 1;
+    for( int r = row + 1; r <= map->height; r += r & -r ) {
+        for( int c = col + 1; c <= map->width; c += c & -c ) {
+            p->holes[ r * w + c ] += n;
+        }
+    }
+}
+
+// uncovered cells in the cols and rows before col, row
+int parallax_holes_before( const struct parallax *p, int col, int row ) {
+    int w = map->width + 1;
+    int n = 0;
+    for( int r = row; r > 0; r -= r & -r ) {
+        for( int c = col; c > 0; c -= c & -c ) {
+            n += p->holes[ r * w + c ];
+        }
+    }
+    return n;
+}
+
+// strips for the visible parallax layers and the map's holes, needs the
+// tilesets loaded and the cover built
+void parallax_init( struct parallax *p ) {
+    for( int i = 0; i < map->num_layers; i++ ) {
+        const struct level_layer *layer = &map->layers[ i ];
+        if( !level_layer_is_parallax( map, i ) || !layer->visible ) {
+            continue;
+        }
+        struct parallax_layer pl;
+        pl.scroll_x = layer->scroll_x;
+        pl.scroll_y = layer->scroll_y;
+        pl.shared = layer->image != LEVEL_NO_IMAGE;
+        if( pl.shared ) {
+            pl.strip = asset_acquire( std::string( "map/" ) + level_string( map, layer->image ) );
+            pl.top = 0;
+            if( pl.strip ) {
+                SDL_Rect all = { 0, 0, (Uint16)pl.strip->w, (Uint16)pl.strip->h };
+                pl.opaque = image_rect_is_opaque( pl.strip, &all );
+            }
+        } else {
+            parallax_bake_tiles( &pl, i );
+        }
+        if( pl.strip ) {
+            p->layers.push_back( pl );
+        }
+    }
+    TRACE( TRACE_INFO, TRACE_RENDER, "%i parallax layers", (int)p->layers.size() );
+    if( p->layers.empty() ) {
+        return;
+    }
+    p->holes.assign( ( map->width + 1 ) * ( map->height + 1 ), 0 );
+    for( int row = 0; row < map->height; row++ ) {
+        for( int col = 0; col < map->width; col++ ) {
+            if( cell_cover[ row * map->width + col ] < 0 ) {
+                parallax_add_hole( p, col, row, 1 );
+            }
+        }
+    }
+}
+
+void parallax_free( struct parallax *p ) {
+    for( unsigned int i = 0; i < p->layers.size(); i++ ) {
+        if( p->layers[ i ].shared ) {
+            asset_release( p->layers[ i ].strip );
+        } else {
+            SDL_FreeSurface( p->layers[ i ].strip );
+        }
+    }
+    p->layers.clear();
+    p->holes.clear();
+}
+
+// uncovered cells in cols c0..c1, rows r0..r1, ends exclusive
+int parallax_holes( const struct parallax *p, int c0, int r0, int c1, int r1 ) {
+    c0 = std::max( c0, 0 );
+    r0 = std::max( r0, 0 );
+    c1 = std::min( c1, map->width );
+    r1 = std::min( r1, map->height );
+    if( p->holes.empty() || c0 >= c1 || r0 >= r1 ) {
+        return 0;
+    }
+    return parallax_holes_before( p, c1, r1 ) - parallax_holes_before( p, c0, r1 ) -
+        parallax_holes_before( p, c1, r0 ) + parallax_holes_before( p, c0, r0 );
+}
+
+// the layers showing through the map in viewport vp, back to front from
+// the nearest one that hides everything behind it
+void draw_parallax( const struct parallax *p, SDL_Rect vp, SDL_Surface *destination ) {
+    int holes = parallax_holes(
+        p, vp.x / map->tile_width, vp.y / map->tile_height, ( vp.x + vp.w + map->tile_width - 1 ) / map->tile_width, ( vp.y + vp.h + map->tile_height - 1 ) / map->tile_height
+    );
+    if( holes == 0 ) {
+        return;
+    }
+    int first = 0;
+    for( int i = (int)p->layers.size() - 1; i > 0; i-- ) {
+        const struct parallax_layer *pl = &p->layers[ i ];
+        int y = pl->top - (int)( vp.y * pl->scroll_y );
+        if( pl->opaque && y <= 0 && y + pl->strip->h >= destination->h ) {
+            first = i;
+            break;
+        }
+    }
+    for( int i = first; i < (int)p->layers.size(); i++ ) {
+        const struct parallax_layer *pl = &p->layers[ i ];
+        int y = pl->top - (int)( vp.y * pl->scroll_y );
+        if( y >= destination->h || y + pl->strip->h <= 0 ) {
+            continue;
+        }
+        int w = pl->strip->w;
+        int offset = (int)( vp.x * pl->scroll_x ) % w;
+        if( offset < 0 ) {
+            offset += w;
+        }
+        // one strip's width at a time, so narrow strips repeat
+        for( int x = 0; x < destination->w; x += w ) {
+            apply_tiling_surface( x, y, std::min( w, destination->w - x ), offset, pl->strip, destination );
+        }
+    }
+}
+
+// ************* background chunk cache ******************
+//
+// rather than baking the whole map into one surface, bake CHUNK_TILES
+// square blocks as the viewport approaches them and throw away the least
+// recently drawn ones once we're over budget, so memory follows the
+// screen size instead of the level size
+
+const int CHUNK_TILES = 8;
+const int CHUNK_BUDGET = 6 * 1024 * 1024; // bytes
+
+struct bg_chunk {
+    SDL_Surface *surface; // NULL if there's nothing on this side here
+    Uint32 last_used; // frame it was last drawn or prefetched
+};
+struct chunk_cache {
+    std::map<int, struct bg_chunk> chunks; // keyed by chunk_key()
+    int across;
+    int down;
+    int bytes;
+    Uint32 frame;
+    struct worker_pool pool; // bakes missing chunks in parallel
+    struct parallax *behind; // chunks over its holes are see-through
+};
+
+inline int chunk_key( const struct chunk_cache *cache, int side, int ccol, int crow ) {
+    return ( side * cache->down + crow ) * cache->across + ccol;
+}
+
+inline int chunk_bytes( SDL_Surface *surface ) {
+    return surface ? surface->pitch * surface->h : 0;
+}
+
+void chunk_cache_init( struct chunk_cache *cache, struct parallax *behind ) {
+    cache->behind = behind;
+    cache->across = ( map->width + CHUNK_TILES - 1 ) / CHUNK_TILES;
+    cache->down = ( map->height + CHUNK_TILES - 1 ) / CHUNK_TILES;
+    cache->bytes = 0;
+    cache->frame = 0;
+    workers_start( &cache->pool );
+}
+
+void chunk_cache_free( struct chunk_cache *cache ) {
+    for( std::map<int, struct bg_chunk>::iterator it = cache->chunks.begin(); it != cache->chunks.end(); ++it ) {
+        SDL_FreeSurface( it->second.surface );
+    }
+    cache->chunks.clear();
+    cache->bytes = 0;
+    workers_stop( &cache->pool );
+}
+
+// drop least recently used chunks, but never one wanted this frame
+void chunk_cache_evict( struct chunk_cache *cache ) {
+    while( cache->bytes > CHUNK_BUDGET ) {
+        std::map<int, struct bg_chunk>::iterator oldest = cache->chunks.end();
+        for( std::map<int, struct bg_chunk>::iterator it = cache->chunks.begin(); it != cache->chunks.end(); ++it ) {
+            if( oldest == cache->chunks.end() || it->second.last_used < oldest->second.last_used ) {
+                oldest = it;
+            }
+        }
+        if( oldest == cache->chunks.end() || oldest->second.last_used == cache->frame ) {
+            return;
+        }
+        cache->bytes -= chunk_bytes( oldest->second.surface );
+        SDL_FreeSurface( oldest->second.surface );
+        cache->chunks.erase( oldest );
+    }
+}
+
+// an empty chunk, or NULL if the side has no tiles there. Front chunks
+// and those over a parallax layer's holes are keyed so what's behind them
+// shows through
+SDL_Surface *chunk_cache_surface( struct chunk_cache *cache, int side, int ccol, int crow, int cols, int rows ) {
+    int c0 = ccol * CHUNK_TILES;
+    int r0 = crow * CHUNK_TILES;
+    if( render_map_region( side, c0, r0, cols, rows, NULL ) == 0 ) {
+        return NULL;
+    }
+    SDL_Surface *surface = create_display_surface( cols * map->tile_width, rows * map->tile_height );
+    if( side == LEVEL_FRONT || parallax_holes( cache->behind, c0, r0, c0 + cols, r0 + rows ) > 0 ) {
+        key_surface( surface );
+    }
+    return surface;
+}
+
+// a batch of chunks being baked at once, one job each
+struct chunk_bake {
+    int across;
+    int down;
+    bool direct;
+    std::vector<int> keys;
+    std::vector<SDL_Surface *> surfaces;
+};
+
+void chunk_bake_job( void *data, int index ) {
+    struct chunk_bake *bake = (struct chunk_bake *)data;
+    int key = bake->keys[ index ];
+    int ccol = key % bake->across;
+    int crow = key / bake->across % bake->down;
+    int side = key / bake->across / bake->down;
+    render_map_region( side, ccol * CHUNK_TILES, crow * CHUNK_TILES, CHUNK_TILES, CHUNK_TILES, bake->surfaces[ index ], bake->direct );
+}
+
+// can tiles go into surface with blit_rect, so off the main thread
+bool tiles_can_copy( SDL_Surface *surface ) {
+    for( unsigned int i = 0; i < tilesets.size(); i++ ) {
+        if( tilesets[ i ] == NULL || blit_kind( tilesets[ i ], surface ) == BLIT_NONE ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void lock_surfaces( const std::vector<SDL_Surface *> &surfaces ) {
+    for( unsigned int i = 0; i < surfaces.size(); i++ ) {
+        if( SDL_MUSTLOCK( surfaces[ i ] ) ) {
+            SDL_LockSurface( surfaces[ i ] );
+        }
+    }
+}
+
+void unlock_surfaces( const std::vector<SDL_Surface *> &surfaces ) {
+    for( unsigned int i = 0; i < surfaces.size(); i++ ) {
+        if( SDL_MUSTLOCK( surfaces[ i ] ) ) {
+            SDL_UnlockSurface( surfaces[ i ] );
+        }
+    }
+}
+
+// bake every chunk of the side in c0,r0 - c1,r1 that isn't already, split
+// across the pool when the tiles allow it and one after another when they
+// don't. Those already baked count as used this frame
+void chunk_cache_bake( struct chunk_cache *cache, int side, int c0, int r0, int c1, int r1 ) {
+    struct chunk_bake bake;
+    bake.across = cache->across;
+    bake.down = cache->down;
+    for( int crow = r0; crow <= r1; crow++ ) {
+        for( int ccol = c0; ccol <= c1; ccol++ ) {
+            int key = chunk_key( cache, side, ccol, crow );
+            std::map<int, struct bg_chunk>::iterator it = cache->chunks.find( key );
+            if( it != cache->chunks.end() ) {
+                it->second.last_used = cache->frame;
+                continue;
+            }
+            // edge chunks are cut short by the map
+            int cols = std::min( CHUNK_TILES, map->width - ccol * CHUNK_TILES );
+            int rows = std::min( CHUNK_TILES, map->height - crow * CHUNK_TILES );
+            struct bg_chunk chunk;
+            chunk.surface = chunk_cache_surface( cache, side, ccol, crow, cols, rows );
+            chunk.last_used = cache->frame;
+            cache->chunks[ key ] = chunk;
+            cache->bytes += chunk_bytes( chunk.surface );
+            if( chunk.surface ) {
+                bake.keys.push_back( key );
+                bake.surfaces.push_back( chunk.surface );
+            }
+        }
+    }
+    if( bake.keys.empty() ) {
+        return;
+    }
+    bake.direct = tiles_can_copy( bake.surfaces[ 0 ] );
+    if( !bake.direct ) {
+        for( unsigned int i = 0; i < bake.keys.size(); i++ ) {
+            chunk_bake_job( &bake, i );
+        }
+        return;
+    }
+    // locked here, on this thread, so the workers only see plain pixels
+    lock_surfaces( tilesets );
+    lock_surfaces( bake.surfaces );
+    workers_run( &cache->pool, bake.keys.size(), chunk_bake_job, &bake );
+    unlock_surfaces( bake.surfaces );
+    unlock_surfaces( tilesets );
+    TRACE( TRACE_DEBUG, TRACE_RENDER, "baked %i chunks on %i threads", (int)bake.keys.size(), cache->pool.num_threads + 1 );
+}
+
+SDL_Surface *chunk_cache_get( struct chunk_cache *cache, int side, int ccol, int crow ) {
+    int key = chunk_key( cache, side, ccol, crow );
+    std::map<int, struct bg_chunk>::iterator it = cache->chunks.find( key );
+    if( it != cache->chunks.end() ) {
+        it->second.last_used = cache->frame;
+        return it->second.surface;
+    }
+    // edge chunks are cut short by the map
+    int cols = std::min( CHUNK_TILES, map->width - ccol * CHUNK_TILES );
+    int rows = std::min( CHUNK_TILES, map->height - crow * CHUNK_TILES );
+    struct bg_chunk chunk;
+    chunk.surface = chunk_cache_surface( cache, side, ccol, crow, cols, rows );
+    chunk.last_used = cache->frame;
+    if( chunk.surface ) {
+        render_map_region( side, ccol * CHUNK_TILES, crow * CHUNK_TILES, cols, rows, chunk.surface );
+    }
+    cache->chunks[ key ] = chunk;
+    cache->bytes += chunk_bytes( chunk.surface );
+    return chunk.surface;
+}
+
+// redraw one edited cell in the chunks holding it, or drop a chunk to be
+// baked afresh when it's empty or should now be keyed differently
+void chunk_cache_patch( struct chunk_cache *cache, int col, int row ) {
+    int ccol = col / CHUNK_TILES;
+    int crow = row / CHUNK_TILES;
+    int c0 = ccol * CHUNK_TILES;
+    int r0 = crow * CHUNK_TILES;
+    for( int side = LEVEL_BEHIND; side <= LEVEL_FRONT; side++ ) {
+        std::map<int, struct bg_chunk>::iterator it = cache->chunks.find( chunk_key( cache, side, ccol, crow ) );
+        if( it == cache->chunks.end() ) {
+            continue;
+        }
+        SDL_Surface *surface = it->second.surface;
+        bool keyed = surface && ( surface->flags & SDL_SRCCOLORKEY );
+        bool see_through = side == LEVEL_FRONT || parallax_holes( cache->behind, c0, r0, c0 + CHUNK_TILES, r0 + CHUNK_TILES ) > 0;
+        if( surface == NULL || keyed != see_through ) {
+            cache->bytes -= chunk_bytes( surface );
+            SDL_FreeSurface( surface );
+            cache->chunks.erase( it );
+            continue;
+        }
+        SDL_Rect cell = { (Sint16)( ( col - c0 ) * map->tile_width ), (Sint16)( ( row - r0 ) * map->tile_height ), (Uint16)map->tile_width, (Uint16)map->tile_height };
+        SDL_FillRect( surface, &cell, keyed ? surface->format->colorkey : 0 );
+        render_map_cell( side, col, row, surface, cell.x, cell.y );
+    }
+}
+
+// once a frame, before any drawing: bake both sides' chunks under
+// viewport vp that are missing and any within half a chunk of the edge,
+// then drop what's over budget
+void prepare_background( struct chunk_cache *cache, SDL_Rect vp ) {
+    const int cw = CHUNK_TILES * map->tile_width;
+    const int ch = CHUNK_TILES * map->tile_height;
+    cache->frame++;
+    int c0 = std::max( 0, (int)vp.x - cw / 2 ) / cw;
+    int r0 = std::max( 0, (int)vp.y - ch / 2 ) / ch;
+    int c1 = std::min( cache->across - 1, ( vp.x + vp.w + cw / 2 - 1 ) / cw );
+    int r1 = std::min( cache->down - 1, ( vp.y + vp.h + ch / 2 - 1 ) / ch );
+    for( int side = LEVEL_BEHIND; side <= LEVEL_FRONT; side++ ) {
+        chunk_cache_bake( cache, side, c0, r0, c1, r1 );
+    }
+    chunk_cache_evict( cache );
+}
+
+// blit the side's chunks under viewport vp that overlap destination's
+// clip rect, which prepare_background has baked already
+void draw_background( struct chunk_cache *cache, int side, SDL_Rect vp, SDL_Surface *destination ) {
+    const int cw = CHUNK_TILES * map->tile_width;
+    const int ch = CHUNK_TILES * map->tile_height;
+    const SDL_Rect &clip = destination->clip_rect;
+    int c0 = std::max( 0, vp.x + clip.x ) / cw;
+    int r0 = std::max( 0, vp.y + clip.y ) / ch;
+    int c1 = std::min( cache->across - 1, ( vp.x + clip.x + clip.w - 1 ) / cw );
+    int r1 = std::min( cache->down - 1, ( vp.y + clip.y + clip.h - 1 ) / ch );
+    for( int crow = r0; crow <= r1; crow++ ) {
+        for( int ccol = c0; ccol <= c1; ccol++ ) {
+            SDL_Surface *chunk = chunk_cache_get( cache, side, ccol, crow );
+            if( chunk ) {
+                apply_surface( ccol * cw - vp.x, crow * ch - vp.y, chunk, destination );
+            }
+        }
+    }
+}
+
+// ************* contact routing ******************
+//
+// Box2D tells one listener about every contact in the world. Fixtures that
+// care carry a contact_tag as their user data, saying what kind of thing
+// they are and whose, and their filter category keeps them out of contacts
+// they'd never care about in the first place. The listener only queues
+// events for tagged fixtures, and after the step the queue goes out
+// through a table of handlers by tag type. A new kind of thing adds a row
+// to the table rather than a test to every contact, and handlers are free
+// to change the world since it's no longer locked.
+
+// filter categories
+enum {
+    CONTACT_CAT_GROUND = 1 << 0, // Box2D's default
+    CONTACT_CAT_PLAYER = 1 << 1,
+    CONTACT_CAT_SENSOR = 1 << 2
+};
+
+enum { CONTACT_NONE, CONTACT_FOOT, CONTACT_NUM_TYPES };
+
+// has to last until the events for its fixture have been dispatched
+struct contact_tag {
+    int type;
+    void *owner;
+};
+
+struct contact_event {
+    bool begin; // or end
+    const struct contact_tag *tag; // the fixture it's for
+    const struct contact_tag *other_tag; // NULL if the other isn't tagged
+    Uint16 other_category;
+};
+
+typedef void (*contact_handler)( const struct contact_event *e );
+
+class contact_router : public b2ContactListener {
+public:
+    contact_handler handlers[ CONTACT_NUM_TYPES ];
+    std::vector<struct contact_event> queue;
+
+    contact_router() {
+        std::fill( handlers, handlers + CONTACT_NUM_TYPES, (contact_handler)NULL );
+    }
+    void BeginContact( b2Contact *contact ) {
+        queue_side( contact->GetFixtureA(), contact->GetFixtureB(), true );
+        queue_side( contact->GetFixtureB(), contact->GetFixtureA(), true );
+    }
+    void EndContact( b2Contact *contact ) {
+        queue_side( contact->GetFixtureA(), contact->GetFixtureB(), false );
+        queue_side( contact->GetFixtureB(), contact->GetFixtureA(), false );
+    }
+    void queue_side( b2Fixture *fixture, b2Fixture *other, bool begin ) {
+        const struct contact_tag *tag = (const struct contact_tag *)fixture->GetUserData();
+        if( tag == NULL || handlers[ tag->type ] == NULL ) {
+            return;
+        }
+        // the other fixture may be gone by the time this is handled
+        struct contact_event e = {
+            begin, tag, (const struct contact_tag *)other->GetUserData(), other->GetFilterData().categoryBits
+        };
+        queue.push_back( e );
+    }
+    // once the step has returned, ends of contacts from destroyed bodies
+    // included
+    void dispatch() {
+        for( unsigned int i = 0; i < queue.size(); i++ ) {
+            handlers[ queue[ i ].tag->type ]( &queue[ i ] );
+        }
+        queue.clear();
+    }
+};
+
+// ************* static geometry streaming ******************
+//
+// Only the static geometry near the camera or near something moving is in
+// the Box2D world, so the broadphase and the world's memory go with the
+// neighbourhood rather than the size of the level.
+//
+// Solid cells are greedily merged into as few boxes as possible, which
+// also gets rid of most of the internal edges between tiles that the
+// player snags on. Boxes never cross a SOLID_BLOCK square, so the boxes
+// are worked out once per block, kept a few bytes each, and a block's
+// static body is made from them when something comes within
+// STREAM_MARGIN and destroyed again once nothing is within twice that.
+// Polylines stream the same way, a body each, by their bounds.
+const int SOLID_BLOCK = 8; // cells
+const int STREAM_MARGIN = 256; // px
+
+// in cells from the block's corner
+struct block_box {
+    Uint8 x;
+    Uint8 y;
+    Uint8 w;
+    Uint8 h;
+};
+
+struct stream_item {
+    int x0; // px covered
+    int y0;
+    int x1;
+    int y1;
+    std::vector<struct block_box> boxes; // a block's, empty for polylines
+    int polyline; // into the map's, -1 for a block
+    b2Body *body; // NULL while out of the world
+    Uint32 seen; // last update it was in range
+};
+
+struct static_stream {
+    std::vector<struct stream_item> items; // blocks row by row, then polylines
+    int across; // blocks
+    int down;
+    std::vector<int> live; // items with a body
+    Uint32 stamp; // updates so far
+    // polyline items by the blocks their bounds cover, so only those near
+    // a region are looked at, line_starts is the first of each block's in
+    // lines and one past the last
+    std::vector<int> line_starts;
+    std::vector<int> lines;
+};
+
+struct static_stream statics;
+
+inline int grid_bit( const std::vector<Uint64> &bits, int col, int row ) {
+    return ( bits[ row * solidity.stride + ( col >> 6 ) ] >> ( col & 63 ) ) & 1;
+}
+
+// a block's solid cells as boxes, the widest run along a row then as
+// many rows down as that whole run stays solid
+void merge_block( int bcol, int brow, std::vector<struct block_box> *out ) {
+    int c0 = bcol * SOLID_BLOCK;
+    int r0 = brow * SOLID_BLOCK;
+    int c1 = std::min( c0 + SOLID_BLOCK, solidity.w );
+    int r1 = std::min( r0 + SOLID_BLOCK, solidity.h );
+    bool todo[ SOLID_BLOCK ][ SOLID_BLOCK ];
+    for (int y = r0; y < r1; ++y) {
+        for (int x = c0; x < c1; ++x) {
+            todo[ y - r0 ][ x - c0 ] = grid_bit( solidity.bits, x, y );
+        }
+    }
+    out->clear();
+    for (int y = r0; y < r1; ++y) {
+        for (int x = c0; x < c1; ++x) {
+            if( !todo[ y - r0 ][ x - c0 ] ) {
+                continue;
+            }
+            int w = 1;
+            while( x + w < c1 && todo[ y - r0 ][ x + w - c0 ] ) {
+                w++;
+            }
+            int h = 1;
+            while( y + h < r1 ) {
+                int c = x;
+                while( c < x + w && todo[ y + h - r0 ][ c - c0 ] ) {
+                    c++;
+                }
+                if( c < x + w ) {
                     break;
-                } else {
-                    //Nuffin 'ere at all
                 }
+                h++;
             }
+            for (int r = y; r < y + h; r++) {
+                for (int c = x; c < x + w; c++) {
+                    todo[ r - r0 ][ c - c0 ] = false;
+                }
+            }
+            struct block_box box = { (Uint8)( x - c0 ), (Uint8)( y - r0 ), (Uint8)w, (Uint8)h };
+            out->push_back( box );
         }
     }
+}
 
-    return 1;
+b2Body *stream_create( const struct stream_item *item ) {
+    b2BodyDef groundBodyDef;
+    b2Body *body = world->CreateBody(&groundBodyDef);
+    if( item->polyline < 0 ) {
+        const float tw = (float)map->tile_width / SCALE;
+        const float th = (float)map->tile_height / SCALE;
+        int c0 = item->x0 / map->tile_width;
+        int r0 = item->y0 / map->tile_height;
+        for( unsigned int i = 0; i < item->boxes.size(); i++ ) {
+            const struct block_box *b = &item->boxes[ i ];
+            b2PolygonShape groundBox;
+            groundBox.SetAsBox(
+                b->w * tw / 2, b->h * th / 2,
+                b2Vec2( ( c0 + b->x + b->w / 2.0f ) * tw, ( r0 + b->y + b->h / 2.0f ) * th ),
+                0.0f
+            );
+            b2FixtureDef boxDef;
+            boxDef.shape = &groundBox;
+            boxDef.density = 0.0f;
+            boxDef.filter.categoryBits = CONTACT_CAT_GROUND;
+            body->CreateFixture(&boxDef);
+        }
+    } else {
+        const struct level_polyline *pl = &map->polylines[ item->polyline ];
+        b2Vec2 *vertices = new b2Vec2 [pl->num_points];
+        for( int k = 0; k < (int)pl->num_points; k ++ ) {
+            struct level_point p = map->points[ pl->first_point + k ];
+            // offset by the object position, the body sits at the origin
+            vertices[ k ].Set( (float)(pl->x + p.x)/SCALE, (float)(pl->y + p.y)/SCALE );
+        }
+        b2ChainShape chain;
+        chain.CreateChain( vertices, pl->num_points );
+        b2FixtureDef chainDef;
+        chainDef.shape = &chain;
+        chainDef.density = 10.0f;
+        chainDef.filter.categoryBits = CONTACT_CAT_GROUND;
+        body->CreateFixture(&chainDef);
+        delete [] vertices;
+    }
+    return body;
 }
 
-std::vector<b2Body*> solids;
-int build_map() {
-    for (int y = 0; y < map->GetHeight(); ++y) {
-        for (int x = 0; x < map->GetWidth(); ++x) {
-            // iterate in reverse so we get top layer first
-            for (int i = map->GetNumLayers() - 1; i >= 0; i--) {
-                const Tmx::Layer *layer = map->GetLayer(i);
-                int tile_id = layer->GetTileId(x, y);
-                if( tile_id ) {
-                    const Tmx::Tileset *tileset = map->FindTileset(tile_id);
-                    const Tmx::Tile *tile = tileset->GetTile(tile_id);
-                    if( tile ) {
-                        // not sure why a tileid wouldn't resolve to a tile...
-                        if( tile_is_solid( tile ) ) {
-                            b2BodyDef groundBodyDef;
-                            groundBodyDef.position.Set(
-                                ((float)x + 0.5) * tileset->GetTileWidth() / SCALE,
-                                ((float)y + 0.5) * tileset->GetTileHeight() / SCALE
-                            );
-                            groundBodyDef.userData = (void*)tile;
-                            b2Body* groundBody = world->CreateBody(&groundBodyDef);
-                            b2PolygonShape groundBox;
-                            groundBox.SetAsBox(
-                                (float)(tileset->GetTileWidth()) / SCALE / 2,
-                                (float)(tileset->GetTileHeight()) / SCALE / 2
-                            );
-
-                            groundBody->CreateFixture(&groundBox, 0.0f);
-                            solids.push_back( groundBody );
-                            
-
-                        } else {
-                            // TODO
-                        }
+// take the k'th live item out of the world
+void stream_drop( struct static_stream *s, unsigned int k ) {
+    struct stream_item *item = &s->items[ s->live[ k ] ];
+    world->DestroyBody( item->body );
+    item->body = NULL;
+    s->live[ k ] = s->live.back();
+    s->live.pop_back();
+}
+
+// the blocks within margin of a region, clamped to the map, so c1 < c0
+// or r1 < r0 if there are none
+void stream_blocks( const struct static_stream *s, int x0, int y0, int x1, int y1, int margin, int *c0, int *r0, int *c1, int *r1 ) {
+    const int cw = SOLID_BLOCK * map->tile_width;
+    const int ch = SOLID_BLOCK * map->tile_height;
+    *c0 = std::max( 0, ( x0 - margin ) / cw );
+    *r0 = std::max( 0, ( y0 - margin ) / ch );
+    *c1 = std::min( s->across - 1, ( x1 + margin ) / cw );
+    *r1 = std::min( s->down - 1, ( y1 + margin ) / ch );
+}
+
+// work out every block's boxes and every polyline's bounds, nothing goes
+// into the world until stream_update
+void stream_init( struct static_stream *s ) {
+    s->across = ( solidity.w + SOLID_BLOCK - 1 ) / SOLID_BLOCK;
+    s->down = ( solidity.h + SOLID_BLOCK - 1 ) / SOLID_BLOCK;
+    s->items.clear();
+    s->items.resize( s->across * s->down );
+    s->live.clear();
+    s->stamp = 0;
+    int boxes = 0;
+    for (int brow = 0; brow < s->down; brow++) {
+        for (int bcol = 0; bcol < s->across; bcol++) {
+            struct stream_item *item = &s->items[ brow * s->across + bcol ];
+            item->x0 = bcol * SOLID_BLOCK * map->tile_width;
+            item->y0 = brow * SOLID_BLOCK * map->tile_height;
+            item->x1 = item->x0 + SOLID_BLOCK * map->tile_width;
+            item->y1 = item->y0 + SOLID_BLOCK * map->tile_height;
+            item->polyline = -1;
+            item->body = NULL;
+            item->seen = 0;
+            merge_block( bcol, brow, &item->boxes );
+            boxes += item->boxes.size();
+        }
+    }
+    TRACE( TRACE_INFO, TRACE_MAP, "%i solid boxes in %i blocks", boxes, s->across * s->down );
+    TRACE( TRACE_INFO, TRACE_MAP, "map has %i polylines", map->num_polylines );
+    for (int i = 0; i < map->num_polylines; i ++) {
+        const struct level_polyline *pl = &map->polylines[ i ];
+        if( strcmp( level_string( map, pl->type ), "polyline" ) != 0 || pl->num_points < 2 ) {
+            continue;
+        }
+        TRACE( TRACE_INFO, TRACE_MAP, "polyline %i has %i points", i, pl->num_points );
+        struct stream_item item;
+        item.x0 = item.x1 = pl->x + map->points[ pl->first_point ].x;
+        item.y0 = item.y1 = pl->y + map->points[ pl->first_point ].y;
+        for( int k = 1; k < (int)pl->num_points; k ++ ) {
+            struct level_point p = map->points[ pl->first_point + k ];
+            TRACE( TRACE_DEBUG, TRACE_MAP, "node %i %i", p.x, p.y );
+            item.x0 = std::min( item.x0, pl->x + p.x );
+            item.y0 = std::min( item.y0, pl->y + p.y );
+            item.x1 = std::max( item.x1, pl->x + p.x );
+            item.y1 = std::max( item.y1, pl->y + p.y );
+        }
+        item.polyline = i;
+        item.body = NULL;
+        item.seen = 0;
+        s->items.push_back( item );
+    }
+    // counting sort into the blocks, twice over the same ranges
+    s->line_starts.assign( s->across * s->down + 1, 0 );
+    for( int pass = 0; pass < 2; pass++ ) {
+        for( int i = s->across * s->down; i < (int)s->items.size(); i++ ) {
+            int c0, r0, c1, r1;
+            stream_blocks( s, s->items[ i ].x0, s->items[ i ].y0, s->items[ i ].x1, s->items[ i ].y1, 0, &c0, &r0, &c1, &r1 );
+            // anything off the map goes in the blocks along its edge
+            c0 = std::min( c0, s->across - 1 );
+            r0 = std::min( r0, s->down - 1 );
+            c1 = std::max( c1, 0 );
+            r1 = std::max( r1, 0 );
+            for( int brow = r0; brow <= r1; brow++ ) {
+                for( int bcol = c0; bcol <= c1; bcol++ ) {
+                    int b = brow * s->across + bcol;
+                    if( pass == 0 ) {
+                        s->line_starts[ b + 1 ]++;
                     } else {
-                        // we have to construct a tile ourselves!
-                        // TODO
+                        s->lines[ s->line_starts[ b ]++ ] = i;
                     }
-                    break;
-                } else {
-                    //Nuffin 'ere at all
                 }
             }
         }
-    }
-    for (int i = 0; i < map->GetNumObjectGroups(); i ++) {
-        printf_debug( "obj %i\n", i );
-        const Tmx::ObjectGroup *group = map->GetObjectGroup(i);
-        printf_debug( "num objs %i\n", group->GetNumObjects() );
-        for (int j = 0; j < group->GetNumObjects(); j ++) {
-            const Tmx::Object *ob = group->GetObject(j);
-            printf_debug( "type %s\n", (ob->GetType()).c_str() );
-            if( ob->GetType().compare("polyline") == 0 ) {
-                const Tmx::Polyline *pl = ob->GetPolyline();
-                int x = ob->GetX();
-                int y = ob->GetY();
-                b2Vec2 * vertices;
-                printf_debug( "polyline %i\n", ob->GetPolyline()->GetNumPoints() );
-                vertices = new b2Vec2 [ob->GetPolyline()->GetNumPoints()];
-                for( int k = 0; k < ob->GetPolyline()->GetNumPoints(); k ++ ) {
-                    Tmx::Point p = ob->GetPolyline()->GetPoint( k );
-                    vertices[ k ].Set( (float)(p.x)/SCALE, (float)(p.y)/SCALE );
-                    printf_debug( "node %f %f\b", (float)(p.x), (float)(p.y) );
-                }
-                b2ChainShape chain;// = new b2ChainShape();
-                chain.CreateChain( vertices, ob->GetPolyline()->GetNumPoints() );
-                            b2BodyDef groundBodyDef;
-                            groundBodyDef.position.Set( (float)x/SCALE, (float)y/SCALE );
-                            b2Body* groundBody = world->CreateBody(&groundBodyDef);
-                            groundBody->CreateFixture(&chain, 10.0f);
-                            solids.push_back( groundBody );
+        if( pass == 0 ) {
+            for( int b = 0; b < s->across * s->down; b++ ) {
+                s->line_starts[ b + 1 ] += s->line_starts[ b ];
+            }
+            s->lines.resize( s->line_starts[ s->across * s->down ] );
+        } else {
+            // line_starts[ b ] was used as the fill point, put it back
+            for( int b = s->across * s->down; b > 0; b-- ) {
+                s->line_starts[ b ] = s->line_starts[ b - 1 ];
             }
+            s->line_starts[ 0 ] = 0;
+        }
+    }
+}
 
+inline bool stream_near( const struct stream_item *item, int x0, int y0, int x1, int y1, int margin ) {
+    return item->x0 < x1 + margin && x0 - margin < item->x1 && item->y0 < y1 + margin && y0 - margin < item->y1;
+}
+
+// keep item i if it's within twice the margin of a region, bring it in if
+// it's within the margin, returns whether a body was made
+bool stream_touch( struct static_stream *s, int i, int x0, int y0, int x1, int y1 ) {
+    struct stream_item *item = &s->items[ i ];
+    if( !stream_near( item, x0, y0, x1, y1, 2 * STREAM_MARGIN ) ) {
+        return false;
+    }
+    item->seen = s->stamp;
+    if(
+        item->body != NULL || ( item->polyline < 0 && item->boxes.empty() ) ||
+        !stream_near( item, x0, y0, x1, y1, STREAM_MARGIN )
+    ) {
+        return false;
+    }
+    item->body = stream_create( item );
+    s->live.push_back( i );
+    return true;
+}
+
+// the blocks around a region and the polylines over them, returns how
+// many bodies were made. A polyline over several blocks is just found
+// again, touching it twice does nothing more
+int stream_mark( struct static_stream *s, int x0, int y0, int x1, int y1 ) {
+    int c0, r0, c1, r1;
+    stream_blocks( s, x0, y0, x1, y1, 2 * STREAM_MARGIN, &c0, &r0, &c1, &r1 );
+    int made = 0;
+    for( int brow = r0; brow <= r1; brow++ ) {
+        for( int bcol = c0; bcol <= c1; bcol++ ) {
+            int b = brow * s->across + bcol;
+            made += stream_touch( s, b, x0, y0, x1, y1 );
+            for( int k = s->line_starts[ b ]; k < s->line_starts[ b + 1 ]; k++ ) {
+                made += stream_touch( s, s->lines[ k ], x0, y0, x1, y1 );
+            }
         }
+    }
+    return made;
+}
 
+// bring in what's near the camera or near anything awake and moving, and
+// take out what's no longer near either. A body counts as a point, the
+// margin is far bigger than anything is. Sleeping bodies don't count, they
+// stay where they are with or without the ground under them until
+// something wakes them, and whatever does will have brought it back
+void stream_update( struct static_stream *s, SDL_Rect camera ) {
+    s->stamp++;
+    int made = stream_mark( s, camera.x, camera.y, camera.x + camera.w, camera.y + camera.h );
+    for( b2Body *b = world->GetBodyList(); b; b = b->GetNext() ) {
+        if( b->GetType() != b2_dynamicBody || !b->IsAwake() ) {
+            continue;
+        }
+        int x = to_screen( b->GetPosition().x );
+        int y = to_screen( b->GetPosition().y );
+        made += stream_mark( s, x, y, x, y );
+    }
+    int dropped = 0;
+    for( unsigned int k = 0; k < s->live.size(); ) {
+        if( s->items[ s->live[ k ] ].seen == s->stamp ) {
+            k++;
+            continue;
+        }
+        stream_drop( s, k );
+        dropped++;
     }
+    if( made || dropped ) {
+        TRACE( TRACE_DEBUG, TRACE_MAP, "streamed %i in, %i out, %i live", made, dropped, (int)s->live.size() );
+    }
+}
 
+int build_map() {
+    stream_init( &statics );
     return 1;
 }
 
+// ************* map edits ******************
+//
+// for breakable walls, doors and the like
+
+// wakes whatever it finds, so nothing sleeps on in mid air once the box
+// under it has gone
+class wake_callback : public b2QueryCallback {
+public:
+    bool ReportFixture( b2Fixture *fixture ) {
+        fixture->GetBody()->SetAwake( true );
+        return true;
+    }
+};
+
+// the main thread owns the level and everything drawn from it, the sim
+// owns solidity and the Box2D world, set_tile queues edits from one to
+// the other
+struct edit_queue tile_edits;
+// row * width + col, set since the last frame was drawn
+std::vector<int> edited_cells;
+
+// change one cell of a map layer and patch everything drawn from it, the
+// cover, the parallax holes and the baked chunk holding it, then queue the
+// cell's solidity for the sim. Main thread only, cache may be NULL
+// headless. Parallax layers, cells off the map and unknown gids are
+// refused
+bool set_tile( int layer, int col, int row, int gid, struct chunk_cache *cache = NULL ) {
+    if(
+        layer < 0 || layer >= map->num_layers || level_layer_is_parallax( map, layer ) ||
+        col < 0 || col >= map->width || row < 0 || row >= map->height ||
+        gid < 0 || gid >= map->num_gids
+    ) {
+        return false;
+    }
+    level_set_gid( map, layer, col, row, gid );
+    edits_push( &tile_edits, col, row, cell_is_solid( col, row ) );
+    if( !cell_cover.empty() ) {
+        int *cover = &cell_cover[ row * map->width + col ];
+        bool was_covered = *cover >= 0;
+        *cover = find_cover( col, row );
+        if( cache && !cache->behind->holes.empty() && was_covered != ( *cover >= 0 ) ) {
+            parallax_add_hole( cache->behind, col, row, was_covered ? 1 : -1 );
+        }
+    }
+    if( cache ) {
+        chunk_cache_patch( cache, col, row );
+    }
+    edited_cells.push_back( row * map->width + col );
+    TRACE( TRACE_DEBUG, TRACE_MAP, "layer %i cell %i,%i set to %i", layer, col, row, gid );
+    return true;
+}
+
+// the sim's half, before a tick, each touched block rebuilt once
+void apply_tile_edits( struct edit_queue *q ) {
+    std::vector<struct cell_edit> taken;
+    if( !edits_take( q, &taken ) ) {
+        return;
+    }
+    for( unsigned int i = 0; i < taken.size(); i++ ) {
+        set_solidity( taken[ i ].col, taken[ i ].row, taken[ i ].solid );
+    }
+    if( statics.items.empty() ) {
+        return;
+    }
+    std::vector<int> blocks;
+    for( unsigned int i = 0; i < taken.size(); i++ ) {
+        blocks.push_back( ( taken[ i ].row / SOLID_BLOCK ) * statics.across + taken[ i ].col / SOLID_BLOCK );
+    }
+    std::sort( blocks.begin(), blocks.end() );
+    blocks.erase( std::unique( blocks.begin(), blocks.end() ), blocks.end() );
+    for( unsigned int k = 0; k < blocks.size(); k++ ) {
+        int i = blocks[ k ];
+        struct stream_item *item = &statics.items[ i ];
+        merge_block( i % statics.across, i / statics.across, &item->boxes );
+        // out of the world it'll be made from the new boxes when it's next
+        // needed
+        if( item->body ) {
+            b2AABB block;
+            block.lowerBound.Set( to_world( item->x0 ), to_world( item->y0 ) );
+            block.upperBound.Set( to_world( item->x1 ), to_world( item->y1 ) );
+            wake_callback wake;
+            world->QueryAABB( &wake, block );
+            stream_drop( &statics, std::find( statics.live.begin(), statics.live.end(), i ) - statics.live.begin() );
+            if( !item->boxes.empty() ) {
+                item->body = stream_create( item );
+                statics.live.push_back( i );
+            }
+        }
+    }
+}
+
+#ifdef DEBUG
+// clicking takes out the topmost tile under the pointer, to try set_tile
+// with
+void debug_knock_out( int x, int y, struct chunk_cache *cache ) {
+    int col = x / map->tile_width;
+    int row = y / map->tile_height;
+    if( x < 0 || y < 0 || col >= map->width || row >= map->height ) {
+        return;
+    }
+    for( int i = map->num_layers - 1; i >= 0; i-- ) {
+        if( !level_layer_is_parallax( map, i ) && level_gid( map, i, col, row ) ) {
+            set_tile( i, col, row, 0, cache );
+            return;
+        }
+    }
+}
+#endif
+
 // ************* Sprite classes ******************8
 
+// the player's clips, ids indexed by Player::RUN_LEFT etc.
+const char *const PLAYER_ANIMS = "player_2.anim";
+const char *const PLAYER_CLIP_NAMES[ 4 ] = { "run_left", "run_right", "stand_left", "stand_right" };
+const struct anim_set *player_clips = NULL;
+int player_clip_ids[ 4 ];
+
+bool load_player_clips() {
+    player_clips = anim_get( PLAYER_ANIMS );
+    if( player_clips == NULL ) {
+        return false;
+    }
+    for( int i = 0; i < 4; i++ ) {
+        player_clip_ids[ i ] = anim_find( player_clips, PLAYER_CLIP_NAMES[ i ] );
+        if( player_clip_ids[ i ] < 0 ) {
+            return false;
+        }
+    }
+    return true;
+}
+
 class Sprite {
     public:
         float x;
@@ -399,19 +1361,17 @@ class Sprite {
         Sprite();
         virtual ~Sprite();
 
-        // animation
+        // animation, clips are shared, this is just where we are in one
         SDL_Surface *sprite_sheet;
-        int current_animation;
-        struct animation *animations;
-        int frame_count;
-        float last_frame_timer;
-        float frame_timer;
-
-
+        const struct anim_set *clips;
+        struct anim_state anim;
 };
 Sprite::Sprite() {
     x = 0.0;
     y = 0.0;
+    clips = NULL;
+    anim.clip = 0;
+    anim.time = 0.0;
 }
 Sprite::~Sprite() {
     //
@@ -477,6 +1437,7 @@ class Player: public Sprite {
         float dx();
         float dy();
 
+        struct contact_tag footTag;
         int numFootContacts;
         bool onFloor;
         float last_jump_impulse;
@@ -493,11 +1454,10 @@ int Player::getScreenY() {
 
 
 Player::Player() {
-    frame_count = 0;
-    last_frame_timer = 0.0;
-    frame_timer = 0.0;
     last_jump_impulse = 0.0;
 
+    footTag.type = CONTACT_FOOT;
+    footTag.owner = this;
     numFootContacts = 0;
     onFloor = false;
 
@@ -515,33 +1475,11 @@ Player::Player() {
     jump_powering = false;
     jump_start = 0;
     jump_power_time = 150; // ms
-    sprite_sheet = load_image( "player_2.png" );
-
-    animations = new animation[4];
-    short fr_w = 42;
-    short fr_h = 50;
-    const struct animation animation_template = {};
-    animations[RUN_RIGHT].frames = new struct sprite_frame[30];
-    animations[RUN_RIGHT].count = 30;
-    for( short f_c = 0; f_c < 30; f_c ++ ) {
-        animations[RUN_RIGHT].frames[ f_c ] = { { (int) (f_c * fr_w), 0, fr_w, fr_h }, 0.01 };
-    }
-    animations[RUN_LEFT].frames = new struct sprite_frame[30];
-    animations[RUN_LEFT].count = 30;
-    for( short f_c = 0; f_c < 30; f_c ++ ) {
-        animations[RUN_LEFT].frames[ f_c ] = { { (int) (f_c * fr_w), fr_h, fr_w, fr_h }, 0.01 };
-    }
-    animations[STAND_RIGHT].frames = new struct sprite_frame[30];
-    animations[STAND_RIGHT].count = 1;
-    for( short f_c = 0; f_c < 1; f_c ++ ) {
-        animations[STAND_RIGHT].frames[ f_c ] = { { (int) (f_c * fr_w), (int)(fr_h * 2), fr_w, fr_h }, 0.01 };
-    }
-    animations[STAND_LEFT].frames = new struct sprite_frame[30];
-    animations[STAND_LEFT].count = 1;
-    for( short f_c = 0; f_c < 1; f_c ++ ) {
-        animations[STAND_LEFT].frames[ f_c ] = { { (int) (f_c * fr_w), (int)(fr_h * 3), fr_w, fr_h }, 0.01 };
-    }
-    current_animation = RUN_LEFT;
+    sprite_sheet = asset_acquire( "player_2.png" );
+
+    clips = player_clips;
+    anim.clip = player_clip_ids[ RUN_LEFT ];
+    anim.time = 0.0;
     top_speed = runspeed;
 
     //
@@ -560,13 +1498,17 @@ Player::Player() {
     fixtureDef.density = 100.0f; //300kg/m3
     fixtureDef.friction = 0.5f;
     fixtureDef.restitution = 0.10f;
+    fixtureDef.filter.categoryBits = CONTACT_CAT_PLAYER;
 
     b2PolygonShape floorSensorShape;
     floorSensorShape.SetAsBox(2.0f/SCALE, 2.0f/SCALE, b2Vec2(-0.1f, (float)(fr_h+1)/SCALE/2.0f), 0.0f );
 
     b2FixtureDef floorSensorDef;
     floorSensorDef.isSensor = true;
-    floorSensorDef.userData = (void*)this;
+    floorSensorDef.userData = &footTag;
+    // only the ground can be underfoot
+    floorSensorDef.filter.categoryBits = CONTACT_CAT_SENSOR;
+    floorSensorDef.filter.maskBits = CONTACT_CAT_GROUND;
     floorSensorDef.shape = &floorSensorShape;
 
     floorSensor = body->CreateFixture(&floorSensorDef);
@@ -578,10 +1520,7 @@ void Player::setPosition( float x, float y ) {
 }
 
 Player::~Player() {
-    delete animations[RUN_LEFT].frames;
-    delete animations[RUN_RIGHT].frames;
-    delete animations;
-    SDL_FreeSurface( sprite_sheet );
+    asset_release( sprite_sheet );
 }
 // get pixel vel updown
 float Player::dy() {
@@ -591,28 +1530,40 @@ float Player::dy() {
 float Player::dx() {
     return body->GetLinearVelocity().x * SCALE;
 }
-void Player::animate( float tdelta ) {
-    if( dx() > 0.1 ) {
-        current_animation = RUN_RIGHT;
-    } else if( dx() < -0.1 ) {
-        current_animation = RUN_LEFT;
-    } else {
-        if( current_animation == RUN_LEFT ) {
-            current_animation = STAND_LEFT;
-        } else if( current_animation == RUN_RIGHT ) {
-            current_animation = STAND_RIGHT;
+// x to the 0.9, how fast the run clips play for x = speed / runspeed / 2,
+// from a table made once so animate needn't call powf every tick. Past
+// the end of the table it carries on in a straight line
+const int RUN_RATE_STEPS = 64;
+const float RUN_RATE_MAX = 2.0f;
+float run_rate( float x ) {
+    static float table[ RUN_RATE_STEPS + 2 ];
+    static bool made = false;
+    if( !made ) {
+        for( int i = 0; i < RUN_RATE_STEPS + 2; i++ ) {
+            table[ i ] = powf( i * RUN_RATE_MAX / RUN_RATE_STEPS, 0.9f );
         }
-        // else don't change it
+        made = true;
     }
-    frame_timer += ( ( pow( abs(dx()) / runspeed / 2, 0.9 ) ) * tdelta );
-    if( frame_timer >= last_frame_timer + animations[ current_animation ].frames[ frame_count ].duration ) {
-        frame_timer = 0.0;
-        last_frame_timer = 0.0;
-        frame_count += 1;
-        if( frame_count > animations[ current_animation ].count - 1 ) {
-            frame_count = 0;
-        }
+    float at = x * ( RUN_RATE_STEPS / RUN_RATE_MAX );
+    int i = std::min( (int)at, RUN_RATE_STEPS );
+    return table[ i ] + ( table[ i + 1 ] - table[ i ] ) * ( at - i );
+}
+
+void Player::animate( float tdelta ) {
+    float vx = dx();
+    int which;
+    if( vx > 0.1 ) {
+        which = RUN_RIGHT;
+    } else if( vx < -0.1 ) {
+        which = RUN_LEFT;
+    } else if( anim.clip == player_clip_ids[ RUN_LEFT ] || anim.clip == player_clip_ids[ STAND_LEFT ] ) {
+        which = STAND_LEFT;
+    } else {
+        which = STAND_RIGHT;
     }
+    anim_play( &anim, player_clip_ids[ which ] );
+    float rate = vx > 0.1 || vx < -0.1 ? run_rate( fabsf( vx ) / runspeed / 2 ) : 0.0;
+    anim_advance( clips, &anim, rate * tdelta );
 }
 void Player::updateKinematics( float tdelta ) {
     if( dx() < -1.0 * top_speed ) {
@@ -631,7 +1582,7 @@ void Player::walk() {
     top_speed = walkspeed;
 }
 SDL_Rect Player::getCurrentFrame() {
-    return animations[ current_animation ].frames[ frame_count ].rect;    
+    return anim_sample( clips, &anim )->rect;
 }
 // floor = last place you were standing
 //void Player::jump( int time, int floor_left, int floor_right ) {
@@ -639,12 +1590,12 @@ void Player::jump( int time, float dt ) {
     if( jump_powering == true ) {
         if( time >= jump_start + jump_power_time ) {
             // finish jump power phase
-            printf_debug( "jump done\n" );
+            TRACE( TRACE_INFO, TRACE_INPUT, "jump done" );
             jump_powering = false;
         } else {
             // keep powering
             //dy = jump_dy * ( 1.0 - (time - jump_start ) / jump_power_time );
-            printf_debug( "jump float\n" );
+            TRACE( TRACE_DEBUG, TRACE_INPUT, "jump float" );
             // applying impulses allows for a 'constant energy' appoach
             // sum of dt's should be <= jump_power_time
             body->ApplyLinearImpulse(
@@ -655,7 +1606,7 @@ void Player::jump( int time, float dt ) {
         }
     //} else if( ybottom() == floor_left || ybottom() == floor_right ) {
     } else if( onFloor ) {
-        printf_debug( "jump\n" );
+        TRACE( TRACE_INFO, TRACE_INPUT, "jump at %i", time );
         // start jump power phase
         //dy = jump_dy;
         //b2Vec2 vel = body->GetLinearVelocity();
@@ -689,62 +1640,242 @@ void Player::halt( float tdelta ) {
     body->ApplyLinearImpulse( b2Vec2( impulse, 0), body->GetWorldCenter(), true );
 }
 
-class PlayerContactListener : public b2ContactListener {
-public:
+void player_foot_contact( const struct contact_event *e ) {
+    Player *player = (Player *)e->tag->owner;
+    player->numFootContacts += e->begin ? 1 : -1;
+    player->onFloor = player->numFootContacts > 0;
+    TRACE( TRACE_DEBUG, TRACE_CONTACT, "%s contact, foot contacts %i", e->begin ? "begin" : "end", player->numFootContacts );
+}
+
+// ************* simulation ******************
+//
+// a tick only touches what's in here and the world, so it can run on a
+// thread of its own
+
+struct sim_state {
     Player *player;
-    PlayerContactListener( Player *_player ) {
-        player = _player;
-    }
-    void BeginContact(b2Contact* contact) {
-
-        printf_debug( "contact" );
-        //check if fixture A was the foot sensor
-        void* fixtureUserData = contact->GetFixtureA()->GetBody()->GetUserData();
-        if ( (Player *)fixtureUserData == player ) {
-            printf_debug( "A" );
-            player->numFootContacts++;
-        }
-        //check if fixture B was the foot sensor
-        fixtureUserData = contact->GetFixtureB()->GetBody()->GetUserData();
-        if ( (Player *)fixtureUserData == player ) {
-            printf_debug( "B" );
-            player->numFootContacts++;
-        }
-        printf_debug( " = %i\n", player->numFootContacts );
-        if ( player->numFootContacts > 0 ) {
-            player->onFloor = true;
-        } else {
-            player->onFloor = false;
-        }
+    int lc; // ticks so far
+    b2Vec2 prev_position; // player, last tick
+    struct profiler *prof; // tick phases are timed into this
+    struct phys_stats *phys; // Box2D's timings and the iterations to step with
+    struct replay *recording; // keys are saved here if set
+    struct edit_queue *edits; // map edits from the main thread
+    contact_router *contacts; // queued during the step, handled after
+};
 
+// everything drawing needs from one tick, copied out so the sim can get on
+// with the next
+struct sim_snapshot {
+    Uint64 time; // clock_us() when taken
+    b2Vec2 prev_position; // player
+    b2Vec2 position;
+    SDL_Rect frame;
+    bool on_floor;
+};
+
+void sim_tick( struct sim_state *sim, Uint8 *keystates ) {
+    Player &player = *sim->player;
+
+    apply_tile_edits( sim->edits );
+    sim->prev_position = player.body->GetPosition();
+    float tdelta = SIM_DT / SLOW_DOWN;
+    // jump timing is in ms of sim time
+    int sim_time = (int)( (Uint64)sim->lc * 1000 / SIM_RATE );
+
+    {
+        struct prof_timer t( sim->prof, PROF_PHYSICS );
+        // the camera follows the player, so it's known here without the
+        // drawing side
+        int px = to_screen( sim->prev_position.x ) - ( player.fr_w / 2 );
+        int py = to_screen( sim->prev_position.y ) - ( player.fr_h / 2 );
+        stream_update( &statics, calculate_viewport( px, py, map->width * map->tile_width, map->height * map->tile_height ) );
+        world->Step(tdelta, phys_velocity_iterations( sim->phys ), phys_position_iterations( sim->phys ));
+        phys_stats_step( sim->phys, world );
+        sim->contacts->dispatch();
     }
+    //printf_debug( "step" );
 
-    void EndContact(b2Contact* contact) {
-        printf_debug( "endcontact" );
-        //check if fixture A was the foot sensor
-        void* fixtureUserData = contact->GetFixtureA()->GetBody()->GetUserData();
-        if ( (Player *)fixtureUserData == player ) {
-            printf_debug( "A" );
-            player->numFootContacts--;
+    {
+        struct prof_timer t( sim->prof, PROF_INPUT );
+        if( sim->recording ) {
+            replay_record( sim->recording, keystates );
         }
-        //check if fixture B was the foot sensor
-        fixtureUserData = contact->GetFixtureB()->GetBody()->GetUserData();
-        if ( (Player *)fixtureUserData == player ) {
-            printf_debug( "B" );
-            player->numFootContacts--;
+        //if( keystates[ SDLK_LCTRL ] ) {
+        //    player.run();
+        //} else {
+        //    player.walk();
+        //}
+
+        //player.updateKinematics( tdelta );
+
+        if( keystates[ SDLK_UP ] ) {
+            player.jump( sim_time, tdelta );
         }
-        printf_debug( " = %i\n", player->numFootContacts );
-        if ( player->numFootContacts > 0 ) {
-            player->onFloor = true;
+
+        if( keystates[ SDLK_LEFT ] ) {
+            player.left( tdelta );
+        } else if( keystates[ SDLK_RIGHT ] ) {
+            player.right( tdelta );
         } else {
-            player->onFloor = false;
+            // supply a halting impule
+            player.halt( tdelta );
         }
     }
+
+    {
+        struct prof_timer t( sim->prof, PROF_ANIMATE );
+        player.animate( tdelta );
+    }
+    sim->lc++;
+}
+
+void sim_snapshot_take( const struct sim_state *sim, struct sim_snapshot *snap ) {
+    snap->time = clock_us();
+    snap->prev_position = sim->prev_position;
+    snap->position = sim->player->body->GetPosition();
+    snap->frame = sim->player->getCurrentFrame();
+    snap->on_floor = sim->player->onFloor;
+}
+
+struct sim_thread {
+    struct sim_state *sim;
+    struct profiler *report; // the main thread's
+    struct triple_buffer<struct sim_snapshot> out;
+    std::atomic<Uint8> keys; // replay_key_mask() of what's held
+    std::atomic<bool> running;
+    SDL_Thread *thread;
 };
 
+// ticks in real time, publishing a snapshot after each one
+int sim_thread_main( void *data ) {
+    struct sim_thread *st = (struct sim_thread *)data;
+    const Uint64 step = 1000000 / SIM_RATE;
+    Uint8 keystates[ SDLK_LAST ];
+    Uint64 next = clock_us();
+    while( st->running.load() ) {
+        Uint64 now = clock_us();
+        if( now < next ) {
+            SDL_Delay( 1 );
+            continue;
+        }
+        if( now - next > (Uint64)( MAX_FRAME_TIME * 1000000 ) ) {
+            // too far behind to catch up, drop it
+            next = now;
+        }
+        replay_unmask( st->keys.load(), keystates );
+        sim_tick( st->sim, keystates );
+        sim_snapshot_take( st->sim, triple_back( &st->out ) );
+        triple_publish( &st->out );
+        profile_send( st->report, st->sim->prof );
+        profile_end_frame( st->sim->prof );
+        next += step;
+    }
+    return 0;
+}
+
+// report gets the tick phases, for the HUD and CSV
+bool sim_thread_start( struct sim_thread *st, struct sim_state *sim, struct profiler *report ) {
+    st->sim = sim;
+    st->report = report;
+    triple_init( &st->out );
+    // whichever slot gets read first is already a whole frame
+    for( int i = 0; i < 3; i++ ) {
+        sim_snapshot_take( sim, &st->out.slots[ i ] );
+    }
+    st->keys.store( 0 );
+    st->running.store( true );
+    st->thread = SDL_CreateThread( sim_thread_main, st );
+    return st->thread != NULL;
+}
+
+void sim_thread_stop( struct sim_thread *st ) {
+    st->running.store( false );
+    SDL_WaitThread( st->thread, NULL );
+}
+
 // ***************** entry point *******************
 
+// the one way out once the trace has started, so it's flushed with
+// whatever went wrong in it
+int start_failed( int code ) {
+    trace_stop();
+    SDL_Quit();
+    return code;
+}
+
 int main( int argc, char **argv ) {
+    // --headless <file> runs the simulation only, fed by a recording
+    // --record <file> plays as normal and saves the keys held each tick
+    // --dirty only redraws and presents the parts of the screen that changed
+    // --trace <file> writes the binary trace log there, see tracedump
+    // --profile <file> writes per-frame phase timings there as CSV
+    // --threads runs the simulation on a thread of its own
+    // --physics <file> writes Box2D's per-step timings and counts there as CSV
+    // --physics-budget <ms> cuts solver iterations when a step takes longer,
+    //   not headless since it would make runs differ
+    // --physics-level <n> steps at a fixed iteration level, 0 (6 and 2) to 4
+    bool headless = false;
+    bool threaded = false;
+    bool recording = false;
+    bool dirty_mode = false;
+    const char *replay_file = NULL;
+    const char *profile_file = NULL;
+    const char *physics_file = NULL;
+    float physics_budget = 0.0f;
+    int physics_level = 0;
+#ifdef DEBUG
+    const char *trace_file = "ninjabox.trace";
+#else
+    const char *trace_file = NULL;
+#endif
+    for( int a = 1; a < argc; a++ ) {
+        if( strcmp( argv[ a ], "--headless" ) == 0 && a + 1 < argc ) {
+            headless = true;
+            replay_file = argv[ ++a ];
+        } else if( strcmp( argv[ a ], "--record" ) == 0 && a + 1 < argc ) {
+            recording = true;
+            replay_file = argv[ ++a ];
+        } else if( strcmp( argv[ a ], "--dirty" ) == 0 ) {
+            dirty_mode = true;
+        } else if( strcmp( argv[ a ], "--trace" ) == 0 && a + 1 < argc ) {
+            trace_file = argv[ ++a ];
+        } else if( strcmp( argv[ a ], "--profile" ) == 0 && a + 1 < argc ) {
+            profile_file = argv[ ++a ];
+        } else if( strcmp( argv[ a ], "--threads" ) == 0 ) {
+            threaded = true;
+        } else if( strcmp( argv[ a ], "--physics" ) == 0 && a + 1 < argc ) {
+            physics_file = argv[ ++a ];
+        } else if( strcmp( argv[ a ], "--physics-budget" ) == 0 && a + 1 < argc ) {
+            physics_budget = atof( argv[ ++a ] );
+        } else if( strcmp( argv[ a ], "--physics-level" ) == 0 && a + 1 < argc ) {
+            physics_level = atoi( argv[ ++a ] );
+        }
+    }
+    struct replay input;
+    if( headless && !replay_load( &input, replay_file ) ) {
+        fprintf( stderr, "can't read replay %s\n", replay_file );
+        return 4;
+    }
+
+    // headless runs report these per tick, F3 shows them on screen
+    struct profiler prof;
+    if( !profile_init( &prof, profile_file ) ) {
+        fprintf( stderr, "can't write profile %s\n", profile_file );
+        return 4;
+    }
+    struct phys_stats phys;
+    if( headless && physics_budget > 0.0f ) {
+        // the state hash has to come out the same every run
+        fprintf( stderr, "--physics-budget ignored headless, use --physics-level\n" );
+        physics_budget = 0.0f;
+    }
+    if( !phys_stats_init( &phys, physics_file, (Uint32)( std::max( physics_budget, 0.0f ) * 1000 ), physics_level ) ) {
+        fprintf( stderr, "can't write physics stats %s\n", physics_file );
+        return 4;
+    }
+    struct prof_hud hud;
+    bool show_hud = false;
+
     SDL_Surface *screen = NULL;
 
     b2Vec2 gravity(0.0f, GRAVITY);
@@ -752,7 +1883,8 @@ int main( int argc, char **argv ) {
 
     //The layers
     SDL_Surface *message = NULL;
-    SDL_Surface *background = NULL;
+    struct chunk_cache bg_cache;
+    struct parallax backdrop;
 
     SDL_Surface *msg = NULL;
     SDL_Event event;
@@ -771,131 +1903,314 @@ int main( int argc, char **argv ) {
     SDL_Color textColor = { 255, 255, 255 };
 
     //Start SDL
-    if( SDL_Init( SDL_INIT_EVERYTHING ) == -1 ) {
+    if( SDL_Init( headless ? SDL_INIT_TIMER : SDL_INIT_EVERYTHING ) == -1 ) {
         return 1;
     }
-    if( TTF_Init() == -1 ) {
-        return 3;
-    }
-    screen = SDL_SetVideoMode( SCREEN_WIDTH, SCREEN_HEIGHT, SCREEN_BPP, SCREEN_FLAGS );
-    if( screen == NULL ) {
-        return 2;
+    if( trace_file && !trace_start( trace_file ) ) {
+        fprintf( stderr, "can't write trace %s\n", trace_file );
     }
-    SDL_WM_SetCaption( "Hello World", NULL );
+    if( !headless ) {
+        if( TTF_Init() == -1 ) {
+            TRACE( TRACE_ERROR, TRACE_GENERAL, "TTF_Init failed" );
+            return start_failed( 3 );
+        }
+        // update rects need a single buffered software screen
+        screen = SDL_SetVideoMode( SCREEN_WIDTH, SCREEN_HEIGHT, SCREEN_BPP, dirty_mode ? SDL_SWSURFACE : SCREEN_FLAGS );
+        if( screen == NULL ) {
+            TRACE( TRACE_ERROR, TRACE_RENDER, "SDL_SetVideoMode failed" );
+            return start_failed( 2 );
+        }
+        SDL_WM_SetCaption( "Hello World", NULL );
 
-    font = TTF_OpenFont( "dejavu/DejaVuSans-Bold.ttf", 16 );
+        font = TTF_OpenFont( "dejavu/DejaVuSans-Bold.ttf", 16 );
 
-    background = init_background( map );
-    render_map( 0, 0, background );
-    debug_render_map( 0, 0, background );
+        load_tilesets();
+        parallax_init( &backdrop );
+        chunk_cache_init( &bg_cache, &backdrop );
+        profile_hud_init( &hud, 10, 10 );
+        debug_render_map( 0, 0, screen );
+    }
     build_map();
 
     float dynamic_friction = 12.00; // 1/s
     float static_friction = 12.0; // p/s^2
 
-    // distances are pixels
-    int lc = 0;
-    float tdelta = 0;
-
+    if( !load_player_clips() ) {
+        fprintf( stderr, "can't read animations %s\n", PLAYER_ANIMS );
+        TRACE( TRACE_ERROR, TRACE_GENERAL, "can't read animations" );
+        return start_failed( 4 );
+    }
     Player player = Player();
     player.setPosition( 300.0, 200.0 );
 
-    PlayerContactListener *clistener = new PlayerContactListener( &player );
-    world->SetContactListener( clistener );
+    contact_router router;
+    router.handlers[ CONTACT_FOOT ] = player_foot_contact;
+    world->SetContactListener( &router );
+
+    edits_init( &tile_edits );
 
     // init last_time or it goes mental
-    last_time = SDL_GetTicks();
+    last_time = headless ? 0 : SDL_GetTicks();
+    Uint64 run_start = clock_us();
+
+    // fixed step physics, frames consume whole ticks from the accumulator
+    // and draw the remainder by interpolating between the last two ticks
+    float accumulator = 0.0f;
+    float frame_time = SIM_DT;
+    int frames = 0;
+    struct sim_state sim = { &player, 0, player.body->GetPosition(), &prof, &phys, recording ? &input : NULL, &tile_edits, &router };
+    struct sim_snapshot snap;
+
+    // --threads ticks on its own thread at its own pace, with its own
+    // profiler since they aren't shared, which sends its phases to prof
+    struct profiler sim_prof;
+    struct sim_thread worker;
+    if( threaded && !headless ) {
+        profile_init( &sim_prof, NULL );
+        sim.prof = &sim_prof;
+        threaded = sim_thread_start( &worker, &sim, &prof );
+    } else {
+        threaded = false;
+    }
 
-    int32 velocityIterations = 6;
-    int32 positionIterations = 2;
+    // what's on screen now, so we can tell what changed
+    struct dirty_rects damage;
+    bool redraw_all = true;
+    SDL_Rect last_vp = { 0, 0, 0, 0 };
+    SDL_Rect last_sprite = { 0, 0, 0, 0 };
+    SDL_Rect last_frame = { 0, 0, 0, 0 };
+    std::string hud_text;
+    SDL_Rect hud_rect = { 400, 400, 0, 0 };
 
     while( !quit ) {
 
         formatter.str( "" );
 
-        time = SDL_GetTicks();
-        tdelta = (float)((time - last_time)/1000.0) / SLOW_DOWN;
-        last_time = time;
+        // headless runs exactly one tick per pass so every run is identical
+        if( headless ) {
+            accumulator += SIM_DT;
+        } else {
+            time = SDL_GetTicks();
+            frame_time = (float)((time - last_time)/1000.0);
+            last_time = time;
+            if( !threaded ) {
+                accumulator += std::min( frame_time, MAX_FRAME_TIME );
+            }
+        }
 
-        world->Step(tdelta, velocityIterations, positionIterations);
-        //printf_debug( "step" );
-        b2Vec2 position = player.body->GetPosition();
-        float32 angle = player.body->GetAngle();
-        //printf_debug("%4.2f %4.2f %4.2f\n", position.x, position.y, angle);
-        //printf_debug("%i %i\n", to_screen(position.x), to_screen(position.y));
-        
-        if( SDL_PollEvent( &event ) ) {
-            if( event.type == SDL_KEYDOWN ) {
-                switch( event.key.keysym.sym ) {
-                    case SDLK_ESCAPE:
-                        quit = true;
-                        break;
+        if( !headless ) {
+            struct prof_timer t( &prof, PROF_EVENTS );
+            if( SDL_PollEvent( &event ) ) {
+                if( event.type == SDL_KEYDOWN ) {
+                    switch( event.key.keysym.sym ) {
+                        case SDLK_ESCAPE:
+                            quit = true;
+                            break;
+                        case SDLK_F3:
+                            show_hud = !show_hud;
+                            redraw_all = true;
+                            break;
+                    }
                 }
-            }
-            
-            if( event.type == SDL_QUIT ) {
-                quit = true;
+
+                if( event.type == SDL_QUIT ) {
+                    quit = true;
+                }
+                if( event.type == SDL_VIDEOEXPOSE ) {
+                    redraw_all = true;
+                }
+#ifdef DEBUG
+                if( event.type == SDL_MOUSEBUTTONDOWN ) {
+                    debug_knock_out( last_vp.x + event.button.x, last_vp.y + event.button.y, &bg_cache );
+                }
+#endif
             }
         }
-        Uint8 *keystates = SDL_GetKeyState( NULL );
-        //if( keystates[ SDLK_LCTRL ] ) {
-        //    player.run();
-        //} else {
-        //    player.walk();
-        //}
 
-        //player.updateKinematics( tdelta );
+        const struct sim_snapshot *shown = &snap;
+        float alpha;
+        if( threaded ) {
+            // hand the keys over and draw the newest tick it's finished
+            worker.keys.store( replay_key_mask( SDL_GetKeyState( NULL ) ) );
+            triple_update( &worker.out );
+            shown = triple_front( &worker.out );
+            alpha = std::min( 1.0f, ( clock_us() - shown->time ) / 1000000.0f / SIM_DT );
+        } else {
+            while( accumulator >= SIM_DT && !quit ) {
+                accumulator -= SIM_DT;
+                Uint8 *keystates;
+                {
+                    struct prof_timer t( &prof, PROF_INPUT );
+                    keystates = headless ? replay_next( &input ) : SDL_GetKeyState( NULL );
+                }
+                if( keystates == NULL ) {
+                    // out of recorded input
+                    quit = true;
+                    break;
+                }
+                sim_tick( &sim, keystates );
+            }
 
-        if( keystates[ SDLK_UP ] ) {
-            player.jump( time, tdelta );
+            if( headless ) {
+                profile_end_frame( &prof );
+                continue;
+            }
+            sim_snapshot_take( &sim, &snap );
+            alpha = accumulator / SIM_DT;
         }
-        if( player.onFloor ) {
-            //printf_debug( "On floor \n" );
+        if( shown->on_floor ) {
             formatter.str( "On floor" );
         }
-        
-        if( keystates[ SDLK_LEFT ] ) {
-            player.left( tdelta );
-        } else if( keystates[ SDLK_RIGHT ] ) {
-            player.right( tdelta );
-        } else {
-            // supply a halting impule
-            player.halt( tdelta );
-        }
-        //if( keystates[ SDLK_UP ] ) {
-        //    //player.right( tdelta );
-        //    b2Vec2 push( 0.0f, -1000.0f );
-        //    player.body->ApplyForce( push, position );
-        //}
 
-        player.animate( tdelta );
-
-        SDL_Rect vp = calculate_viewport( player.getScreenX(), player.getScreenY(), map->GetWidth() * map->GetTileWidth(), map->GetHeight() * map->GetTileHeight() );
-
-        clear_surface( screen, 0xffffffff );
-        apply_surface( 0-vp.x, 0-vp.y, background, screen );
-
-        SDL_Rect player_rect = player.getCurrentFrame();
-
-        apply_sprite( player.getScreenX() - vp.x, player.getScreenY() -  vp.y, player.sprite_sheet, &player_rect, screen );
+        // where to draw, between the previous and current tick
+        b2Vec2 prev_position = shown->prev_position;
+        b2Vec2 position = shown->position;
+        int draw_x = to_screen( prev_position.x + ( position.x - prev_position.x ) * alpha ) - ( player.fr_w / 2 );
+        int draw_y = to_screen( prev_position.y + ( position.y - prev_position.y ) * alpha ) - ( player.fr_h / 2 );
+
+        SDL_Rect vp = calculate_viewport( draw_x, draw_y, map->width * map->tile_width, map->height * map->tile_height );
+
+        SDL_Rect player_rect = shown->frame;
+        SDL_Rect sprite_rect = { (Sint16)( draw_x - vp.x ), (Sint16)( draw_y - vp.y ), player_rect.w, player_rect.h };
+
+        // work out what needs drawing, scrolling moves every pixel
+        dirty_reset( &damage, screen->w, screen->h );
+        if( !dirty_mode || redraw_all || vp.x != last_vp.x || vp.y != last_vp.y ) {
+            dirty_all( &damage );
+        } else if(
+            sprite_rect.x != last_sprite.x || sprite_rect.y != last_sprite.y ||
+            player_rect.x != last_frame.x || player_rect.y != last_frame.y
+        ) {
+            dirty_add( &damage, &last_sprite );
+            dirty_add( &damage, &sprite_rect );
+        }
+        if( show_hud && frames % FPSFPS == 0 ) {
+            struct prof_timer t( &prof, PROF_TEXT );
+            dirty_add( &damage, &hud.rect );
+            profile_hud_update( &hud, &prof, 1.0f / frame_time, font, textColor );
+            dirty_add( &damage, &hud.rect );
+        }
+        // only re-render the text when it changes
+        if( formatter.str() != hud_text ) {
+            struct prof_timer t( &prof, PROF_TEXT );
+            dirty_add( &damage, &hud_rect );
+            if( msg ) {
+                SDL_FreeSurface( msg );
+                msg = NULL;
+            }
+            hud_text = formatter.str();
+            hud_rect.w = hud_rect.h = 0;
+            if( !hud_text.empty() ) {
+                msg = TTF_RenderText_Blended( font, hud_text.c_str(), textColor );
+            }
+            if( msg ) {
+                hud_rect.w = msg->w;
+                hud_rect.h = msg->h;
+            }
+            dirty_add( &damage, &hud_rect );
+        }
+        // cells set_tile changed, wherever they are on screen now
+        for( unsigned int i = 0; i < edited_cells.size(); i++ ) {
+            int col = edited_cells[ i ] % map->width;
+            int row = edited_cells[ i ] / map->width;
+            dirty_add( &damage, col * map->tile_width - vp.x, row * map->tile_height - vp.y, map->tile_width, map->tile_height );
+        }
+        edited_cells.clear();
+        redraw_all = false;
+        last_vp = vp;
+        last_sprite = sprite_rect;
+        last_frame = player_rect;
+
+        {
+            struct prof_timer t( &prof, PROF_BACKGROUND );
+            prepare_background( &bg_cache, vp );
+        }
+        // one pass per damaged rect, clipped to it
+        for( int pass = 0; pass < dirty_passes( &damage ); pass++ ) {
+            SDL_SetClipRect( screen, dirty_clip( &damage, pass ) );
+            {
+                struct prof_timer t( &prof, PROF_BACKGROUND );
+                clear_surface( screen, 0xffffffff );
+                draw_parallax( &backdrop, vp, screen );
+                draw_background( &bg_cache, LEVEL_BEHIND, vp, screen );
+            }
+            {
+                struct prof_timer t( &prof, PROF_SPRITE );
+                apply_sprite( sprite_rect.x, sprite_rect.y, player.sprite_sheet, &player_rect, screen );
+            }
+            {
+                struct prof_timer t( &prof, PROF_BACKGROUND );
+                draw_background( &bg_cache, LEVEL_FRONT, vp, screen );
+            }
+            {
+                struct prof_timer t( &prof, PROF_TEXT );
+                if( msg ) {
+                    apply_surface( hud_rect.x, hud_rect.y, msg, screen );
+                }
+                if( show_hud ) {
+                    profile_hud_draw( &hud, screen );
+                }
+            }
+        }
+        SDL_SetClipRect( screen, NULL );
 
         // use up remaining ticks before frame is done
-        if( tdelta < (1.0/(float)FPS_CAP) ) {
-            SDL_Delay( (int)( ( 1/(float)FPS_CAP - tdelta ) * 1000 ) );
+        {
+            struct prof_timer t( &prof, PROF_DELAY );
+            // one read of the clock, or it can pass the deadline between
+            // the test and the delay and wrap
+            int remaining = 1000 / FPS_CAP - (int)( SDL_GetTicks() - time );
+            if( remaining > 0 ) {
+                SDL_Delay( remaining );
+            }
         }
-        //SDL_Delay( (int) ( 3 * pow( SLOW_DOWN, 2 ) ) ); // recommend to smooth things out
-        msg = TTF_RenderText_Blended( font, formatter.str().c_str(), textColor );
-        apply_surface( 400, 400, msg, screen );
 
-        SDL_Flip( screen );
-        if( lc++ % FPSFPS == 0 ) {
-            float fps = 1.0f / (float) tdelta;
-            //printf_debug( "FPS: %.4f\n", fps );
-            //formatter << "FPS: " << fps;
+        {
+            struct prof_timer t( &prof, PROF_FLIP );
+            if( dirty_mode ) {
+                dirty_present( &damage, screen );
+            } else {
+                SDL_Flip( screen );
+            }
         }
+        profile_end_frame( &prof );
+        frames++;
+    }
+    if( threaded ) {
+        sim_thread_stop( &worker );
+        profile_close( &sim_prof );
+    }
+    if( recording ) {
+        replay_save( &input, replay_file );
+    }
+    if( headless ) {
+        Uint64 run_us = clock_us() - run_start;
+        b2Vec2 position = player.body->GetPosition();
+        b2Vec2 velocity = player.body->GetLinearVelocity();
+        Uint32 hash = STATE_HASH_INIT;
+        hash = state_hash( hash, &position, sizeof( position ) );
+        hash = state_hash( hash, &velocity, sizeof( velocity ) );
+        hash = state_hash( hash, &player.anim, sizeof( player.anim ) );
+        printf( "ticks: %i\n", sim.lc );
+        printf( "ticks/s: %.1f\n", sim.lc * 1000000.0 / std::max( run_us, (Uint64)1 ) );
+        for( int p = PROF_INPUT; p <= PROF_ANIMATE; p++ ) {
+            printf( "%s: %.3f us/tick\n", PROF_PHASE_NAMES[ p ], (float)prof.total[ p ] / std::max( sim.lc, 1 ) );
+        }
+        phys_stats_report( &phys, stdout );
+        printf( "state: %08x\n", hash );
+    }
+    if( !headless ) {
+        chunk_cache_free( &bg_cache );
+        parallax_free( &backdrop );
+        free_tilesets();
+        profile_hud_free( &hud );
     }
-    SDL_FreeSurface( background );
+    edits_free( &tile_edits );
+    profile_close( &prof );
+    phys_stats_close( &phys );
+    trace_stop();
     SDL_Quit();
+    level_close( map );
     delete map;
     return 0;
 }
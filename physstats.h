@@ -0,0 +1,190 @@
+#ifndef PHYSSTATS_H
+#define PHYSSTATS_H
+
+// Box2D's own timings for each step, and an optional iteration budget.
+//
+//   world->Step( dt, phys_velocity_iterations( &stats ), phys_position_iterations( &stats ) );
+//   phys_stats_step( &stats, world );
+//
+// Box2D fills in a b2Profile on every step. The step, collide, solve,
+// broadphase and TOI times from it go into a rolling window like
+// profile.h's phases, alongside the body, contact and proxy counts. If a
+// CSV file was given they also go out as one row per step.
+//
+// With a budget the solver iterations drop a level whenever a step takes
+// longer than the budget. They go back up once steps have stayed under
+// half of it for PHYS_RAISE_STEPS in a row. Under load that trades
+// softer contacts for a frame that physics can't eat. Without a budget
+// they stay at a fixed level, by default the top one, the 6 and 2 Box2D
+// recommends.
+//
+// The budget goes by wall clock time, so a budgeted run can't be replayed
+// exactly; headless runs fix the level instead.
+
+#include <Box2D/Box2D.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#include "profile.h"
+#include "trace.h"
+
+enum { PHYS_STEP, PHYS_COLLIDE, PHYS_SOLVE, PHYS_BROADPHASE, PHYS_TOI, PHYS_NUM_TIMES };
+const char *const PHYS_TIME_NAMES[ PHYS_NUM_TIMES ] = { "step", "collide", "solve", "broadphase", "toi" };
+
+enum { PHYS_BODIES, PHYS_CONTACTS, PHYS_PROXIES, PHYS_NUM_COUNTS };
+const char *const PHYS_COUNT_NAMES[ PHYS_NUM_COUNTS ] = { "bodies", "contacts", "proxies" };
+
+// velocity and position iterations, best first
+const int PHYS_NUM_LEVELS = 5;
+const int PHYS_ITERATIONS[ PHYS_NUM_LEVELS ][ 2 ] = { { 6, 2 }, { 5, 2 }, { 4, 2 }, { 3, 1 }, { 2, 1 } };
+const int PHYS_RAISE_STEPS = 60; // a second of ticks
+
+struct phys_stats {
+    Uint32 history[ PHYS_NUM_TIMES ][ PROF_WINDOW ]; // us per step, ring
+    Uint64 total[ PHYS_NUM_TIMES ]; // us over the whole run
+    int counts[ PHYS_NUM_COUNTS ]; // at the last step
+    int peak[ PHYS_NUM_COUNTS ];
+    int steps; // recorded so far
+    Uint32 budget; // us per step, 0 for none
+    int level; // into PHYS_ITERATIONS
+    int calm; // steps in a row under half the budget
+    int level_steps[ PHYS_NUM_LEVELS ]; // steps taken at each level
+    FILE *csv;
+};
+
+// level is where the iterations start and, without a budget, stay
+inline bool phys_stats_init( struct phys_stats *s, const char *csv_file, Uint32 budget_us, int level ) {
+    memset( s, 0, sizeof( *s ) );
+    s->budget = budget_us;
+    s->level = std::max( 0, std::min( level, PHYS_NUM_LEVELS - 1 ) );
+    if( csv_file == NULL ) {
+        return true;
+    }
+    s->csv = fopen( csv_file, "w" );
+    if( s->csv == NULL ) {
+        return false;
+    }
+    fprintf( s->csv, "step" );
+    for( int i = 0; i < PHYS_NUM_TIMES; i++ ) {
+        fprintf( s->csv, ",%s", PHYS_TIME_NAMES[ i ] );
+    }
+    for( int i = 0; i < PHYS_NUM_COUNTS; i++ ) {
+        fprintf( s->csv, ",%s", PHYS_COUNT_NAMES[ i ] );
+    }
+    fprintf( s->csv, ",velocity iterations,position iterations\n" );
+    return true;
+}
+
+inline void phys_stats_close( struct phys_stats *s ) {
+    if( s->csv ) {
+        fclose( s->csv );
+        s->csv = NULL;
+    }
+}
+
+inline int phys_velocity_iterations( const struct phys_stats *s ) {
+    return PHYS_ITERATIONS[ s->level ][ 0 ];
+}
+
+inline int phys_position_iterations( const struct phys_stats *s ) {
+    return PHYS_ITERATIONS[ s->level ][ 1 ];
+}
+
+// file away the step the world just took and pick the iterations for the
+// next one
+inline void phys_stats_step( struct phys_stats *s, b2World *world ) {
+    const b2Profile &p = world->GetProfile();
+    // b2Profile is in ms
+    float ms[ PHYS_NUM_TIMES ] = { p.step, p.collide, p.solve, p.broadphase, p.solveTOI };
+    int slot = s->steps % PROF_WINDOW;
+    for( int i = 0; i < PHYS_NUM_TIMES; i++ ) {
+        Uint32 us = (Uint32)( std::max( ms[ i ], 0.0f ) * 1000.0f );
+        s->history[ i ][ slot ] = us;
+        s->total[ i ] += us;
+    }
+    s->counts[ PHYS_BODIES ] = world->GetBodyCount();
+    s->counts[ PHYS_CONTACTS ] = world->GetContactCount();
+    s->counts[ PHYS_PROXIES ] = world->GetProxyCount();
+    for( int i = 0; i < PHYS_NUM_COUNTS; i++ ) {
+        s->peak[ i ] = std::max( s->peak[ i ], s->counts[ i ] );
+    }
+    if( s->csv ) {
+        fprintf( s->csv, "%i", s->steps );
+        for( int i = 0; i < PHYS_NUM_TIMES; i++ ) {
+            fprintf( s->csv, ",%u", s->history[ i ][ slot ] );
+        }
+        for( int i = 0; i < PHYS_NUM_COUNTS; i++ ) {
+            fprintf( s->csv, ",%i", s->counts[ i ] );
+        }
+        fprintf( s->csv, ",%i,%i\n", phys_velocity_iterations( s ), phys_position_iterations( s ) );
+    }
+    s->level_steps[ s->level ]++;
+    s->steps++;
+    if( s->budget == 0 ) {
+        return;
+    }
+    Uint32 took = s->history[ PHYS_STEP ][ slot ];
+    if( took > s->budget ) {
+        s->calm = 0;
+        if( s->level < PHYS_NUM_LEVELS - 1 ) {
+            s->level++;
+            TRACE( TRACE_INFO, TRACE_PHYSICS, "step took %u us, iterations down to %i %i", took, phys_velocity_iterations( s ), phys_position_iterations( s ) );
+        }
+    } else if( took * 2 <= s->budget && ++s->calm >= PHYS_RAISE_STEPS ) {
+        s->calm = 0;
+        if( s->level > 0 ) {
+            s->level--;
+            TRACE( TRACE_INFO, TRACE_PHYSICS, "iterations back up to %i %i", phys_velocity_iterations( s ), phys_position_iterations( s ) );
+        }
+    } else if( took * 2 > s->budget ) {
+        s->calm = 0;
+    }
+}
+
+inline struct prof_stats phys_stats_get( const struct phys_stats *s, int time ) {
+    struct prof_stats r = { 0, 0, 0 };
+    int n = std::min( s->steps, PROF_WINDOW );
+    if( n == 0 ) {
+        return r;
+    }
+    Uint32 sorted[ PROF_WINDOW ];
+    std::copy( s->history[ time ], s->history[ time ] + n, sorted );
+    std::sort( sorted, sorted + n );
+    Uint64 sum = 0;
+    for( int i = 0; i < n; i++ ) {
+        sum += sorted[ i ];
+    }
+    r.min = sorted[ 0 ];
+    r.avg = sum / n;
+    r.p99 = sorted[ ( n * 99 + 99 ) / 100 - 1 ];
+    return r;
+}
+
+// where the physics time went over the run, and how often the budget had
+// to cut the iterations
+inline void phys_stats_report( const struct phys_stats *s, FILE *out ) {
+    int n = std::max( s->steps, 1 );
+    for( int i = 0; i < PHYS_NUM_TIMES; i++ ) {
+        struct prof_stats last = phys_stats_get( s, i );
+        fprintf(
+            out, "box2d %s: %.3f us/step, last %i steps p99 %u us\n",
+            PHYS_TIME_NAMES[ i ], (float)s->total[ i ] / n, std::min( s->steps, PROF_WINDOW ), last.p99
+        );
+    }
+    for( int i = 0; i < PHYS_NUM_COUNTS; i++ ) {
+        fprintf( out, "box2d %s: %i, peak %i\n", PHYS_COUNT_NAMES[ i ], s->counts[ i ], s->peak[ i ] );
+    }
+    if( s->budget == 0 ) {
+        fprintf( out, "box2d iterations %i %i\n", phys_velocity_iterations( s ), phys_position_iterations( s ) );
+    } else {
+        for( int l = 0; l < PHYS_NUM_LEVELS; l++ ) {
+            fprintf(
+                out, "box2d iterations %i %i: %i steps\n",
+                PHYS_ITERATIONS[ l ][ 0 ], PHYS_ITERATIONS[ l ][ 1 ], s->level_steps[ l ]
+            );
+        }
+    }
+}
+
+#endif
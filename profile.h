@@ -0,0 +1,214 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+// Per-phase frame timings.
+//
+// Wrap each part of the frame in a scoped timer:
+//
+//   {
+//       struct prof_timer t( &prof, PROF_FLIP );
+//       SDL_Flip( screen );
+//   }
+//
+// A phase can be timed several times a frame (once per tick, once per
+// dirty rect) and the times add up. profile_end_frame() files the frame
+// away in a rolling window for the min/avg/p99 HUD and, if a CSV file was
+// given, writes it out as one row.
+//
+// A thread with a profiler of its own hands its phases over with
+// profile_send() at the end of each of its frames. They're added into the
+// receiver's next frame, so its HUD and CSV cover both threads.
+
+#include <SDL/SDL.h>
+#include <SDL/SDL_ttf.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+
+enum {
+    PROF_EVENTS, PROF_INPUT, PROF_PHYSICS, PROF_ANIMATE,
+    PROF_BACKGROUND, PROF_SPRITE, PROF_TEXT, PROF_FLIP, PROF_DELAY,
+    PROF_NUM_PHASES
+};
+const char *const PROF_PHASE_NAMES[ PROF_NUM_PHASES ] = {
+    "events", "input", "physics", "animate",
+    "background", "sprite", "text", "flip", "delay"
+};
+
+const int PROF_WINDOW = 240; // frames the HUD stats are taken over
+
+// wall clock in microseconds, SDL_GetTicks is too coarse to time a phase
+inline Uint64 clock_us() {
+    struct timeval tv;
+    gettimeofday( &tv, NULL );
+    return (Uint64)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+struct profiler {
+    Uint32 current[ PROF_NUM_PHASES ]; // us so far this frame
+    Uint32 history[ PROF_NUM_PHASES ][ PROF_WINDOW ]; // us per frame, ring
+    Uint64 total[ PROF_NUM_PHASES ]; // us over the whole run
+    int frames; // frames ended so far
+    FILE *csv;
+    std::atomic<Uint32> sent[ PROF_NUM_PHASES ]; // us from other threads, not yet in a frame
+};
+
+struct prof_stats {
+    Uint32 min;
+    Uint32 avg;
+    Uint32 p99;
+};
+
+inline bool profile_init( struct profiler *p, const char *csv_file ) {
+    memset( p->current, 0, sizeof( p->current ) );
+    memset( p->history, 0, sizeof( p->history ) );
+    memset( p->total, 0, sizeof( p->total ) );
+    p->frames = 0;
+    p->csv = NULL;
+    for( int i = 0; i < PROF_NUM_PHASES; i++ ) {
+        p->sent[ i ].store( 0 );
+    }
+    if( csv_file == NULL ) {
+        return true;
+    }
+    p->csv = fopen( csv_file, "w" );
+    if( p->csv == NULL ) {
+        return false;
+    }
+    fprintf( p->csv, "frame" );
+    for( int i = 0; i < PROF_NUM_PHASES; i++ ) {
+        fprintf( p->csv, ",%s", PROF_PHASE_NAMES[ i ] );
+    }
+    fprintf( p->csv, ",total\n" );
+    return true;
+}
+
+inline void profile_close( struct profiler *p ) {
+    if( p->csv ) {
+        fclose( p->csv );
+        p->csv = NULL;
+    }
+}
+
+inline void profile_add( struct profiler *p, int phase, Uint64 us ) {
+    p->current[ phase ] += us;
+}
+
+struct prof_timer {
+    struct profiler *p;
+    int phase;
+    Uint64 start;
+
+    prof_timer( struct profiler *p, int phase ) : p( p ), phase( phase ), start( clock_us() ) {
+    }
+    ~prof_timer() {
+        profile_add( p, phase, clock_us() - start );
+    }
+};
+
+inline void profile_end_frame( struct profiler *p ) {
+    int slot = p->frames % PROF_WINDOW;
+    Uint32 frame_us = 0;
+    for( int i = 0; i < PROF_NUM_PHASES; i++ ) {
+        p->current[ i ] += p->sent[ i ].exchange( 0 );
+        p->history[ i ][ slot ] = p->current[ i ];
+        p->total[ i ] += p->current[ i ];
+        frame_us += p->current[ i ];
+    }
+    if( p->csv ) {
+        fprintf( p->csv, "%i", p->frames );
+        for( int i = 0; i < PROF_NUM_PHASES; i++ ) {
+            fprintf( p->csv, ",%u", p->current[ i ] );
+        }
+        fprintf( p->csv, ",%u\n", frame_us );
+    }
+    memset( p->current, 0, sizeof( p->current ) );
+    p->frames++;
+}
+
+// from another thread, the frame it's just finished, before ending it
+inline void profile_send( struct profiler *to, const struct profiler *from ) {
+    for( int i = 0; i < PROF_NUM_PHASES; i++ ) {
+        if( from->current[ i ] ) {
+            to->sent[ i ].fetch_add( from->current[ i ] );
+        }
+    }
+}
+
+inline struct prof_stats profile_stats( const struct profiler *p, int phase ) {
+    struct prof_stats s = { 0, 0, 0 };
+    int n = std::min( p->frames, PROF_WINDOW );
+    if( n == 0 ) {
+        return s;
+    }
+    Uint32 sorted[ PROF_WINDOW ];
+    std::copy( p->history[ phase ], p->history[ phase ] + n, sorted );
+    std::sort( sorted, sorted + n );
+    Uint64 sum = 0;
+    for( int i = 0; i < n; i++ ) {
+        sum += sorted[ i ];
+    }
+    s.min = sorted[ 0 ];
+    s.avg = sum / n;
+    s.p99 = sorted[ ( n * 99 + 99 ) / 100 - 1 ];
+    return s;
+}
+
+// one rendered line per phase plus a header, TTF can't do multi-line
+struct prof_hud {
+    SDL_Surface *lines[ PROF_NUM_PHASES + 1 ];
+    SDL_Rect rect; // area covered on screen, for dirty rects
+};
+
+inline void profile_hud_init( struct prof_hud *hud, int x, int y ) {
+    memset( hud, 0, sizeof( *hud ) );
+    hud->rect.x = x;
+    hud->rect.y = y;
+}
+
+inline void profile_hud_free( struct prof_hud *hud ) {
+    for( int i = 0; i <= PROF_NUM_PHASES; i++ ) {
+        if( hud->lines[ i ] ) {
+            SDL_FreeSurface( hud->lines[ i ] );
+            hud->lines[ i ] = NULL;
+        }
+    }
+    hud->rect.w = hud->rect.h = 0;
+}
+
+inline void profile_hud_update( struct prof_hud *hud, const struct profiler *p, float fps, TTF_Font *font, SDL_Color color ) {
+    profile_hud_free( hud );
+    if( font == NULL ) {
+        return;
+    }
+    char text[ 64 ];
+    snprintf( text, sizeof( text ), "FPS %.1f   min / avg / p99 us", fps );
+    hud->lines[ 0 ] = TTF_RenderText_Blended( font, text, color );
+    for( int i = 0; i < PROF_NUM_PHASES; i++ ) {
+        struct prof_stats s = profile_stats( p, i );
+        snprintf( text, sizeof( text ), "%s: %u / %u / %u", PROF_PHASE_NAMES[ i ], s.min, s.avg, s.p99 );
+        hud->lines[ i + 1 ] = TTF_RenderText_Blended( font, text, color );
+    }
+    for( int i = 0; i <= PROF_NUM_PHASES; i++ ) {
+        if( hud->lines[ i ] ) {
+            hud->rect.w = std::max( (int)hud->rect.w, hud->lines[ i ]->w );
+            hud->rect.h += hud->lines[ i ]->h;
+        }
+    }
+}
+
+inline void profile_hud_draw( struct prof_hud *hud, SDL_Surface *screen ) {
+    int y = hud->rect.y;
+    for( int i = 0; i <= PROF_NUM_PHASES; i++ ) {
+        if( hud->lines[ i ] ) {
+            // blitting clips the offset rect, so it can't be reused
+            SDL_Rect offset = { hud->rect.x, (Sint16)y, 0, 0 };
+            SDL_BlitSurface( hud->lines[ i ], NULL, screen, &offset );
+            y += hud->lines[ i ]->h;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+// Recorded per-tick input, so the games can run headless and repeatably.
+//
+// File format is plain text, one run per line:
+//   <ticks> <keys>
+// where keys is any of L R U D C (left, right, up, down, ctrl) or - for
+// nothing held, e.g.
+//   60 -
+//   120 RC
+//   10 RUC
+
+#include <SDL/SDL.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+const int REPLAY_NUM_KEYS = 5;
+const SDLKey REPLAY_KEYS[ REPLAY_NUM_KEYS ] = { SDLK_LEFT, SDLK_RIGHT, SDLK_UP, SDLK_DOWN, SDLK_LCTRL };
+const char REPLAY_KEY_NAMES[ REPLAY_NUM_KEYS + 1 ] = "LRUDC";
+
+struct replay {
+    std::vector<Uint8> ticks; // one key mask per tick
+    unsigned int pos;
+    Uint8 keystates[ SDLK_LAST ]; // laid out like SDL_GetKeyState()
+};
+
+inline bool replay_load( struct replay *r, const char *filename ) {
+    FILE *f = fopen( filename, "r" );
+    if( f == NULL ) {
+        return false;
+    }
+    r->ticks.clear();
+    r->pos = 0;
+    int count;
+    char keys[ 16 ];
+    while( fscanf( f, "%d %15s", &count, keys ) == 2 ) {
+        Uint8 mask = 0;
+        for( int k = 0; k < REPLAY_NUM_KEYS; k++ ) {
+            if( strchr( keys, REPLAY_KEY_NAMES[ k ] ) ) {
+                mask |= 1 << k;
+            }
+        }
+        r->ticks.insert( r->ticks.end(), count, mask );
+    }
+    fclose( f );
+    return true;
+}
+
+// run-length encode the ticks back out in the same format
+inline bool replay_save( const struct replay *r, const char *filename ) {
+    FILE *f = fopen( filename, "w" );
+    if( f == NULL ) {
+        return false;
+    }
+    unsigned int i = 0;
+    while( i < r->ticks.size() ) {
+        unsigned int run = i;
+        while( run < r->ticks.size() && r->ticks[ run ] == r->ticks[ i ] ) {
+            run++;
+        }
+        fprintf( f, "%u ", run - i );
+        if( r->ticks[ i ] == 0 ) {
+            fputc( '-', f );
+        }
+        for( int k = 0; k < REPLAY_NUM_KEYS; k++ ) {
+            if( r->ticks[ i ] & ( 1 << k ) ) {
+                fputc( REPLAY_KEY_NAMES[ k ], f );
+            }
+        }
+        fputc( '\n', f );
+        i = run;
+    }
+    fclose( f );
+    return true;
+}
+
+// the keys we care about as one byte, and back
+inline Uint8 replay_key_mask( const Uint8 *keystates ) {
+    Uint8 mask = 0;
+    for( int k = 0; k < REPLAY_NUM_KEYS; k++ ) {
+        if( keystates[ REPLAY_KEYS[ k ] ] ) {
+            mask |= 1 << k;
+        }
+    }
+    return mask;
+}
+
+inline void replay_unmask( Uint8 mask, Uint8 *keystates ) {
+    memset( keystates, 0, SDLK_LAST );
+    for( int k = 0; k < REPLAY_NUM_KEYS; k++ ) {
+        if( mask & ( 1 << k ) ) {
+            keystates[ REPLAY_KEYS[ k ] ] = 1;
+        }
+    }
+}
+
+inline void replay_record( struct replay *r, const Uint8 *keystates ) {
+    r->ticks.push_back( replay_key_mask( keystates ) );
+}
+
+// advance one tick, returns NULL once the recording is used up
+inline Uint8 *replay_next( struct replay *r ) {
+    if( r->pos >= r->ticks.size() ) {
+        return NULL;
+    }
+    replay_unmask( r->ticks[ r->pos ], r->keystates );
+    r->pos++;
+    return r->keystates;
+}
+
+// FNV-1a, for fingerprinting the final simulation state
+inline Uint32 state_hash( Uint32 h, const void *data, size_t len ) {
+    const Uint8 *p = (const Uint8 *)data;
+    for( size_t i = 0; i < len; i++ ) {
+        h = ( h ^ p[ i ] ) * 16777619u;
+    }
+    return h;
+}
+const Uint32 STATE_HASH_INIT = 2166136261u;
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+// Handing the latest state from one thread to another.
+//
+// A triple buffer: the writer fills its back slot and publishes it, the
+// reader picks up whatever was published last. Three slots means neither
+// side ever waits on the other or sees a half written value; a reader
+// that falls behind just skips to the newest one.
+//
+//   struct snap *s = triple_back( &tb );   // writer
+//   ...fill *s...
+//   triple_publish( &tb );
+//
+//   triple_update( &tb );                  // reader
+//   const struct snap *s = triple_front( &tb );
+//
+// One writer thread and one reader thread only.
+
+#include <atomic>
+
+const int TRIPLE_FRESH = 4; // set in middle when it holds an unread slot
+
+template <typename T>
+struct triple_buffer {
+    T slots[ 3 ];
+    int back; // writer's
+    int front; // reader's
+    std::atomic<int> middle; // slot index, | TRIPLE_FRESH
+};
+
+template <typename T>
+inline void triple_init( struct triple_buffer<T> *tb ) {
+    tb->back = 0;
+    tb->middle.store( 1 );
+    tb->front = 2;
+}
+
+template <typename T>
+inline T *triple_back( struct triple_buffer<T> *tb ) {
+    return &tb->slots[ tb->back ];
+}
+
+template <typename T>
+inline void triple_publish( struct triple_buffer<T> *tb ) {
+    tb->back = tb->middle.exchange( tb->back | TRIPLE_FRESH, std::memory_order_acq_rel ) & 3;
+}
+
+// returns true if there was something newer to pick up
+template <typename T>
+inline bool triple_update( struct triple_buffer<T> *tb ) {
+    if( !( tb->middle.load( std::memory_order_relaxed ) & TRIPLE_FRESH ) ) {
+        return false;
+    }
+    tb->front = tb->middle.exchange( tb->front, std::memory_order_acq_rel ) & 3;
+    return true;
+}
+
+template <typename T>
+inline const T *triple_front( const struct triple_buffer<T> *tb ) {
+    return &tb->slots[ tb->front ];
+}
+
+#endif
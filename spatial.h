@@ -0,0 +1,173 @@
+#ifndef SPATIAL_H
+#define SPATIAL_H
+
+// Broadphase for things that move, a spatial hash over a uniform grid.
+//
+//   spatial_clear( &grid );
+//   spatial_insert( &grid, id, x0, y0, x1, y1 );  // for each, ids from 0
+//   spatial_build( &grid );
+//   spatial_pairs( &grid, &pairs );               // boxes that overlap
+//   spatial_query( &grid, x0, y0, x1, y1, &ids ); // boxes in a region
+//
+// Every box goes into each grid cell it overlaps and each cell into a
+// bucket by hash, so the grid needn't be bounded. It's rebuilt from
+// scratch with a counting sort each time, into flat arrays, which is
+// cheaper than keeping it up to date for things that all move anyway.
+//
+// A pair is only reported from the cell its overlap starts in, and a
+// query marks what it has already found, so nothing comes out twice.
+// With cells about the size of the boxes the cost is close to linear in
+// how many there are.
+
+#include <SDL/SDL.h>
+#include <math.h>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+struct spatial_entry {
+    int id;
+    int cx; // cell
+    int cy;
+};
+
+struct spatial_hash {
+    float cell_w;
+    float cell_h;
+    int mask; // buckets - 1
+    std::vector<int> starts; // first entry of each bucket, and one past the last
+    std::vector<struct spatial_entry> entries; // grouped by bucket
+    std::vector<struct spatial_entry> pending; // inserted since the clear
+    std::vector<float> boxes; // x0, y0, x1, y1 by id
+    std::vector<Uint32> seen; // by id, the last query that found it
+    Uint32 query;
+};
+
+inline void spatial_init( struct spatial_hash *h, float cell_w, float cell_h ) {
+    h->cell_w = cell_w;
+    h->cell_h = cell_h;
+    h->mask = 0;
+    h->query = 0;
+}
+
+inline void spatial_clear( struct spatial_hash *h ) {
+    h->pending.clear();
+    h->boxes.clear();
+}
+
+inline int spatial_cell( float c, float size ) {
+    return (int)floorf( c / size );
+}
+
+inline int spatial_bucket( const struct spatial_hash *h, int cx, int cy ) {
+    return ( (Uint32)cx * 73856093u ^ (Uint32)cy * 19349663u ) & h->mask;
+}
+
+inline void spatial_insert( struct spatial_hash *h, int id, float x0, float y0, float x1, float y1 ) {
+    if( (int)h->boxes.size() < ( id + 1 ) * 4 ) {
+        h->boxes.resize( ( id + 1 ) * 4 );
+    }
+    float *box = &h->boxes[ id * 4 ];
+    box[ 0 ] = x0;
+    box[ 1 ] = y0;
+    box[ 2 ] = x1;
+    box[ 3 ] = y1;
+    int cx1 = spatial_cell( x1, h->cell_w );
+    int cy1 = spatial_cell( y1, h->cell_h );
+    for( int cy = spatial_cell( y0, h->cell_h ); cy <= cy1; cy++ ) {
+        for( int cx = spatial_cell( x0, h->cell_w ); cx <= cx1; cx++ ) {
+            struct spatial_entry e = { id, cx, cy };
+            h->pending.push_back( e );
+        }
+    }
+}
+
+// sort what's been inserted into buckets, about two per entry
+inline void spatial_build( struct spatial_hash *h ) {
+    int buckets = 16;
+    while( buckets < (int)h->pending.size() * 2 ) {
+        buckets *= 2;
+    }
+    h->mask = buckets - 1;
+    h->starts.assign( buckets + 1, 0 );
+    for( unsigned int i = 0; i < h->pending.size(); i++ ) {
+        h->starts[ spatial_bucket( h, h->pending[ i ].cx, h->pending[ i ].cy ) + 1 ]++;
+    }
+    for( int b = 0; b < buckets; b++ ) {
+        h->starts[ b + 1 ] += h->starts[ b ];
+    }
+    h->entries.resize( h->pending.size() );
+    // starts[ b ] is used as the fill point, then put back
+    for( unsigned int i = 0; i < h->pending.size(); i++ ) {
+        h->entries[ h->starts[ spatial_bucket( h, h->pending[ i ].cx, h->pending[ i ].cy ) ]++ ] = h->pending[ i ];
+    }
+    for( int b = buckets; b > 0; b-- ) {
+        h->starts[ b ] = h->starts[ b - 1 ];
+    }
+    h->starts[ 0 ] = 0;
+    h->seen.resize( h->boxes.size() / 4 );
+}
+
+inline bool spatial_overlap( const float *a, const float *b ) {
+    return a[ 0 ] < b[ 2 ] && b[ 0 ] < a[ 2 ] && a[ 1 ] < b[ 3 ] && b[ 1 ] < a[ 3 ];
+}
+
+// every pair of boxes that overlap, once each, lower id first
+inline void spatial_pairs( const struct spatial_hash *h, std::vector<std::pair<int, int> > *out ) {
+    out->clear();
+    if( h->entries.empty() ) {
+        return;
+    }
+    for( int b = 0; b <= h->mask; b++ ) {
+        for( int i = h->starts[ b ]; i < h->starts[ b + 1 ]; i++ ) {
+            const struct spatial_entry *e = &h->entries[ i ];
+            const float *a = &h->boxes[ e->id * 4 ];
+            for( int j = i + 1; j < h->starts[ b + 1 ]; j++ ) {
+                const struct spatial_entry *f = &h->entries[ j ];
+                // other cells can share the bucket
+                if( f->cx != e->cx || f->cy != e->cy ) {
+                    continue;
+                }
+                const float *o = &h->boxes[ f->id * 4 ];
+                if(
+                    !spatial_overlap( a, o ) ||
+                    spatial_cell( std::max( a[ 0 ], o[ 0 ] ), h->cell_w ) != e->cx ||
+                    spatial_cell( std::max( a[ 1 ], o[ 1 ] ), h->cell_h ) != e->cy
+                ) {
+                    continue;
+                }
+                out->push_back( std::make_pair( std::min( e->id, f->id ), std::max( e->id, f->id ) ) );
+            }
+        }
+    }
+}
+
+// ids of the boxes overlapping a region, once each
+inline void spatial_query( struct spatial_hash *h, float x0, float y0, float x1, float y1, std::vector<int> *out ) {
+    out->clear();
+    if( h->entries.empty() ) {
+        return;
+    }
+    h->query++;
+    float region[ 4 ] = { x0, y0, x1, y1 };
+    int cx1 = spatial_cell( x1, h->cell_w );
+    int cy1 = spatial_cell( y1, h->cell_h );
+    for( int cy = spatial_cell( y0, h->cell_h ); cy <= cy1; cy++ ) {
+        for( int cx = spatial_cell( x0, h->cell_w ); cx <= cx1; cx++ ) {
+            int b = spatial_bucket( h, cx, cy );
+            for( int i = h->starts[ b ]; i < h->starts[ b + 1 ]; i++ ) {
+                const struct spatial_entry *e = &h->entries[ i ];
+                if(
+                    e->cx != cx || e->cy != cy || h->seen[ e->id ] == h->query ||
+                    !spatial_overlap( &h->boxes[ e->id * 4 ], region )
+                ) {
+                    continue;
+                }
+                h->seen[ e->id ] = h->query;
+                out->push_back( e->id );
+            }
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,259 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Binary trace log, a cheaper printf_debug.
+//
+//   TRACE( TRACE_DEBUG, TRACE_COLLIDE, "hit %i %i at %f", col, row, t );
+//
+// Anything below TRACE_MIN_LEVEL or outside the TRACE_CATEGORIES mask is
+// compiled out, arguments and all. What's left copies the format string's
+// address and up to TRACE_MAX_ARGS numeric arguments into a fixed size
+// record in a ring owned by the calling thread; no formatting, locking or
+// I/O on the hot path. A background thread drains the rings into the trace
+// file and tracedump turns that back into text. Only numbers are captured,
+// so don't pass %s arguments.
+//
+// Override the filter with e.g. -DTRACE_MIN_LEVEL=TRACE_DEBUG or
+// -DTRACE_CATEGORIES="(1<<TRACE_COLLIDE)".
+
+#include <SDL/SDL.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <set>
+#include <vector>
+
+enum { TRACE_DEBUG, TRACE_INFO, TRACE_WARN, TRACE_ERROR, TRACE_NUM_LEVELS };
+enum { TRACE_GENERAL, TRACE_MAP, TRACE_COLLIDE, TRACE_PHYSICS, TRACE_CONTACT, TRACE_INPUT, TRACE_RENDER, TRACE_NUM_CATEGORIES };
+
+const char *const TRACE_LEVEL_NAMES[ TRACE_NUM_LEVELS ] = { "debug", "info", "warn", "error" };
+const char *const TRACE_CATEGORY_NAMES[ TRACE_NUM_CATEGORIES ] = { "general", "map", "collide", "physics", "contact", "input", "render" };
+
+#ifndef TRACE_MIN_LEVEL
+#ifdef DEBUG
+#define TRACE_MIN_LEVEL TRACE_INFO
+#else
+#define TRACE_MIN_LEVEL TRACE_WARN
+#endif
+#endif
+
+#ifndef TRACE_CATEGORIES
+#define TRACE_CATEGORIES 0xffffffffu
+#endif
+
+#define TRACE( level, category, ... ) do { \
+    if( (level) >= TRACE_MIN_LEVEL && ( ( 1u << (category) ) & (TRACE_CATEGORIES) ) ) { \
+        trace_emit( (level), (category), __VA_ARGS__ ); \
+    } \
+} while( 0 )
+
+const int TRACE_MAX_ARGS = 4;
+const Uint32 TRACE_RING_SIZE = 4096; // records per thread, power of two
+const int TRACE_FLUSH_MS = 10;
+
+// also the on-disk layout, fmt is the format string's address and is
+// resolved through the 'F' chunk written before its first use
+struct trace_record {
+    Uint64 time_us;
+    Uint64 fmt;
+    Uint64 args[ TRACE_MAX_ARGS ]; // raw bits, ints widened to 64, floats to double
+    Uint32 thread;
+    Uint8 level;
+    Uint8 category;
+    Uint8 nargs;
+    Uint8 pad;
+};
+
+const char TRACE_MAGIC[ 8 ] = { 'N', 'J', 'T', 'R', 'A', 'C', 'E', '1' };
+// chunk tags in the file after the magic
+const Uint8 TRACE_CHUNK_FORMAT = 'F'; // Uint64 fmt, Uint32 len, len chars
+const Uint8 TRACE_CHUNK_RECORD = 'R'; // struct trace_record
+const Uint8 TRACE_CHUNK_DROPPED = 'D'; // Uint32 thread, Uint32 records lost to a full ring
+
+// single producer (the owning thread), single consumer (the writer)
+struct trace_ring {
+    struct trace_record records[ TRACE_RING_SIZE ];
+    std::atomic<Uint32> head;
+    std::atomic<Uint32> tail;
+    std::atomic<Uint32> dropped;
+    Uint32 thread;
+};
+
+struct trace_state {
+    std::atomic<bool> enabled;
+    std::atomic<bool> running;
+    std::atomic<int> emitting; // threads part way through a trace_emit
+    Uint32 generation; // trace_start()s so far, rings from before are gone
+    FILE *file;
+    SDL_Thread *writer;
+    SDL_mutex *lock; // guards rings
+    std::vector<struct trace_ring *> rings;
+    std::set<Uint64> formats_written;
+};
+
+inline struct trace_state *trace_get_state() {
+    static struct trace_state state;
+    return &state;
+}
+
+inline struct trace_ring *trace_thread_ring() {
+    static __thread struct trace_ring *ring = NULL;
+    static __thread Uint32 generation = 0;
+    struct trace_state *state = trace_get_state();
+    if( ring == NULL || generation != state->generation ) {
+        generation = state->generation;
+        ring = new trace_ring;
+        ring->head = 0;
+        ring->tail = 0;
+        ring->dropped = 0;
+        ring->thread = SDL_ThreadID();
+        SDL_mutexP( state->lock );
+        state->rings.push_back( ring );
+        SDL_mutexV( state->lock );
+    }
+    return ring;
+}
+
+inline Uint64 trace_bits( int v ) { return (Uint64)(Sint64)v; }
+inline Uint64 trace_bits( long v ) { return (Uint64)(Sint64)v; }
+inline Uint64 trace_bits( long long v ) { return (Uint64)v; }
+inline Uint64 trace_bits( unsigned int v ) { return v; }
+inline Uint64 trace_bits( unsigned long v ) { return v; }
+inline Uint64 trace_bits( unsigned long long v ) { return v; }
+inline Uint64 trace_bits( const void *v ) { return (Uint64)(size_t)v; }
+inline Uint64 trace_bits( double v ) {
+    Uint64 bits;
+    memcpy( &bits, &v, sizeof( bits ) );
+    return bits;
+}
+
+inline void trace_pack( struct trace_record * ) {
+}
+template <typename T, typename... Rest>
+inline void trace_pack( struct trace_record *r, T first, Rest... rest ) {
+    if( r->nargs < TRACE_MAX_ARGS ) {
+        r->args[ r->nargs++ ] = trace_bits( first );
+    }
+    trace_pack( r, rest... );
+}
+
+template <typename... Args>
+inline void trace_emit( int level, int category, const char *fmt, Args... args ) {
+    struct trace_state *state = trace_get_state();
+    if( !state->enabled.load( std::memory_order_relaxed ) ) {
+        return;
+    }
+    // trace_stop() waits for anyone counted here before freeing the rings,
+    // so check again once counted
+    state->emitting.fetch_add( 1 );
+    if( !state->enabled.load() ) {
+        state->emitting.fetch_sub( 1 );
+        return;
+    }
+    struct trace_ring *ring = trace_thread_ring();
+    Uint32 head = ring->head.load( std::memory_order_relaxed );
+    if( head - ring->tail.load( std::memory_order_acquire ) >= TRACE_RING_SIZE ) {
+        // never block the game, the writer reports how many went missing
+        ring->dropped.fetch_add( 1, std::memory_order_relaxed );
+        state->emitting.fetch_sub( 1 );
+        return;
+    }
+    struct trace_record *r = &ring->records[ head & ( TRACE_RING_SIZE - 1 ) ];
+    struct timeval tv;
+    gettimeofday( &tv, NULL );
+    r->time_us = (Uint64)tv.tv_sec * 1000000 + tv.tv_usec;
+    r->fmt = (Uint64)(size_t)fmt;
+    r->thread = ring->thread;
+    r->level = level;
+    r->category = category;
+    r->nargs = 0;
+    r->pad = 0;
+    trace_pack( r, args... );
+    ring->head.store( head + 1, std::memory_order_release );
+    state->emitting.fetch_sub( 1 );
+}
+
+// writer side, copy everything queued so far out to the file
+inline void trace_drain( struct trace_state *state ) {
+    SDL_mutexP( state->lock );
+    for( unsigned int i = 0; i < state->rings.size(); i++ ) {
+        struct trace_ring *ring = state->rings[ i ];
+        Uint32 tail = ring->tail.load( std::memory_order_relaxed );
+        Uint32 head = ring->head.load( std::memory_order_acquire );
+        for( ; tail != head; tail++ ) {
+            const struct trace_record *r = &ring->records[ tail & ( TRACE_RING_SIZE - 1 ) ];
+            if( state->formats_written.insert( r->fmt ).second ) {
+                const char *fmt = (const char *)(size_t)r->fmt;
+                Uint32 len = strlen( fmt );
+                fputc( TRACE_CHUNK_FORMAT, state->file );
+                fwrite( &r->fmt, sizeof( r->fmt ), 1, state->file );
+                fwrite( &len, sizeof( len ), 1, state->file );
+                fwrite( fmt, 1, len, state->file );
+            }
+            fputc( TRACE_CHUNK_RECORD, state->file );
+            fwrite( r, sizeof( *r ), 1, state->file );
+        }
+        ring->tail.store( tail, std::memory_order_release );
+        Uint32 dropped = ring->dropped.exchange( 0 );
+        if( dropped ) {
+            fputc( TRACE_CHUNK_DROPPED, state->file );
+            fwrite( &ring->thread, sizeof( ring->thread ), 1, state->file );
+            fwrite( &dropped, sizeof( dropped ), 1, state->file );
+        }
+    }
+    SDL_mutexV( state->lock );
+    fflush( state->file );
+}
+
+inline int trace_writer( void *data ) {
+    struct trace_state *state = (struct trace_state *)data;
+    while( state->running ) {
+        trace_drain( state );
+        SDL_Delay( TRACE_FLUSH_MS );
+    }
+    return 0;
+}
+
+inline bool trace_start( const char *filename ) {
+    struct trace_state *state = trace_get_state();
+    state->file = fopen( filename, "wb" );
+    if( state->file == NULL ) {
+        return false;
+    }
+    fwrite( TRACE_MAGIC, sizeof( TRACE_MAGIC ), 1, state->file );
+    state->lock = SDL_CreateMutex();
+    state->emitting = 0;
+    state->generation++;
+    state->running = true;
+    state->enabled = true;
+    state->writer = SDL_CreateThread( trace_writer, state );
+    return true;
+}
+
+inline void trace_stop() {
+    struct trace_state *state = trace_get_state();
+    if( !state->enabled ) {
+        return;
+    }
+    state->enabled = false;
+    // let any emit already past the check finish its record
+    while( state->emitting.load() > 0 ) {
+        SDL_Delay( 0 );
+    }
+    state->running = false;
+    SDL_WaitThread( state->writer, NULL );
+    trace_drain( state );
+    fclose( state->file );
+    state->file = NULL;
+    // each thread makes a new ring if tracing starts again
+    for( unsigned int i = 0; i < state->rings.size(); i++ ) {
+        delete state->rings[ i ];
+    }
+    state->rings.clear();
+    state->formats_written.clear();
+    SDL_DestroyMutex( state->lock );
+    state->lock = NULL;
+}
+
+#endif
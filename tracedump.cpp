@@ -0,0 +1,147 @@
+// tracedump - print a binary trace written by trace.h as text
+//
+//   ./tracedump ninja.trace
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#include "trace.h"
+
+bool record_before( const struct trace_record &a, const struct trace_record &b ) {
+    return a.time_us < b.time_us;
+}
+
+// expand fmt against the recorded raw argument bits, every conversion
+// gets re-issued with a 64 bit length to match how trace.h stored it
+std::string format_record( const std::string &fmt, const struct trace_record &r ) {
+    std::string out;
+    char buf[ 128 ];
+    int arg = 0;
+    for( unsigned int i = 0; i < fmt.size(); i++ ) {
+        if( fmt[ i ] != '%' ) {
+            out += fmt[ i ];
+            continue;
+        }
+        if( i + 1 < fmt.size() && fmt[ i + 1 ] == '%' ) {
+            out += '%';
+            i++;
+            continue;
+        }
+        // flags, width and precision carry over, length modifiers don't
+        std::string spec = "%";
+        unsigned int j = i + 1;
+        while( j < fmt.size() && strchr( "-+ #0123456789.*", fmt[ j ] ) ) {
+            spec += fmt[ j++ ];
+        }
+        while( j < fmt.size() && strchr( "hlLqjzt", fmt[ j ] ) ) {
+            j++;
+        }
+        if( j >= fmt.size() ) {
+            break;
+        }
+        char conv = fmt[ j ];
+        i = j;
+        if( arg >= r.nargs ) {
+            out += "<?>";
+            continue;
+        }
+        Uint64 bits = r.args[ arg++ ];
+        if( strchr( "di", conv ) ) {
+            snprintf( buf, sizeof( buf ), ( spec + "lld" ).c_str(), (long long)bits );
+        } else if( strchr( "ouxX", conv ) ) {
+            snprintf( buf, sizeof( buf ), ( spec + "ll" + conv ).c_str(), (unsigned long long)bits );
+        } else if( strchr( "eEfFgG", conv ) ) {
+            double d;
+            memcpy( &d, &bits, sizeof( d ) );
+            snprintf( buf, sizeof( buf ), ( spec + conv ).c_str(), d );
+        } else if( conv == 'c' ) {
+            snprintf( buf, sizeof( buf ), ( spec + "c" ).c_str(), (int)bits );
+        } else if( conv == 'p' ) {
+            snprintf( buf, sizeof( buf ), "%p", (void *)(size_t)bits );
+        } else {
+            snprintf( buf, sizeof( buf ), "<%%%c?>", conv );
+        }
+        out += buf;
+    }
+    // trailing newlines are the dumper's job
+    while( !out.empty() && out[ out.size() - 1 ] == '\n' ) {
+        out.erase( out.size() - 1 );
+    }
+    return out;
+}
+
+int main( int argc, char **argv ) {
+    if( argc < 2 ) {
+        fprintf( stderr, "usage: %s <trace file>\n", argv[ 0 ] );
+        return 1;
+    }
+    FILE *f = fopen( argv[ 1 ], "rb" );
+    if( f == NULL ) {
+        fprintf( stderr, "can't open %s\n", argv[ 1 ] );
+        return 1;
+    }
+    char magic[ sizeof( TRACE_MAGIC ) ];
+    if( fread( magic, sizeof( magic ), 1, f ) != 1 || memcmp( magic, TRACE_MAGIC, sizeof( magic ) ) != 0 ) {
+        fprintf( stderr, "%s is not a trace file\n", argv[ 1 ] );
+        return 1;
+    }
+
+    std::map<Uint64, std::string> formats;
+    std::vector<struct trace_record> records;
+    Uint64 dropped = 0;
+    int tag;
+    while( ( tag = fgetc( f ) ) != EOF ) {
+        if( tag == TRACE_CHUNK_FORMAT ) {
+            Uint64 id;
+            Uint32 len;
+            if( fread( &id, sizeof( id ), 1, f ) != 1 || fread( &len, sizeof( len ), 1, f ) != 1 ) {
+                break;
+            }
+            std::string fmt( len, ' ' );
+            if( len && fread( &fmt[ 0 ], 1, len, f ) != len ) {
+                break;
+            }
+            formats[ id ] = fmt;
+        } else if( tag == TRACE_CHUNK_RECORD ) {
+            struct trace_record r;
+            if( fread( &r, sizeof( r ), 1, f ) != 1 ) {
+                break;
+            }
+            records.push_back( r );
+        } else if( tag == TRACE_CHUNK_DROPPED ) {
+            Uint32 thread;
+            Uint32 count;
+            if( fread( &thread, sizeof( thread ), 1, f ) != 1 || fread( &count, sizeof( count ), 1, f ) != 1 ) {
+                break;
+            }
+            dropped += count;
+        } else {
+            fprintf( stderr, "bad chunk '%c', stopping\n", tag );
+            break;
+        }
+    }
+    fclose( f );
+
+    // each thread's ring is drained in turn, so put them back in time order
+    std::stable_sort( records.begin(), records.end(), record_before );
+    Uint64 start = records.empty() ? 0 : records[ 0 ].time_us;
+    for( unsigned int i = 0; i < records.size(); i++ ) {
+        const struct trace_record &r = records[ i ];
+        printf(
+            "%12.3f %08x %-5s %-8s %s\n",
+            ( r.time_us - start ) / 1000.0,
+            r.thread,
+            r.level < TRACE_NUM_LEVELS ? TRACE_LEVEL_NAMES[ r.level ] : "?",
+            r.category < TRACE_NUM_CATEGORIES ? TRACE_CATEGORY_NAMES[ r.category ] : "?",
+            format_record( formats[ r.fmt ], r ).c_str()
+        );
+    }
+    if( dropped ) {
+        printf( "%llu records dropped\n", (unsigned long long)dropped );
+    }
+    return 0;
+}
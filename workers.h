@@ -0,0 +1,169 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+// A small pool of threads for splitting a batch of independent jobs.
+//
+//   struct worker_pool pool;
+//   workers_start( &pool );
+//   workers_run( &pool, count, bake_one, &args );  // bake_one( &args, 0..count-1 )
+//   workers_stop( &pool );
+//
+// workers_run() hands out job indexes to whoever is free, the calling
+// thread included, and returns once every job has finished. With no
+// threads (one core, or they couldn't be made) it just runs them all in
+// order on the caller.
+
+#include <SDL/SDL.h>
+#include <SDL/SDL_thread.h>
+#include <unistd.h>
+#include <atomic>
+#include <algorithm>
+
+const int WORKERS_MAX = 16;
+
+typedef void (*worker_job)( void *data, int index );
+
+struct worker_pool {
+    int num_threads;
+    SDL_Thread *threads[ WORKERS_MAX ];
+    SDL_mutex *lock;
+    SDL_cond *wake; // a batch was posted, or quit
+    SDL_cond *done; // the batch finished
+    // the current batch, under lock apart from next
+    worker_job job;
+    void *data;
+    int count;
+    int finished;
+    int active; // threads working on it
+    int batch; // bumped for each new one
+    bool quit;
+    std::atomic<int> next; // next job index to hand out
+};
+
+// run jobs from the current batch until there are none left, returns how
+// many this thread did
+inline int workers_drain( struct worker_pool *pool, worker_job job, void *data, int count ) {
+    int done = 0;
+    for( int i = pool->next++; i < count; i = pool->next++ ) {
+        job( data, i );
+        done++;
+    }
+    return done;
+}
+
+inline void workers_finish( struct worker_pool *pool, int done ) {
+    SDL_mutexP( pool->lock );
+    pool->finished += done;
+    pool->active--;
+    if( pool->finished >= pool->count && pool->active == 0 ) {
+        SDL_CondSignal( pool->done );
+    }
+    SDL_mutexV( pool->lock );
+}
+
+inline int workers_main( void *arg ) {
+    struct worker_pool *pool = (struct worker_pool *)arg;
+    int seen = 0;
+    for( ;; ) {
+        SDL_mutexP( pool->lock );
+        while( pool->batch == seen && !pool->quit ) {
+            SDL_CondWait( pool->wake, pool->lock );
+        }
+        if( pool->quit ) {
+            SDL_mutexV( pool->lock );
+            return 0;
+        }
+        seen = pool->batch;
+        if( pool->finished >= pool->count ) {
+            // woke too late, the others got through it
+            SDL_mutexV( pool->lock );
+            continue;
+        }
+        pool->active++;
+        worker_job job = pool->job;
+        void *data = pool->data;
+        int count = pool->count;
+        SDL_mutexV( pool->lock );
+        workers_finish( pool, workers_drain( pool, job, data, count ) );
+    }
+}
+
+// one thread per core besides the caller's
+inline void workers_start( struct worker_pool *pool ) {
+    long cores = sysconf( _SC_NPROCESSORS_ONLN );
+    pool->num_threads = 0;
+    pool->lock = SDL_CreateMutex();
+    pool->wake = SDL_CreateCond();
+    pool->done = SDL_CreateCond();
+    pool->job = NULL;
+    pool->data = NULL;
+    pool->count = 0;
+    pool->finished = 0;
+    pool->active = 0;
+    pool->batch = 0;
+    pool->quit = false;
+    pool->next.store( 0 );
+    if( pool->lock == NULL || pool->wake == NULL || pool->done == NULL ) {
+        return;
+    }
+    int wanted = std::min( (long)WORKERS_MAX, std::max( cores - 1, 0L ) );
+    for( int i = 0; i < wanted; i++ ) {
+        SDL_Thread *t = SDL_CreateThread( workers_main, pool );
+        if( t == NULL ) {
+            break;
+        }
+        pool->threads[ pool->num_threads++ ] = t;
+    }
+}
+
+inline void workers_stop( struct worker_pool *pool ) {
+    if( pool->lock ) {
+        SDL_mutexP( pool->lock );
+        pool->quit = true;
+        SDL_CondBroadcast( pool->wake );
+        SDL_mutexV( pool->lock );
+    }
+    for( int i = 0; i < pool->num_threads; i++ ) {
+        SDL_WaitThread( pool->threads[ i ], NULL );
+    }
+    pool->num_threads = 0;
+    if( pool->done ) {
+        SDL_DestroyCond( pool->done );
+    }
+    if( pool->wake ) {
+        SDL_DestroyCond( pool->wake );
+    }
+    if( pool->lock ) {
+        SDL_DestroyMutex( pool->lock );
+    }
+}
+
+inline void workers_run( struct worker_pool *pool, int count, worker_job job, void *data ) {
+    if( pool->num_threads == 0 || count <= 1 ) {
+        for( int i = 0; i < count; i++ ) {
+            job( data, i );
+        }
+        return;
+    }
+    SDL_mutexP( pool->lock );
+    pool->job = job;
+    pool->data = data;
+    pool->count = count;
+    pool->finished = 0;
+    pool->next.store( 0 );
+    pool->batch++;
+    SDL_CondBroadcast( pool->wake );
+    SDL_mutexV( pool->lock );
+
+    int done = workers_drain( pool, job, data, count );
+    SDL_mutexP( pool->lock );
+    pool->finished += done;
+    // wait for stragglers too, so none of them is still holding this
+    // batch's job when the next one resets the counter
+    while( pool->finished < count || pool->active > 0 ) {
+        SDL_CondWait( pool->done, pool->lock );
+    }
+    SDL_mutexV( pool->lock );
+}
+
+#endif